@@ -13,6 +13,7 @@ mkdir -p build
 CXX=g++
 CPPFLAGS="--std=c++14 -Wall -Wpedantic -Wno-gnu-zero-variadic-macro-arguments -g -DNDEBUG"
 CPPFLAGS="$CPPFLAGS -O2"
+# CPPFLAGS="$CPPFLAGS -DFIELD_INTERPOLATION_64BIT_INDEX=1" # For more than 2^31 unknowns or non-zeros
 COMPILE_FLAGS="$CPPFLAGS -I libs -I libs/emilib -I libs/visit_struct/include"
 LDLIBS="-lstdc++ -lpthread -ldl"
 LDLIBS="$LDLIBS -lSDL2 -lGLEW"
@@ -0,0 +1,268 @@
+#include "amg.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include <Eigen/SparseCholesky>
+
+#include <loguru.hpp>
+
+#include "parallel.hpp"
+
+namespace {
+
+/// Unknowns per parallel chunk of a matrix-vector product.
+const size_t kUnknownsPerChunk = 4096;
+
+/// A·x for a symmetric A: column j of A is then also row j, so each output element is written by one chunk.
+VectorXr multiply_symmetric(const SparseMatrix& A, const VectorXr& x)
+{
+	VectorXr out(A.cols());
+	parallel_for_chunks(A.cols(), (A.cols() + kUnknownsPerChunk - 1) / kUnknownsPerChunk, [&](size_t, size_t begin, size_t end) {
+		for (size_t col = begin; col < end; ++col) {
+			float sum = 0;
+			for (SparseMatrix::InnerIterator it(A, col); it; ++it) {
+				sum += it.value() * x[it.row()];
+			}
+			out[col] = sum;
+		}
+	});
+	return out;
+}
+
+/// Estimate the largest eigenvalue of D⁻¹·A using power iteration.
+float max_eigenvalue(const SparseMatrix& A, const VectorXr& inv_diagonal)
+{
+	std::default_random_engine rng(0);
+	std::uniform_real_distribution<float> random(0, 1);
+	VectorXr v(A.cols());
+	for (Index i = 0; i < v.size(); ++i) {
+		v[i] = random(rng);
+	}
+	float eigenvalue = 1;
+	for (int iteration = 0; iteration < 10; ++iteration) {
+		const float norm = v.norm();
+		if (norm == 0) { break; }
+		v = inv_diagonal.cwiseProduct(multiply_symmetric(A, v / norm));
+		eigenvalue = v.norm();
+	}
+	return 1.1f * eigenvalue; // Power iteration approaches from below.
+}
+
+/// Group strongly connected unknowns into aggregates, using the three passes of Vaněk et al:
+///   1. Unknowns whose strong neighbors are all free form a new aggregate with them.
+///   2. Left-over unknowns join the aggregate of their strongest aggregated neighbor.
+///   3. Whatever is left forms aggregates with its free strong neighbors (or alone).
+/// Returns the aggregate of each unknown.
+std::vector<Index> aggregate(const SparseMatrix& A, const VectorXr& diagonal, float threshold, Index* out_num_aggregates)
+{
+	const Index n = A.cols();
+	const auto strength = [&](Index i, const SparseMatrix::InnerIterator& it) -> float {
+		const Index j = it.row();
+		if (i == j) { return 0; }
+		const float a_ij = std::abs(it.value());
+		return a_ij >= threshold * std::sqrt(std::abs(diagonal[i] * diagonal[j])) ? a_ij : 0;
+	};
+
+	std::vector<Index> aggregates(n, -1);
+	Index num_aggregates = 0;
+
+	for (Index i = 0; i < n; ++i) {
+		if (aggregates[i] >= 0) { continue; }
+		bool any_strong = false;
+		bool all_free = true;
+		for (SparseMatrix::InnerIterator it(A, i); it; ++it) {
+			if (strength(i, it) > 0) {
+				any_strong = true;
+				all_free &= aggregates[it.row()] < 0;
+			}
+		}
+		if (!any_strong || !all_free) { continue; }
+		aggregates[i] = num_aggregates;
+		for (SparseMatrix::InnerIterator it(A, i); it; ++it) {
+			if (strength(i, it) > 0) {
+				aggregates[it.row()] = num_aggregates;
+			}
+		}
+		num_aggregates += 1;
+	}
+
+	const std::vector<Index> after_first_pass = aggregates;
+	for (Index i = 0; i < n; ++i) {
+		if (aggregates[i] >= 0) { continue; }
+		float best_strength = 0;
+		for (SparseMatrix::InnerIterator it(A, i); it; ++it) {
+			const float s = strength(i, it);
+			if (s > best_strength && after_first_pass[it.row()] >= 0) {
+				best_strength = s;
+				aggregates[i] = after_first_pass[it.row()];
+			}
+		}
+	}
+
+	for (Index i = 0; i < n; ++i) {
+		if (aggregates[i] >= 0) { continue; }
+		aggregates[i] = num_aggregates;
+		for (SparseMatrix::InnerIterator it(A, i); it; ++it) {
+			if (strength(i, it) > 0 && aggregates[it.row()] < 0) {
+				aggregates[it.row()] = num_aggregates;
+			}
+		}
+		num_aggregates += 1;
+	}
+
+	*out_num_aggregates = num_aggregates;
+	return aggregates;
+}
+
+/// The tentative prolongator: piecewise constant over each aggregate, with orthonormal columns.
+SparseMatrix tentative_prolongator(const std::vector<Index>& aggregates, Index num_aggregates)
+{
+	std::vector<int> aggregate_sizes(num_aggregates, 0);
+	for (const Index aggregate : aggregates) {
+		aggregate_sizes[aggregate] += 1;
+	}
+	std::vector<Eigen::Triplet<float, Index>> triplets;
+	triplets.reserve(aggregates.size());
+	for (size_t i = 0; i < aggregates.size(); ++i) {
+		triplets.emplace_back(i, aggregates[i], 1 / std::sqrt(static_cast<float>(aggregate_sizes[aggregates[i]])));
+	}
+	SparseMatrix P(aggregates.size(), num_aggregates);
+	P.setFromTriplets(triplets.begin(), triplets.end());
+	return P;
+}
+
+} // namespace
+
+struct AmgPreconditioner::Hierarchy
+{
+	struct Level
+	{
+		SparseMatrix       A;
+		VectorXr           inv_diagonal;
+		float              jacobi_weight = 0; ///< Damping of the Jacobi smoother.
+		std::vector<Index> aggregates;        ///< Empty for the coarsest level.
+		SparseMatrix       P;                 ///< Prolongation from the next coarser level.
+		SparseMatrix       R;                 ///< Restriction to the next coarser level: Pᵀ
+	};
+
+	std::vector<Level>                  levels;
+	Eigen::SimplicialLDLT<SparseMatrix> coarse_solver;
+};
+
+AmgPreconditioner::AmgPreconditioner(const AmgOptions& options) : _options(options) {}
+AmgPreconditioner::~AmgPreconditioner() = default;
+AmgPreconditioner::AmgPreconditioner(AmgPreconditioner&&) = default;
+AmgPreconditioner& AmgPreconditioner::operator=(AmgPreconditioner&&) = default;
+
+int AmgPreconditioner::num_levels() const
+{
+	return _hierarchy ? _hierarchy->levels.size() : 0;
+}
+
+std::vector<Index> AmgPreconditioner::level_sizes() const
+{
+	std::vector<Index> sizes;
+	for (int i = 0; i < num_levels(); ++i) {
+		sizes.push_back(_hierarchy->levels[i].A.cols());
+	}
+	return sizes;
+}
+
+void AmgPreconditioner::setup(SparseMatrix A, bool reuse_aggregates)
+{
+	LOG_SCOPE_F(INFO, "AMG setup");
+	CHECK_EQ_F(A.rows(), A.cols());
+
+	std::unique_ptr<Hierarchy> old_hierarchy = std::move(_hierarchy);
+	if (!old_hierarchy || old_hierarchy->levels.empty() || old_hierarchy->levels[0].A.cols() != A.cols()) {
+		reuse_aggregates = false;
+	}
+
+	_hierarchy.reset(new Hierarchy{});
+	auto& levels = _hierarchy->levels;
+	A.makeCompressed();
+
+	for (size_t level_index = 0; ; ++level_index) {
+		levels.emplace_back();
+		auto& level = levels.back();
+		level.A = std::move(A);
+
+		const VectorXr diagonal = level.A.diagonal();
+		level.inv_diagonal.resize(diagonal.size());
+		for (Index i = 0; i < diagonal.size(); ++i) {
+			level.inv_diagonal[i] = diagonal[i] != 0 ? 1 / diagonal[i] : 0;
+		}
+		level.jacobi_weight = (4.0f / 3.0f) / max_eigenvalue(level.A, level.inv_diagonal);
+
+		const Index num_unknowns = level.A.cols();
+		if (num_unknowns <= _options.max_coarse_size || level_index + 1 >= _options.max_levels) { break; }
+
+		Index num_aggregates = 0;
+		if (reuse_aggregates && level_index < old_hierarchy->levels.size() && !old_hierarchy->levels[level_index].aggregates.empty()) {
+			level.aggregates = std::move(old_hierarchy->levels[level_index].aggregates);
+			num_aggregates = *std::max_element(level.aggregates.begin(), level.aggregates.end()) + 1;
+		} else if (reuse_aggregates) {
+			break; // The old hierarchy stopped here.
+		} else {
+			level.aggregates = aggregate(level.A, diagonal, _options.strength_threshold, &num_aggregates);
+		}
+
+		if (num_aggregates * 10 > num_unknowns * 9) {
+			LOG_F(1, "Coarsening stalled at %ld unknowns", static_cast<long>(num_unknowns));
+			level.aggregates.clear();
+			break;
+		}
+
+		// Smooth the tentative prolongator with one damped Jacobi step: P = (I - ω·D⁻¹·A)·P̂
+		const SparseMatrix P_tentative = tentative_prolongator(level.aggregates, num_aggregates);
+		const SparseMatrix AP_tentative = level.A * P_tentative;
+		level.P = P_tentative - SparseMatrix((level.jacobi_weight * level.inv_diagonal).asDiagonal() * AP_tentative);
+		level.R = level.P.transpose();
+
+		const SparseMatrix AP = level.A * level.P;
+		A = level.R * AP;
+		A.makeCompressed();
+	}
+
+	const SparseMatrix& coarsest = levels.back().A;
+	_hierarchy->coarse_solver.compute(coarsest);
+	_info = _hierarchy->coarse_solver.info();
+	LOG_IF_F(WARNING, _info != Eigen::Success, "AMG coarse factorization failed");
+
+	for (size_t i = 0; i < levels.size(); ++i) {
+		LOG_F(1, "AMG level %lu: %ld unknowns, %ld non-zeros", i,
+		      static_cast<long>(levels[i].A.cols()), static_cast<long>(levels[i].A.nonZeros()));
+	}
+}
+
+VectorXr AmgPreconditioner::v_cycle(size_t level_index, const VectorXr& b) const
+{
+	CHECK_NOTNULL_F(_hierarchy.get(), "AmgPreconditioner not initialized");
+	const auto& level = _hierarchy->levels[level_index];
+
+	if (level_index + 1 == _hierarchy->levels.size()) {
+		return _hierarchy->coarse_solver.solve(b);
+	}
+
+	const auto smooth = [&](VectorXr* x) {
+		const VectorXr residual = b - multiply_symmetric(level.A, *x);
+		*x += level.jacobi_weight * level.inv_diagonal.cwiseProduct(residual);
+	};
+
+	// Pre-smoothing from zero, coarse correction, and post-smoothing. Symmetric, as CG requires.
+	VectorXr x = VectorXr::Zero(b.size());
+	for (int step = 0; step < _options.smoothing_steps; ++step) {
+		smooth(&x);
+	}
+
+	const VectorXr residual = b - multiply_symmetric(level.A, x);
+	const VectorXr residual_coarse = level.R * residual;
+	x += level.P * v_cycle(level_index + 1, residual_coarse);
+
+	for (int step = 0; step < _options.smoothing_steps; ++step) {
+		smooth(&x);
+	}
+	return x;
+}
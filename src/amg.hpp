@@ -0,0 +1,101 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "sparse_linear.hpp"
+
+struct AmgOptions
+{
+	/// j is a strong neighbor of i if |a_ij| >= strength_threshold * sqrt(a_ii * a_jj).
+	/// Only strong neighbors are aggregated together.
+	float strength_threshold = 0.08f;
+	int   max_coarse_size    = 1000; ///< Stop coarsening below this many unknowns, and solve that level directly.
+	int   max_levels         = 10;
+	int   smoothing_steps    = 2;    ///< Damped Jacobi steps before and after each coarse correction.
+};
+
+/// Smoothed aggregation algebraic multigrid (Vaněk, Mandel & Brezina 1996), used as a preconditioner for CG.
+///
+/// Unlike downscale_solver the coarse levels are built from the assembled AtA alone, so it keeps working when
+/// data weights vary wildly over the lattice, or when only parts of the lattice are active.
+/// Each level:
+///   1. Strength of connection: weak couplings are ignored when aggregating.
+///   2. Aggregation: neighborhoods of strongly connected unknowns become one coarse unknown.
+///   3. The piecewise constant (tentative) prolongator is smoothed with a damped Jacobi step.
+///   4. The coarse operator is the Galerkin product Pᵀ·A·P.
+/// The coarsest level is factorized. Applying the preconditioner is one symmetric V-cycle.
+///
+/// Follows Eigen's preconditioner concept, so use it as:
+///     Eigen::ConjugateGradient<SparseMatrix, Eigen::Lower, AmgPreconditioner> solver(AtA);
+/// analyzePattern() does the full setup. factorize() keeps the aggregates of the last analyzePattern()
+/// and only recomputes the numbers, which is cheaper for a sequence of solves with the same sparsity pattern
+/// (e.g. re-weighting).
+class AmgPreconditioner
+{
+public:
+	using StorageIndex = Index;
+	enum {
+		ColsAtCompileTime    = Eigen::Dynamic,
+		MaxColsAtCompileTime = Eigen::Dynamic,
+	};
+
+	explicit AmgPreconditioner(const AmgOptions& options = {});
+	~AmgPreconditioner();
+
+	AmgPreconditioner(AmgPreconditioner&&);
+	AmgPreconditioner& operator=(AmgPreconditioner&&);
+
+	template<typename MatType>
+	AmgPreconditioner& analyzePattern(const MatType& mat)
+	{
+		setup(SparseMatrix(mat), false);
+		_just_analyzed = true;
+		return *this;
+	}
+
+	template<typename MatType>
+	AmgPreconditioner& factorize(const MatType& mat)
+	{
+		if (!_just_analyzed) {
+			setup(SparseMatrix(mat), true);
+		}
+		_just_analyzed = false;
+		return *this;
+	}
+
+	template<typename MatType>
+	AmgPreconditioner& compute(const MatType& mat)
+	{
+		setup(SparseMatrix(mat), false);
+		_just_analyzed = false;
+		return *this;
+	}
+
+	/// One V-cycle, approximating AtA⁻¹·b.
+	template<typename Rhs>
+	VectorXr solve(const Rhs& b) const
+	{
+		return v_cycle(0, b);
+	}
+
+	Eigen::ComputationInfo info() { return _info; }
+
+	/// Including the finest (the input) and the coarsest (solved directly).
+	int num_levels() const;
+
+	/// Number of unknowns of each level.
+	std::vector<Index> level_sizes() const;
+
+private:
+	struct Hierarchy;
+
+	/// If `reuse_aggregates`, use the aggregates from the previous setup (same pattern, new values).
+	void setup(SparseMatrix A, bool reuse_aggregates);
+	VectorXr v_cycle(size_t level_index, const VectorXr& b) const;
+
+	AmgOptions                 _options;
+	std::unique_ptr<Hierarchy> _hierarchy;
+	Eigen::ComputationInfo     _info = Eigen::Success;
+	bool                       _just_analyzed = false;
+};
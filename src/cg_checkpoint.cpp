@@ -0,0 +1,313 @@
+#include "cg_checkpoint.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char     kMagic[8] = {'F', 'I', 'C', 'G', 'C', 'K', 'P', 'T'};
+const uint32_t kVersion  = 1;
+const int      kNumSlots = 2;
+const int      kNumVectors = 3; // x, residual, direction
+
+struct FileHeader
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t num_vectors;
+	uint64_t num_unknowns;
+	uint64_t fingerprint;
+};
+
+/// 64-bit FNV-1a, a word at a time. Continues from `hash`.
+uint64_t hash_words(uint64_t hash, const void* data, size_t num_bytes)
+{
+	const uint64_t kPrime = 1099511628211ull;
+	const char* bytes = static_cast<const char*>(data);
+	size_t i = 0;
+	for (; i + sizeof(uint32_t) <= num_bytes; i += sizeof(uint32_t)) {
+		uint32_t word;
+		std::memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * kPrime;
+	}
+	for (; i < num_bytes; ++i) {
+		hash = (hash ^ static_cast<unsigned char>(bytes[i])) * kPrime;
+	}
+	return hash;
+}
+
+const uint64_t kHashSeed = 14695981039346656037ull;
+
+/// Size of the data of one snapshot.
+size_t slot_bytes(Index num_unknowns)
+{
+	return sizeof(float) * kNumVectors * static_cast<size_t>(num_unknowns);
+}
+
+size_t round_up(size_t value, size_t multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+/// msync the pages covering [begin, begin + num_bytes).
+void sync_range(char* mapped, size_t begin, size_t num_bytes)
+{
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t first = begin / page_size * page_size;
+	if (msync(mapped + first, begin + num_bytes - first, MS_SYNC) != 0) {
+		LOG_F(WARNING, "msync of checkpoint failed");
+	}
+}
+
+} // namespace
+
+struct CgCheckpoint::SlotHeader
+{
+	uint64_t sequence;  ///< 0 means empty (or being written).
+	int64_t  iteration;
+	uint64_t checksum;  ///< Of the slot data.
+	uint64_t padding;
+};
+
+uint64_t checkpoint_fingerprint(const SparseMatrix& AtA, const VectorXr& Atb, uint64_t tag)
+{
+	if (!AtA.isCompressed()) {
+		SparseMatrix compressed = AtA;
+		compressed.makeCompressed();
+		return checkpoint_fingerprint(compressed, Atb, tag);
+	}
+	uint64_t hash = hash_words(kHashSeed, &tag, sizeof(tag));
+	hash = hash_words(hash, AtA.outerIndexPtr(), (AtA.outerSize() + 1) * sizeof(Index));
+	hash = hash_words(hash, AtA.innerIndexPtr(), AtA.nonZeros() * sizeof(Index));
+	hash = hash_words(hash, AtA.valuePtr(),      AtA.nonZeros() * sizeof(float));
+	hash = hash_words(hash, Atb.data(),          Atb.size() * sizeof(float));
+	return hash;
+}
+
+CgCheckpoint::CgCheckpoint(const std::string& path, Index num_unknowns, uint64_t fingerprint, double interval_seconds)
+	: _path(path)
+	, _num_unknowns(num_unknowns)
+	, _fingerprint(fingerprint)
+	, _interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval_seconds)))
+	, _next_save(std::chrono::steady_clock::now() + _interval)
+{
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	_slot_offset  = round_up(sizeof(FileHeader) + kNumSlots * sizeof(SlotHeader), page_size);
+	_slot_stride  = round_up(slot_bytes(num_unknowns), page_size);
+	_mapped_bytes = _slot_offset + kNumSlots * _slot_stride;
+
+	const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		LOG_F(ERROR, "Failed to open '%s'", path.c_str());
+		return;
+	}
+
+	struct stat file_stat;
+	const bool right_size = fstat(fd, &file_stat) == 0 && static_cast<size_t>(file_stat.st_size) == _mapped_bytes;
+	bool matches = false;
+	if (right_size) {
+		FileHeader header;
+		matches = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+			&& std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0
+			&& header.version      == kVersion
+			&& header.num_vectors  == kNumVectors
+			&& header.num_unknowns == static_cast<uint64_t>(num_unknowns)
+			&& header.fingerprint  == fingerprint;
+	}
+
+	if (!matches) {
+		// Start afresh. Truncating first zeroes everything, so both slots are empty.
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, _mapped_bytes) != 0) {
+			LOG_F(ERROR, "Failed to resize '%s' to %lu bytes", path.c_str(), _mapped_bytes);
+			close(fd);
+			return;
+		}
+	}
+
+	void* mapped = mmap(nullptr, _mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // The mapping keeps the file open.
+	if (mapped == MAP_FAILED) {
+		LOG_F(ERROR, "Failed to mmap '%s'", path.c_str());
+		return;
+	}
+	_mapped = static_cast<char*>(mapped);
+
+	if (matches) {
+		const int slot = latest_slot();
+		if (slot >= 0) {
+			_sequence = slot_header(slot)->sequence;
+			LOG_F(INFO, "Found CG checkpoint of iteration %ld in '%s'",
+			      static_cast<long>(slot_header(slot)->iteration), path.c_str());
+		}
+	} else {
+		FileHeader header;
+		std::memcpy(header.magic, kMagic, sizeof(kMagic));
+		header.version      = kVersion;
+		header.num_vectors  = kNumVectors;
+		header.num_unknowns = num_unknowns;
+		header.fingerprint  = fingerprint;
+		std::memcpy(_mapped, &header, sizeof(header));
+		sync_range(_mapped, 0, sizeof(header));
+	}
+
+	_writer = std::thread([this]() { write_loop(); });
+}
+
+CgCheckpoint::~CgCheckpoint()
+{
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_cv.notify_all();
+	if (_writer.joinable()) {
+		_writer.join();
+	}
+	unmap();
+}
+
+void CgCheckpoint::unmap()
+{
+	if (_mapped) {
+		munmap(_mapped, _mapped_bytes);
+		_mapped = nullptr;
+	}
+}
+
+CgCheckpoint::SlotHeader* CgCheckpoint::slot_header(int slot) const
+{
+	return reinterpret_cast<SlotHeader*>(_mapped + sizeof(FileHeader)) + slot;
+}
+
+float* CgCheckpoint::slot_data(int slot) const
+{
+	return reinterpret_cast<float*>(_mapped + _slot_offset + slot * _slot_stride);
+}
+
+int CgCheckpoint::latest_slot() const
+{
+	if (!_mapped) { return -1; }
+	int best_slot = -1;
+	uint64_t best_sequence = 0;
+	for (int slot = 0; slot < kNumSlots; ++slot) {
+		const SlotHeader& header = *slot_header(slot);
+		if (header.sequence <= best_sequence) { continue; }
+		const size_t num_bytes = slot_bytes(_num_unknowns);
+		if (hash_words(kHashSeed, slot_data(slot), num_bytes) != header.checksum) {
+			LOG_F(WARNING, "CG checkpoint slot %d is corrupt", slot);
+			continue;
+		}
+		best_slot = slot;
+		best_sequence = header.sequence;
+	}
+	return best_slot;
+}
+
+bool CgCheckpoint::load(CgState* out) const
+{
+	CHECK_NOTNULL_F(out);
+	std::unique_lock<std::mutex> lock(_mutex);
+	const int slot = latest_slot();
+	if (slot < 0) { return false; }
+
+	const float* data = slot_data(slot);
+	out->iteration = slot_header(slot)->iteration;
+	out->x         = Eigen::Map<const VectorXr>(data + 0 * static_cast<size_t>(_num_unknowns), _num_unknowns);
+	out->residual  = Eigen::Map<const VectorXr>(data + 1 * static_cast<size_t>(_num_unknowns), _num_unknowns);
+	out->direction = Eigen::Map<const VectorXr>(data + 2 * static_cast<size_t>(_num_unknowns), _num_unknowns);
+	return true;
+}
+
+bool CgCheckpoint::save(const CgState& state)
+{
+	if (!_mapped) { return false; }
+	const auto now = std::chrono::steady_clock::now();
+	if (now < _next_save) { return false; }
+
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (_pending) {
+			return false; // Still writing the last one. Skip this one rather than wait.
+		}
+	}
+
+	// The writer thread does not touch _staging while !_pending:
+	CHECK_EQ_F(state.x.size(), _num_unknowns);
+	_staging.iteration = state.iteration;
+	_staging.x         = state.x;
+	_staging.residual  = state.residual;
+	_staging.direction = state.direction;
+	_next_save = now + _interval;
+
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_pending = true;
+	}
+	_cv.notify_all();
+	return true;
+}
+
+void CgCheckpoint::write_loop()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (;;) {
+		_cv.wait(lock, [this]() { return _pending || _stop; });
+		if (!_pending) { return; }
+		lock.unlock();
+
+		// Write to the slot not holding the latest snapshot, and only mark it valid once the data is on disk:
+		const uint64_t sequence = _sequence + 1;
+		const int slot = sequence % kNumSlots;
+		const size_t num_bytes = slot_bytes(_num_unknowns);
+		SlotHeader* header = slot_header(slot);
+		header->sequence = 0;
+		sync_range(_mapped, sizeof(FileHeader), kNumSlots * sizeof(SlotHeader));
+
+		float* data = slot_data(slot);
+		std::memcpy(data + 0 * static_cast<size_t>(_num_unknowns), _staging.x.data(),         _num_unknowns * sizeof(float));
+		std::memcpy(data + 1 * static_cast<size_t>(_num_unknowns), _staging.residual.data(),  _num_unknowns * sizeof(float));
+		std::memcpy(data + 2 * static_cast<size_t>(_num_unknowns), _staging.direction.data(), _num_unknowns * sizeof(float));
+		const uint64_t checksum = hash_words(kHashSeed, data, num_bytes);
+		sync_range(_mapped, _slot_offset + slot * _slot_stride, num_bytes);
+
+		header->iteration = _staging.iteration;
+		header->checksum  = checksum;
+		header->sequence  = sequence;
+		sync_range(_mapped, sizeof(FileHeader), kNumSlots * sizeof(SlotHeader));
+		LOG_F(1, "CG checkpoint of iteration %ld written", static_cast<long>(_staging.iteration));
+
+		lock.lock();
+		_sequence = sequence;
+		_num_saved += 1;
+		_pending = false;
+		_cv.notify_all();
+	}
+}
+
+void CgCheckpoint::flush()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_cv.wait(lock, [this]() { return !_pending; });
+}
+
+void CgCheckpoint::remove()
+{
+	flush();
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (!_mapped) { return; }
+	unmap();
+	if (std::remove(_path.c_str()) != 0) {
+		LOG_F(WARNING, "Failed to remove '%s'", _path.c_str());
+	}
+}
+
+size_t CgCheckpoint::num_saved() const
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	return _num_saved;
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <loguru.hpp>
+
+#include "sparse_linear.hpp"
+
+/// Everything conjugate gradient needs to continue where it left off.
+/// The preconditioned residual is recomputed from `residual` when resuming.
+struct CgState
+{
+	int64_t  iteration = 0;
+	VectorXr x;
+	VectorXr residual;
+	VectorXr direction;
+};
+
+/// Identifies a problem, so that a checkpoint is never resumed into a different one.
+/// Hashes the sparsity pattern and values of AtA, Atb, and `tag` (e.g. the preconditioner).
+uint64_t checkpoint_fingerprint(const SparseMatrix& AtA, const VectorXr& Atb, uint64_t tag);
+
+/// Periodic snapshots of the CgState of a long solve in a memory-mapped file (POSIX),
+/// so that the solve can be resumed after the process is killed (e.g. a preempted spot instance).
+///
+/// The file has two slots which are written alternately, each with a checksum,
+/// so dying in the middle of a write still leaves the previous snapshot intact.
+/// Writing is asynchronous: save() copies the state to a staging buffer, and a background thread writes
+/// and flushes it to disk. If the previous snapshot is still being written the new one is skipped,
+/// so the solver never waits for the disk, and the overhead is bounded by one copy of the state per interval.
+class CgCheckpoint
+{
+public:
+	/// Opens (or creates) the file at `path`. A snapshot of another problem (different `fingerprint`)
+	/// in the file is ignored, and will be overwritten.
+	/// At most one snapshot is taken every `interval_seconds`.
+	CgCheckpoint(const std::string& path, Index num_unknowns, uint64_t fingerprint, double interval_seconds);
+
+	/// Waits for any write in progress.
+	~CgCheckpoint();
+
+	CgCheckpoint(const CgCheckpoint&) = delete;
+	CgCheckpoint& operator=(const CgCheckpoint&) = delete;
+
+	/// False if the file could not be opened or mapped. Saves are then no-ops.
+	bool is_open() const { return _mapped != nullptr; }
+
+	/// Is there a valid snapshot to resume from?
+	bool can_resume() const { return latest_slot() >= 0; }
+
+	/// Load the latest valid snapshot. Returns false if there is none.
+	bool load(CgState* out) const;
+
+	/// Start writing a snapshot of `state`, unless one was taken less than `interval_seconds` ago
+	/// or is still being written. Returns true if a snapshot was started.
+	bool save(const CgState& state);
+
+	/// Wait for the snapshot being written (if any) to reach the disk.
+	void flush();
+
+	/// Delete the file, e.g. once the solve is done. Further saves are no-ops.
+	void remove();
+
+	/// Number of snapshots written so far.
+	size_t num_saved() const;
+
+private:
+	struct SlotHeader;
+
+	SlotHeader* slot_header(int slot) const;
+	float*      slot_data(int slot) const;
+
+	/// The slot with the highest sequence number and a valid checksum, or -1.
+	int latest_slot() const;
+
+	void write_loop();
+	void unmap();
+
+	std::string                           _path;
+	Index                                 _num_unknowns;
+	uint64_t                              _fingerprint;
+	std::chrono::steady_clock::duration   _interval;
+	std::chrono::steady_clock::time_point _next_save;
+
+	char*                                 _mapped = nullptr;
+	size_t                                _mapped_bytes = 0;
+	size_t                                _slot_offset  = 0; ///< Byte offset of slot 0 in the file.
+	size_t                                _slot_stride  = 0; ///< Bytes between slot 0 and slot 1.
+	uint64_t                              _sequence     = 0; ///< Of the latest snapshot written.
+
+	CgState                               _staging;          ///< Owned by the writer thread while _pending.
+	mutable std::mutex                    _mutex;
+	std::condition_variable               _cv;
+	bool                                  _pending   = false;
+	bool                                  _stop      = false;
+	size_t                                _num_saved = 0;
+	std::thread                           _writer;
+};
+
+/// Preconditioned conjugate gradient, step for step the same as Eigen::internal::conjugate_gradient,
+/// but with its state periodically saved to `checkpoint` (optional).
+/// If `checkpoint` holds a snapshot the solve resumes from it, and the starting value of `x` is ignored.
+/// On input `iterations` is the maximum and `error` the tolerance (relative residual norm).
+/// On output they are the iterations used (counting those before a resume) and the error reached.
+template<typename MatrixType, typename Preconditioner>
+void checkpointed_conjugate_gradient(
+	const MatrixType&     mat,
+	const VectorXr&       rhs,
+	VectorXr*             x,
+	const Preconditioner& preconditioner,
+	Eigen::Index*         iterations,
+	float*                error,
+	CgCheckpoint*         checkpoint)
+{
+	CHECK_NOTNULL_F(x);
+	CHECK_NOTNULL_F(iterations);
+	CHECK_NOTNULL_F(error);
+
+	const Eigen::Index max_iterations = *iterations;
+	const float rhs_norm2 = rhs.squaredNorm();
+	if (rhs_norm2 == 0) {
+		x->setZero(rhs.size());
+		*iterations = 0;
+		*error = 0;
+		return;
+	}
+	const float threshold = std::max(*error * *error * rhs_norm2, std::numeric_limits<float>::min());
+
+	CgState state;
+	VectorXr z; // The preconditioned residual
+	if (checkpoint && checkpoint->load(&state)) {
+		LOG_F(INFO, "Resuming CG from iteration %ld", static_cast<long>(state.iteration));
+		z = preconditioner.solve(state.residual);
+	} else {
+		state.x = std::move(*x);
+		state.residual = rhs - mat * state.x;
+		if (state.residual.squaredNorm() >= threshold) {
+			state.direction = preconditioner.solve(state.residual);
+			z = state.direction;
+		}
+	}
+
+	float residual_norm2 = state.residual.squaredNorm();
+	if (residual_norm2 >= threshold) {
+		float abs_new = state.residual.dot(z);
+		VectorXr tmp(rhs.size());
+
+		while (state.iteration < max_iterations) {
+			tmp.noalias() = mat * state.direction;
+			const float alpha = abs_new / state.direction.dot(tmp);
+			state.x += alpha * state.direction;
+			state.residual -= alpha * tmp;
+			residual_norm2 = state.residual.squaredNorm();
+			if (residual_norm2 < threshold) { break; }
+
+			z = preconditioner.solve(state.residual);
+			const float abs_old = abs_new;
+			abs_new = state.residual.dot(z);
+			const float beta = abs_new / abs_old;
+			state.direction = z + beta * state.direction;
+			state.iteration += 1;
+
+			if (checkpoint) {
+				checkpoint->save(state);
+			}
+		}
+	}
+
+	*x = std::move(state.x);
+	*iterations = state.iteration;
+	*error = std::sqrt(residual_norm2 / rhs_norm2);
+}
@@ -0,0 +1,144 @@
+#include "coarse_space.hpp"
+
+#include <algorithm>
+
+#include <Eigen/SparseCholesky>
+
+#include <loguru.hpp>
+
+#include "parallel.hpp"
+
+struct CoarseSpace::Factorization
+{
+	Eigen::SimplicialLLT<SparseMatrix> solver;
+};
+
+CoarseSpace::CoarseSpace(const SparseMatrix& AtA_full, const std::vector<int>& sizes_full, int downscale_factor)
+	: _sizes_full(sizes_full), _downscale_factor(downscale_factor), _factorization(new Factorization{})
+{
+	LOG_SCOPE_F(INFO, "CoarseSpace");
+	CHECK_GE_F(downscale_factor, 2);
+
+	for (int size_full : sizes_full) {
+		_sizes_small.push_back((size_full + downscale_factor - 1) / downscale_factor);
+		_num_unknowns_full *= size_full;
+		_num_unknowns_small *= _sizes_small.back();
+	}
+	CHECK_EQ_F(AtA_full.cols(), _num_unknowns_full);
+
+	// restrict and prolongate run once per CG iteration, so do the div/mod only once:
+	_small_index_of.resize(_num_unknowns_full);
+	parallel_for_static(_num_unknowns_full, [&](size_t, size_t begin, size_t end) {
+		for (size_t full_i = begin; full_i < end; ++full_i) {
+			_small_index_of[full_i] = small_index(full_i);
+		}
+	});
+
+	std::vector<Eigen::Triplet<float, Index>> AtA_triplets_small;
+	for (Index k=0; k < AtA_full.outerSize(); ++k) {
+		for (SparseMatrix::InnerIterator it(AtA_full, k); it; ++it) {
+			AtA_triplets_small.emplace_back(_small_index_of[it.row()], _small_index_of[it.col()], it.value());
+		}
+	}
+
+	SparseMatrix AtA_small(_num_unknowns_small, _num_unknowns_small);
+	AtA_small.setFromTriplets(AtA_triplets_small.begin(), AtA_triplets_small.end());
+	AtA_small.makeCompressed();
+
+	LOG_F(INFO, "AtA_small nnz: %lu (%.3f%%)", AtA_small.nonZeros(),
+	      100.0f * AtA_small.nonZeros() / (AtA_small.rows() * AtA_small.cols()));
+
+	_factorization->solver.compute(AtA_small);
+	_ok = _factorization->solver.info() == Eigen::Success;
+	LOG_IF_F(WARNING, !_ok, "solver_small.compute failed");
+}
+
+CoarseSpace::~CoarseSpace() = default;
+
+Index CoarseSpace::small_index(Index full_index) const
+{
+	Index index_small = 0;
+	Index stride_small = 1;
+	for (int d = 0; d < _sizes_full.size(); ++d) {
+		int pos_full = full_index % _sizes_full[d];
+		int pos_small = pos_full / _downscale_factor;
+		index_small += stride_small * pos_small;
+		full_index /= _sizes_full[d];
+		stride_small *= _sizes_small[d];
+	}
+	return index_small;
+}
+
+VectorXr CoarseSpace::restrict(const VectorXr& fine) const
+{
+	CHECK_EQ_F(fine.size(), _num_unknowns_full);
+	VectorXr coarse = VectorXr::Zero(_num_unknowns_small);
+
+	// A slab of the last axis of the coarse lattice only gets contributions from its own
+	// `_downscale_factor` slabs of the fine lattice, so the chunks never write to the same coarse points.
+	const size_t num_slabs      = _sizes_small.back();
+	const Index  full_slab_size = _num_unknowns_full / _sizes_full.back();
+	parallel_for_chunks(num_slabs, std::min(num_slabs, num_worker_threads()), [&](size_t, size_t begin, size_t end) {
+		const Index full_begin = begin * _downscale_factor * full_slab_size;
+		const Index full_end   = std::min<Index>(end * _downscale_factor * full_slab_size, _num_unknowns_full);
+		for (Index full_i = full_begin; full_i < full_end; ++full_i) {
+			coarse[_small_index_of[full_i]] += fine[full_i];
+		}
+	});
+	return coarse;
+}
+
+VectorXr CoarseSpace::prolongate(const VectorXr& coarse) const
+{
+	VectorXr fine = placed_vector(_num_unknowns_full);
+	parallel_for_static(_num_unknowns_full, [&](size_t, size_t begin, size_t end) {
+		for (size_t full_i = begin; full_i < end; ++full_i) {
+			fine[full_i] = coarse[_small_index_of[full_i]];
+		}
+	});
+	return fine;
+}
+
+VectorXr CoarseSpace::solve(const VectorXr& rhs) const
+{
+	CHECK_F(_ok, "Factorization failed");
+	const VectorXr solution_small = _factorization->solver.solve(restrict(rhs));
+	if (_factorization->solver.info() != Eigen::Success) {
+		LOG_F(WARNING, "solver_small.solve failed");
+		return {};
+	}
+	return prolongate(solution_small);
+}
+
+// ----------------------------------------------------------------------------
+
+DeflationPreconditioner::DeflationPreconditioner(const SparseMatrix& AtA, const CoarseSpace& coarse)
+	: _AtA(AtA), _coarse(coarse)
+{
+	_inv_diagonal = AtA.diagonal();
+	for (Index i = 0; i < _inv_diagonal.size(); ++i) {
+		_inv_diagonal[i] = _inv_diagonal[i] != 0 ? 1 / _inv_diagonal[i] : 1;
+	}
+}
+
+VectorXr DeflationPreconditioner::start_vector(const VectorXr& Atb, const VectorXr& guess) const
+{
+	const VectorXr residual = Atb - _AtA * guess;
+	const VectorXr correction = _coarse.solve(residual);
+	if (correction.size() == 0) {
+		return guess;
+	}
+	return guess + correction;
+}
+
+VectorXr DeflationPreconditioner::solve(const VectorXr& residual) const
+{
+	// (I - Q·AtA)·D⁻¹·r + Q·r  =  y + Q·(r - AtA·y),  where y = D⁻¹·r
+	const VectorXr y = _inv_diagonal.cwiseProduct(residual);
+	const VectorXr remaining = residual - _AtA * y;
+	const VectorXr correction = _coarse.solve(remaining);
+	if (correction.size() == 0) {
+		return y; // Plain Jacobi: still a valid (if slower) preconditioner.
+	}
+	return y + correction;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "sparse_linear.hpp"
+
+/// The coarse lattice of downscale_solver, kept around for re-use.
+/// Each lattice point belongs to the coarse lattice point `downscale_factor` times larger which covers it.
+/// With Z being this (piecewise constant) prolongation, the coarse operator E = Zᵀ·AtA·Z is factorized once.
+class CoarseSpace
+{
+public:
+	CoarseSpace(const SparseMatrix& AtA, const std::vector<int>& sizes, int downscale_factor);
+	~CoarseSpace();
+
+	/// False if the factorization failed.
+	bool ok() const { return _ok; }
+
+	Index num_coarse_unknowns() const { return _num_unknowns_small; }
+
+	/// Zᵀ·fine: sum over each coarse lattice point.
+	/// Parallel over slabs of the last axis: each coarse slab only sums its own `downscale_factor` fine slabs.
+	VectorXr restrict(const VectorXr& fine) const;
+
+	/// Z·coarse: each lattice point gets the value of its coarse lattice point.
+	VectorXr prolongate(const VectorXr& coarse) const;
+
+	/// Q·rhs = Z·E⁻¹·Zᵀ·rhs. Q·Atb is the downscale_solver solution.
+	/// Returns an empty vector on failure.
+	VectorXr solve(const VectorXr& rhs) const;
+
+private:
+	Index small_index(Index full_index) const;
+
+	struct Factorization;
+
+	std::vector<int>               _sizes_full;
+	std::vector<int>               _sizes_small;
+	int                            _downscale_factor;
+	Index                          _num_unknowns_full = 1;
+	Index                          _num_unknowns_small = 1;
+	std::vector<Index>             _small_index_of; ///< small_index of each lattice point, computed once.
+	std::unique_ptr<Factorization> _factorization;
+	bool                           _ok = false;
+};
+
+/// Two-level preconditioner for conjugate gradient: Jacobi for the high frequencies, and a coarse correction
+/// from a CoarseSpace for the smooth modes CG struggles with. This is the A-DEF2 variant of deflation
+/// (Tang et al. 2009, "Comparison of two-level preconditioners derived from deflation, domain decomposition and multigrid methods"):
+///     M⁻¹ = (I - Q·AtA)·D⁻¹ + Q
+/// It costs one coarse solve and one extra product with AtA per iteration, and keeps the number of iterations
+/// largely independent of the lattice resolution.
+/// CG must be started from start_vector(guess), not from the guess itself.
+/// If a coarse solve fails, that step falls back to the Jacobi part alone.
+class DeflationPreconditioner
+{
+public:
+	/// Both must outlive the preconditioner.
+	DeflationPreconditioner(const SparseMatrix& AtA, const CoarseSpace& coarse);
+
+	/// guess + Q·(Atb - AtA·guess): the guess with its coarse error removed (or just the guess, if the coarse solve fails).
+	VectorXr start_vector(const VectorXr& Atb, const VectorXr& guess) const;
+
+	VectorXr solve(const VectorXr& residual) const;
+
+	Eigen::ComputationInfo info() { return _coarse.ok() ? Eigen::Success : Eigen::NumericalIssue; }
+
+private:
+	const SparseMatrix& _AtA;
+	const CoarseSpace&  _coarse;
+	VectorXr            _inv_diagonal;
+};
@@ -0,0 +1,252 @@
+#include "fft.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <loguru.hpp>
+
+#include "parallel.hpp"
+
+namespace {
+
+const double kPi = 3.14159265358979323846;
+
+/// Number of lattice lines transformed by each parallel job.
+const size_t LINES_PER_CHUNK = 64;
+
+bool is_power_of_two(size_t n)
+{
+	return n > 0 && (n & (n - 1)) == 0;
+}
+
+size_t num_line_chunks(size_t num_lines)
+{
+	return (num_lines + LINES_PER_CHUNK - 1) / LINES_PER_CHUNK;
+}
+
+} // namespace
+
+Fft::Fft(size_t n) : _n(n), _m(n)
+{
+	CHECK_GT_F(n, 0u);
+	if (!is_power_of_two(n)) {
+		_m = 1;
+		while (_m < 2 * n - 1) { _m *= 2; }
+	}
+
+	_twiddles.resize(_m / 2);
+	for (size_t k = 0; k < _m / 2; ++k) {
+		_twiddles[k] = std::polar(1.0, -2 * kPi * k / _m);
+	}
+
+	if (_m != _n) {
+		// k² mod 2n keeps the angle accurate for large k:
+		_chirp.resize(_n);
+		for (size_t k = 0; k < _n; ++k) {
+			const size_t k2 = (static_cast<unsigned long long>(k) * k) % (2 * _n);
+			_chirp[k] = std::polar(1.0, -kPi * k2 / _n);
+		}
+		_chirp_filter.assign(_m, Complex(0));
+		_chirp_filter[0] = std::conj(_chirp[0]);
+		for (size_t k = 1; k < _n; ++k) {
+			_chirp_filter[k] = _chirp_filter[_m - k] = std::conj(_chirp[k]);
+		}
+		radix2(_chirp_filter.data(), false);
+	}
+}
+
+void Fft::radix2(Complex* data, bool inverse) const
+{
+	for (size_t i = 1, j = 0; i < _m; ++i) {
+		size_t bit = _m >> 1;
+		for (; j & bit; bit >>= 1) { j ^= bit; }
+		j ^= bit;
+		if (i < j) { std::swap(data[i], data[j]); }
+	}
+
+	for (size_t length = 2; length <= _m; length *= 2) {
+		const size_t half = length / 2;
+		const size_t twiddle_step = _m / length;
+		for (size_t begin = 0; begin < _m; begin += length) {
+			for (size_t k = 0; k < half; ++k) {
+				const Complex twiddle = inverse ? std::conj(_twiddles[k * twiddle_step]) : _twiddles[k * twiddle_step];
+				const Complex a = data[begin + k];
+				const Complex b = data[begin + k + half] * twiddle;
+				data[begin + k]        = a + b;
+				data[begin + k + half] = a - b;
+			}
+		}
+	}
+}
+
+void Fft::forward(Complex* data) const
+{
+	if (_m == _n) {
+		radix2(data, false);
+		return;
+	}
+
+	// X[k] = chirp[k] · Σ (x[j]·chirp[j]) · conj(chirp[k - j]), a convolution:
+	std::vector<Complex> scratch(_m, Complex(0));
+	for (size_t j = 0; j < _n; ++j) {
+		scratch[j] = data[j] * _chirp[j];
+	}
+	radix2(scratch.data(), false);
+	for (size_t k = 0; k < _m; ++k) {
+		scratch[k] *= _chirp_filter[k];
+	}
+	radix2(scratch.data(), true);
+	for (size_t k = 0; k < _n; ++k) {
+		data[k] = _chirp[k] * scratch[k] / static_cast<double>(_m);
+	}
+}
+
+void Fft::inverse(Complex* data) const
+{
+	if (_m == _n) {
+		radix2(data, true);
+	} else {
+		for (size_t k = 0; k < _n; ++k) { data[k] = std::conj(data[k]); }
+		forward(data);
+		for (size_t k = 0; k < _n; ++k) { data[k] = std::conj(data[k]); }
+	}
+	for (size_t k = 0; k < _n; ++k) {
+		data[k] /= static_cast<double>(_n);
+	}
+}
+
+// ----------------------------------------------------------------------------
+
+LatticeFft::LatticeFft(const std::vector<int>& sizes) : _sizes(sizes), _spectrum_sizes(sizes)
+{
+	CHECK_F(!sizes.empty());
+	_spectrum_sizes[0] = sizes[0] / 2 + 1;
+	for (int d = 0; d < sizes.size(); ++d) {
+		CHECK_GT_F(sizes[d], 0);
+		_num_values    *= sizes[d];
+		_spectrum_size *= _spectrum_sizes[d];
+	}
+
+	const int size_x = sizes[0];
+	const bool half_length = size_x % 2 == 0;
+	_ffts.emplace_back(half_length ? size_x / 2 : size_x);
+	for (int d = 1; d < sizes.size(); ++d) {
+		_ffts.emplace_back(sizes[d]);
+	}
+	if (half_length) {
+		_half_twiddles.resize(size_x / 2);
+		for (int k = 0; k < size_x / 2; ++k) {
+			_half_twiddles[k] = std::polar(1.0, -2 * kPi * k / size_x);
+		}
+	}
+}
+
+void LatticeFft::forward(const float* values, Complex* spectrum) const
+{
+	CHECK_NOTNULL_F(values);
+	CHECK_NOTNULL_F(spectrum);
+	const size_t size_x     = _sizes[0];
+	const size_t spectrum_x = _spectrum_sizes[0];
+	const size_t num_lines  = _num_values / size_x;
+	const Fft&   fft        = _ffts[0];
+
+	parallel_for_chunks(num_lines, num_line_chunks(num_lines), [&](size_t, size_t begin, size_t end) {
+		std::vector<Complex> line(fft.size());
+		for (size_t l = begin; l < end; ++l) {
+			const float* in  = values   + l * size_x;
+			Complex*     out = spectrum + l * spectrum_x;
+			if (_half_twiddles.empty()) {
+				for (size_t j = 0; j < size_x; ++j) { line[j] = in[j]; }
+				fft.forward(line.data());
+				std::copy(line.begin(), line.begin() + spectrum_x, out);
+			} else {
+				// Even samples in the real part, odd in the imaginary, then untangle the two spectra:
+				const size_t half = size_x / 2;
+				for (size_t j = 0; j < half; ++j) { line[j] = Complex(in[2 * j], in[2 * j + 1]); }
+				fft.forward(line.data());
+				for (size_t k = 0; k <= half; ++k) {
+					const Complex z      = line[k % half];
+					const Complex z_conj = std::conj(line[(half - k) % half]);
+					const Complex even   = 0.5 * (z + z_conj);
+					const Complex odd    = Complex(0, -0.5) * (z - z_conj);
+					const Complex twiddle = k < half ? _half_twiddles[k] : Complex(-1);
+					out[k] = even + twiddle * odd;
+				}
+			}
+		}
+	});
+
+	for (int d = 1; d < _sizes.size(); ++d) {
+		transform_lines(spectrum, d, false);
+	}
+}
+
+void LatticeFft::inverse(Complex* spectrum, float* values) const
+{
+	CHECK_NOTNULL_F(spectrum);
+	CHECK_NOTNULL_F(values);
+	for (int d = _sizes.size() - 1; d >= 1; --d) {
+		transform_lines(spectrum, d, true);
+	}
+
+	const size_t size_x     = _sizes[0];
+	const size_t spectrum_x = _spectrum_sizes[0];
+	const size_t num_lines  = _num_values / size_x;
+	const Fft&   fft        = _ffts[0];
+
+	parallel_for_chunks(num_lines, num_line_chunks(num_lines), [&](size_t, size_t begin, size_t end) {
+		std::vector<Complex> line(fft.size());
+		for (size_t l = begin; l < end; ++l) {
+			const Complex* in  = spectrum + l * spectrum_x;
+			float*         out = values   + l * size_x;
+			if (_half_twiddles.empty()) {
+				// Restore the negative frequencies from the Hermitian symmetry:
+				line[0] = in[0];
+				for (size_t k = 1; k < spectrum_x; ++k) {
+					line[k] = in[k];
+					line[size_x - k] = std::conj(in[k]);
+				}
+				fft.inverse(line.data());
+				for (size_t j = 0; j < size_x; ++j) { out[j] = line[j].real(); }
+			} else {
+				const size_t half = size_x / 2;
+				for (size_t k = 0; k < half; ++k) {
+					const Complex x_conj = std::conj(in[half - k]);
+					const Complex even   = 0.5 * (in[k] + x_conj);
+					const Complex odd    = 0.5 * (in[k] - x_conj) * std::conj(_half_twiddles[k]);
+					line[k] = even + Complex(0, 1) * odd;
+				}
+				fft.inverse(line.data());
+				for (size_t j = 0; j < half; ++j) {
+					out[2 * j]     = line[j].real();
+					out[2 * j + 1] = line[j].imag();
+				}
+			}
+		}
+	});
+}
+
+void LatticeFft::transform_lines(Complex* spectrum, int d, bool inverse) const
+{
+	size_t stride = 1;
+	for (int i = 0; i < d; ++i) {
+		stride *= _spectrum_sizes[i];
+	}
+	const size_t size      = _spectrum_sizes[d];
+	const size_t num_lines = _spectrum_size / size;
+	const Fft&   fft       = _ffts[d];
+
+	parallel_for_chunks(num_lines, num_line_chunks(num_lines), [&](size_t, size_t begin, size_t end) {
+		std::vector<Complex> line(size);
+		for (size_t l = begin; l < end; ++l) {
+			Complex* first = spectrum + (l / stride) * stride * size + l % stride;
+			for (size_t j = 0; j < size; ++j) { line[j] = first[j * stride]; }
+			if (inverse) {
+				fft.inverse(line.data());
+			} else {
+				fft.forward(line.data());
+			}
+			for (size_t j = 0; j < size; ++j) { first[j * stride] = line[j]; }
+		}
+	});
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <complex>
+#include <vector>
+
+/// Discrete Fourier transform of any length n in O(n log n).
+/// Powers of two use an iterative radix-2 transform. Other lengths use Bluestein's algorithm,
+/// which rewrites the transform as a convolution of power-of-two length.
+/// Done in double precision, so the round-off stays well below that of the float data it is used on.
+class Fft
+{
+public:
+	using Complex = std::complex<double>;
+
+	explicit Fft(size_t n);
+
+	size_t size() const { return _n; }
+
+	/// X[k] = Σ x[j]·exp(-2πi·jk/n), in place.
+	void forward(Complex* data) const;
+
+	/// The inverse of forward, including the 1/n, in place.
+	void inverse(Complex* data) const;
+
+private:
+	/// Unnormalized radix-2 transform of length _m. `inverse` flips the sign of the exponent.
+	void radix2(Complex* data, bool inverse) const;
+
+	size_t               _n;
+	size_t               _m;            ///< Length of the radix-2 transform: _n, or the Bluestein convolution length.
+	std::vector<Complex> _twiddles;     ///< exp(-2πi·k/_m) for k < _m/2.
+	std::vector<Complex> _chirp;        ///< exp(-πi·k²/_n) for k < _n. Empty for powers of two.
+	std::vector<Complex> _chirp_filter; ///< radix2 of the conjugate chirp, wrapped around to length _m.
+};
+
+/// Real-to-complex transform of all the dimensions of a lattice, with the first dimension (x) fastest.
+/// The spectrum of real values is Hermitian, so only the frequencies [0, sizes[0]/2] are kept along x,
+/// and the transform along x is done as a complex transform of half the length. This halves both the memory
+/// and the work of a complex transform of the whole lattice.
+/// The spectrum has the same layout as the lattice, with spectrum_sizes() instead of the lattice sizes.
+/// The lines along each dimension are transformed in parallel.
+class LatticeFft
+{
+public:
+	using Complex = Fft::Complex;
+
+	explicit LatticeFft(const std::vector<int>& sizes);
+
+	const std::vector<int>& sizes() const { return _sizes; }
+
+	/// sizes() with sizes[0] replaced by sizes[0]/2 + 1.
+	const std::vector<int>& spectrum_sizes() const { return _spectrum_sizes; }
+
+	size_t num_values() const { return _num_values; }
+	size_t spectrum_size() const { return _spectrum_size; }
+
+	/// `values` has num_values() elements, `spectrum` spectrum_size().
+	void forward(const float* values, Complex* spectrum) const;
+
+	/// The inverse of forward, normalized. Overwrites `spectrum`.
+	void inverse(Complex* spectrum, float* values) const;
+
+private:
+	/// Transform the lines along `d` (d > 0) of the spectrum in place.
+	void transform_lines(Complex* spectrum, int d, bool inverse) const;
+
+	std::vector<int>     _sizes;
+	std::vector<int>     _spectrum_sizes;
+	size_t               _num_values    = 1;
+	size_t               _spectrum_size = 1;
+	std::vector<Fft>     _ffts;          ///< _ffts[d] transforms along d. Along x it is of half length if sizes[0] is even.
+	std::vector<Complex> _half_twiddles; ///< exp(-2πi·k/sizes[0]) for k < sizes[0]/2, if sizes[0] is even.
+};
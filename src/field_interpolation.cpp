@@ -1,27 +1,74 @@
 #include "field_interpolation.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <limits>
 #include <ostream>
+#include <utility>
 
 #include <loguru.hpp>
 
-const int TWO_TO_MAX_DIM = (1 << 4);
+#include "parallel.hpp"
 
-std::ostream& operator<<(std::ostream& os, const LinearEquation& eq)
+const int TWO_TO_MAX_DIM = (1 << MAX_DIM);
+
+LatticeField::LatticeField(const std::vector<int>& sizes_arg) : sizes(sizes_arg)
+{
+	Index stride = 1;
+	for (int size : sizes) {
+		CHECK_GT_F(size, 0);
+		CHECK_LE_F(stride, std::numeric_limits<Index>::max() / size,
+		           "Lattice too large for %d-bit indices. Build with FIELD_INTERPOLATION_64BIT_INDEX=1.",
+		           static_cast<int>(8 * sizeof(Index)));
+		strides.push_back(stride);
+		stride *= size;
+	}
+}
+
+LatticeField::LatticeField(const std::vector<int>& sizes_arg, const std::vector<float>& spacing_arg)
+	: LatticeField(sizes_arg)
 {
-	const size_t num_rows = eq.rhs.size();
-	std::vector<std::vector<Triplet>> row_triplets(num_rows);
+	CHECK_EQ_F(spacing_arg.size(), sizes_arg.size());
+	for (float axis_spacing : spacing_arg) {
+		CHECK_GT_F(axis_spacing, 0.0f);
+	}
+	spacing = spacing_arg;
+}
+
+void LatticeField::set_periodic(const std::vector<bool>& periodic_arg)
+{
+	CHECK_EQ_F(periodic_arg.size(), sizes.size());
+	CHECK_F(eq.num_rows() == 0 && !model, "set_periodic must be called before adding constraints");
+	periodic = periodic_arg;
+}
 
-	for (const auto& triplet : eq.triplets) {
-		row_triplets[triplet.row].push_back(triplet);
+Index LatticeField::num_unknowns() const
+{
+	Index num_unknowns = 1;
+	for (int size : sizes) {
+		num_unknowns *= size;
 	}
+	return num_unknowns;
+}
+
+size_t LatticeField::num_equations() const
+{
+	return eq.num_rows() + (model ? model->components->num_equations() : 0);
+}
 
-	for (size_t row = 0; row < num_rows; ++row) {
+size_t LatticeField::num_nonzeros() const
+{
+	return eq.num_nonzeros() + (model ? model->components->num_nonzeros() : 0);
+}
+
+std::ostream& operator<<(std::ostream& os, const LinearEquation& eq)
+{
+	for (size_t row = 0; row < eq.num_rows(); ++row) {
 		os << eq.rhs[row] << " = ";
-		for (size_t triplet_idx = 0; triplet_idx < row_triplets[row].size(); ++triplet_idx) {
-			const auto& triplet = row_triplets[row][triplet_idx];
-			os << triplet.value << " * x" << triplet.col;
-			if (triplet_idx + 1 < row_triplets[row].size()) {
+		for (Index entry = eq.row_starts[row]; entry < eq.row_starts[row + 1]; ++entry) {
+			os << eq.values[entry] << " * x" << eq.cols[entry];
+			if (entry + 1 < eq.row_starts[row + 1]) {
 				os  << "  +  ";
 			}
 		}
@@ -37,15 +84,14 @@ void add_equation(
 
 	// bool all_zero = rhs == 0;
 	bool all_zero = true;
-	int row = eq->rhs.size();
 	for (const auto& pair : pairs) {
 		if (pair.value != 0) {
-			eq->triplets.emplace_back(row, pair.column, pair.value * weight.value);
+			eq->add_entry(pair.column, pair.value * weight.value);
 			all_zero = false;
 		}
 	}
 	if (!all_zero) {
-		eq->rhs.emplace_back(rhs.value * weight.value);
+		eq->end_row(rhs.value * weight.value);
 	}
 }
 
@@ -53,7 +99,7 @@ void add_equation(
 /// Returns the number of indices to sample from.
 /// The indices are put in out_indices, the kernel (inteprolation weights) in out_kernel.
 int multilerp(
-	int                 out_indices[],
+	Index               out_indices[],
 	float               out_kernel[],
 	const LatticeField& field,
 	const float         in_pos[],
@@ -72,7 +118,7 @@ int multilerp(
 	int num_samples = 0;
 
 	for (int i = 0; i < (1 << num_dim); ++i) {
-		int index = 0;
+		Index index = 0;
 		float weight = 1;
 		bool inside = true;
 		for (int d = 0; d < num_dim; ++d) {
@@ -92,35 +138,93 @@ int multilerp(
 	return num_samples;
 }
 
+/// Like add_value_constraint, but adds the equation to `eq` instead of `field->eq`.
 bool add_value_constraint(
-	LatticeField* field,
-	const float   pos[],
-	float         value,
-	float         constraint_weight)
+	LinearEquation*     eq,
+	const LatticeField& field,
+	const float         pos[],
+	float               value,
+	float               constraint_weight)
 {
 	if (constraint_weight == 0) { return false; }
 
-	int inteprolation_indices[TWO_TO_MAX_DIM];
+	Index inteprolation_indices[TWO_TO_MAX_DIM];
 	float interpolation_kernel[TWO_TO_MAX_DIM];
-	int num_samples = multilerp(inteprolation_indices, interpolation_kernel, *field, pos, 0);
+	int num_samples = multilerp(inteprolation_indices, interpolation_kernel, field, pos, 0);
 	if (num_samples == 0) { return false; }
 
-	int row = field->eq.rhs.size();
 	float weight_sum = 0;
 	for (int i = 0; i < num_samples; ++i) {
 		float sample_weight = interpolation_kernel[i] * constraint_weight;
-		field->eq.triplets.emplace_back(row, inteprolation_indices[i], sample_weight);
+		eq->add_entry(inteprolation_indices[i], sample_weight);
 		weight_sum += sample_weight;
 	}
-	field->eq.rhs.emplace_back(weight_sum * value);
+	eq->end_row(weight_sum * value);
 
 	return true;
 }
 
+/// Like add_nearest_value_constraint, but adds the equation to `eq` instead of `field->eq`.
+bool add_nearest_value_constraint(
+	LinearEquation*     eq,
+	const LatticeField& field,
+	const float         pos[],
+	float               value,
+	const float*        gradient,
+	float               constraint_weight)
+{
+	if (constraint_weight == 0) { return false; }
+
+	const int num_dim = field.sizes.size();
+	CHECK_F(1 <= num_dim && num_dim <= MAX_DIM);
+
+	Index index = 0;
+	float rhs = value;
+	for (int d = 0; d < num_dim; ++d) {
+		const int closest = std::floor(pos[d] + 0.5f);
+		if (closest < 0 || closest >= field.sizes[d]) { return false; }
+		index += field.strides[d] * closest;
+		if (gradient) {
+			// First order Taylor expansion from pos to the lattice point:
+			rhs += gradient[d] * (closest - pos[d]) * field.axis_spacing(d);
+		}
+	}
+
+	add_equation(eq, Weight{constraint_weight}, Rhs{rhs}, {
+		{index, 1.0f},
+	});
+	return true;
+}
+
+/// Mark the rows from `begin` to the end of `field->eq` as being of the given class.
+void tag_rows(LatticeField* field, ConstraintClass constraint_class, size_t begin)
+{
+	const size_t end = field->eq.num_rows();
+	if (begin == end) { return; }
+	auto& ranges = field->row_classes;
+	if (!ranges.empty() && ranges.back().constraint_class == constraint_class && ranges.back().end == begin) {
+		ranges.back().end = end;
+	} else {
+		ranges.push_back(RowRange{constraint_class, begin, end});
+	}
+}
+
+bool add_value_constraint(
+	LatticeField* field,
+	const float   pos[],
+	float         value,
+	float         constraint_weight)
+{
+	const size_t begin = field->eq.num_rows();
+	const bool success = add_value_constraint(&field->eq, *field, pos, value, constraint_weight);
+	tag_rows(field, ConstraintClass::kDataPos, begin);
+	return success;
+}
+
 /// Return -1 on out-of-bounds
-int cell_index(const LatticeField& field, const float pos[])
+Index cell_index(const LatticeField& field, const float pos[])
 {
-	int index = 0;
+	Index index = 0;
 	const int num_dim = field.sizes.size();
 	for (int d = 0; d < num_dim; ++d) {
 		int pos_d = std::floor(pos[d]);
@@ -131,30 +235,46 @@ int cell_index(const LatticeField& field, const float pos[])
 	return index;
 }
 
+bool add_nearest_value_constraint(
+	LatticeField* field,
+	const float   pos[],
+	float         value,
+	const float*  gradient,
+	float         constraint_weight)
+{
+	const size_t begin = field->eq.num_rows();
+	const bool success = add_nearest_value_constraint(&field->eq, *field, pos, value, gradient, constraint_weight);
+	tag_rows(field, ConstraintClass::kDataPos, begin);
+	return success;
+}
+
+/// Like add_gradient_constraint, but adds the equations to `eq` instead of `field->eq`.
 bool add_gradient_constraint(
-	LatticeField*  field,
-	const float    pos[],
-	const float    gradient[],
-	float          constraint_weight,
-	GradientKernel kernel)
+	LinearEquation*     eq,
+	const LatticeField& field,
+	const float         pos[],
+	const float         gradient[],
+	float               constraint_weight,
+	GradientKernel      kernel)
 {
 	if (constraint_weight == 0) { return false; }
 
 	// TODO: add three equations like in http://citeseerx.ist.psu.edu/viewdoc/download?doi=10.1.1.440.3739&rep=rep1&type=pdf
 
 	if (kernel == GradientKernel::kNearestNeighbor) {
-		int index = cell_index(*field, pos);
+		Index index = cell_index(field, pos);
 		if (index < 0) { return false; }
 
-		const int num_dim = field->sizes.size();
+		const int num_dim = field.sizes.size();
 
 		for (int d = 0; d < num_dim; ++d) {
 			// d f(x, y) / dx = gradient[0]
 			// d f(x, y) / dy = gradient[1]
 			// ...
-			add_equation(&field->eq, Weight{constraint_weight}, Rhs{gradient[d]}, {
-				{index + 0,                 -1.0f},
-				{index + field->strides[d], +1.0f},
+			const float inv_spacing = 1.0f / field.axis_spacing(d);
+			add_equation(eq, Weight{constraint_weight}, Rhs{gradient[d]}, {
+				{index + 0,                 -inv_spacing},
+				{index + field.strides[d], +inv_spacing},
 			});
 		}
 		return true;
@@ -173,27 +293,26 @@ bool add_gradient_constraint(
 		So this will add num_dim equations with 2^num_dim terms in each.
 		*/
 
-		int index = cell_index(*field, pos);
+		Index index = cell_index(field, pos);
 		if (index < 0) { return false; }
 
-		const int num_dim = field->sizes.size();
+		const int num_dim = field.sizes.size();
 
 		for (int d = 0; d < num_dim; ++d) {
-			const int row = field->eq.rhs.size();
 			const int num_corners = (1 << num_dim);
-			const float term_weight = constraint_weight * 2.0f / num_corners;
+			const float term_weight = constraint_weight * 2.0f / (num_corners * field.axis_spacing(d));
 
 			for (int corner = 0; corner < num_corners; ++corner) {
-				int corner_index = index;
+				Index corner_index = index;
 				for (int oa = 0; oa < num_dim; ++oa) {
 					int is_along_oa = (corner >> oa) % 2;
-					corner_index += field->strides[oa] * is_along_oa;
+					corner_index += field.strides[oa] * is_along_oa;
 				}
 				bool is_along_d = (corner >> d) % 2;
 				float sign = is_along_d ? +1.0f : -1.0f;
-				field->eq.triplets.emplace_back(row, corner_index, sign * term_weight);
+				eq->add_entry(corner_index, sign * term_weight);
 			}
-			field->eq.rhs.emplace_back(constraint_weight * gradient[d]);
+			eq->end_row(constraint_weight * gradient[d]);
 		}
 		return true;
 	} else if (kernel == GradientKernel::kLinearInteprolation) {
@@ -217,31 +336,31 @@ bool add_gradient_constraint(
 		We combine these constraints into one equation.
 		*/
 
-		const int num_dim = field->sizes.size();
+		const int num_dim = field.sizes.size();
 
 		float adjusted_pos[MAX_DIM];
 		for (int d = 0; d < num_dim; ++d) {
 			adjusted_pos[d] = pos[d] - 0.5f;
 		}
 
-		int inteprolation_indices[TWO_TO_MAX_DIM];
+		Index inteprolation_indices[TWO_TO_MAX_DIM];
 		float interpolation_kernel[TWO_TO_MAX_DIM];
-		int num_samples = multilerp(inteprolation_indices, interpolation_kernel, *field, adjusted_pos, 1);
+		int num_samples = multilerp(inteprolation_indices, interpolation_kernel, field, adjusted_pos, 1);
 		if (num_samples == 0) { return false; }
 
 		for (int d = 0; d < num_dim; ++d) {
-			int row = field->eq.rhs.size();
+			const float inv_spacing = 1.0f / field.axis_spacing(d);
 			float weight_sum = 0;
 			for (int i = 0; i < num_samples; ++i) {
 				// d f(x, y) / dx = gradient[0]
 				// d f(x, y) / dy = gradient[1]
 				// ...
 				const float sample_weight = interpolation_kernel[i] * constraint_weight;
-				field->eq.triplets.emplace_back(row, inteprolation_indices[i] + 0,                 -sample_weight);
-				field->eq.triplets.emplace_back(row, inteprolation_indices[i] + field->strides[d], +sample_weight);
+				eq->add_entry(inteprolation_indices[i] + 0,                 -sample_weight * inv_spacing);
+				eq->add_entry(inteprolation_indices[i] + field.strides[d], +sample_weight * inv_spacing);
 				weight_sum += sample_weight;
 			}
-			field->eq.rhs.emplace_back(weight_sum * gradient[d]);
+			eq->end_row(weight_sum * gradient[d]);
 		}
 
 		return true;
@@ -250,83 +369,111 @@ bool add_gradient_constraint(
 	}
 }
 
+bool add_gradient_constraint(
+	LatticeField*  field,
+	const float    pos[],
+	const float    gradient[],
+	float          constraint_weight,
+	GradientKernel kernel)
+{
+	const size_t begin = field->eq.num_rows();
+	const bool success = add_gradient_constraint(&field->eq, *field, pos, gradient, constraint_weight, kernel);
+	tag_rows(field, ConstraintClass::kDataGradient, begin);
+	return success;
+}
+
+/// Index of the lattice point `steps` along `d` from the point at `coordinate` (with index `index`).
+/// Wraps around if the point is past the end, which is only asked for along periodic axes.
+Index step_index(const LatticeField& field, const int coordinate[MAX_DIM], Index index, int d, int steps)
+{
+	const int wrapped = (coordinate[d] + steps) % field.sizes[d];
+	return index + static_cast<Index>(wrapped - coordinate[d]) * field.strides[d];
+}
+
 /// Add smoothness constraints at the given coordinate along the given dimension
 void add_model_constraint(
-	LatticeField*  field,
-	const Weights& weights,
-	const int      coordinate[MAX_DIM],
-	int            index,    // index of this value
-	int            d)        // dimension
+	LinearEquation*     eq,
+	const LatticeField& field,
+	const Weights&      weights,
+	const int           coordinate[MAX_DIM],
+	Index               index,    // index of this value
+	int                 d)        // dimension
 {
-	const int size     = field->sizes[d];
-	const int stride   = field->strides[d];
+	const int size     = field.sizes[d];
 	const int dim_cord = coordinate[d];
+	const bool wraps   = field.is_periodic(d);
+	const auto at      = [&](int steps) { return step_index(field, coordinate, index, d, steps); };
 
 	// These weights come from Pascal's triangle.
 	// See also https://en.wikipedia.org/wiki/Finite_difference_coefficient
+	// The n:th difference approximates spacingⁿ times the n:th derivative, hence the division by spacingⁿ:
+	const float h = field.axis_spacing(d);
 
 	if (weights.model_0 > 0 && 0 <= dim_cord && dim_cord < size) {
 		// f(x) = 0
 		// Tikhonov diagonal regularization
-		add_equation(&field->eq, Weight{weights.model_0}, Rhs{0.0f}, {
+		add_equation(eq, Weight{weights.model_0}, Rhs{0.0f}, {
 			{index, 1.0f},
 		});
 	}
 
-	if (weights.model_1 > 0 && 0 <= dim_cord && dim_cord + 1 < size) {
+	if (weights.model_1 > 0 && 0 <= dim_cord && (wraps || dim_cord + 1 < size)) {
 		// f′(x) = 0   ⇔   f(x) = f(x + 1)
-		add_equation(&field->eq, Weight{weights.model_1}, Rhs{0.0f}, {
-			{index + 0 * stride, -1.0f},
-			{index + 1 * stride, +1.0f},
+		add_equation(eq, Weight{weights.model_1 / h}, Rhs{0.0f}, {
+			{at(0), -1.0f},
+			{at(1), +1.0f},
 		});
 	}
 
-	if (weights.model_2 > 0 && 0 <= dim_cord && dim_cord + 2 < size) {
+	if (weights.model_2 > 0 && 0 <= dim_cord && (wraps || dim_cord + 2 < size)) {
 		// f″(x) = 0   ⇔   f′(x - ½) = f′(x + ½)
-		add_equation(&field->eq, Weight{weights.model_2}, Rhs{0.0f}, {
-			{index + 0 * stride, +1.0f},
-			{index + 1 * stride, -2.0f},
-			{index + 2 * stride, +1.0f},
+		add_equation(eq, Weight{weights.model_2 / (h * h)}, Rhs{0.0f}, {
+			{at(0), +1.0f},
+			{at(1), -2.0f},
+			{at(2), +1.0f},
 		});
 	}
 
-	if (weights.model_3 > 0 && 0 <= dim_cord && dim_cord + 3 < size) {
+	if (weights.model_3 > 0 && 0 <= dim_cord && (wraps || dim_cord + 3 < size)) {
 		// f‴(x) = 0   ⇔   f″(x - ½) = f″(x + ½)
-		add_equation(&field->eq, Weight{weights.model_3}, Rhs{0.0f}, {
-			{index + 0 * stride, +1.0f},
-			{index + 1 * stride, -3.0f},
-			{index + 2 * stride, +3.0f},
-			{index + 3 * stride, -1.0f},
+		add_equation(eq, Weight{weights.model_3 / (h * h * h)}, Rhs{0.0f}, {
+			{at(0), +1.0f},
+			{at(1), -3.0f},
+			{at(2), +3.0f},
+			{at(3), -1.0f},
 		});
 	}
 
-	if (weights.model_4 > 0 && 0 <= dim_cord && dim_cord + 4 < size) {
+	if (weights.model_4 > 0 && 0 <= dim_cord && (wraps || dim_cord + 4 < size)) {
 		// f⁗(x) = 0   ⇔   f‴(x - ½) = f‴(x + ½)
-		add_equation(&field->eq, Weight{weights.model_4}, Rhs{0.0f}, {
-			{index + 0 * stride, +1.0f},
-			{index + 1 * stride, -4.0f},
-			{index + 2 * stride, +6.0f},
-			{index + 3 * stride, -4.0f},
-			{index + 4 * stride, +1.0f},
+		add_equation(eq, Weight{weights.model_4 / (h * h * h * h)}, Rhs{0.0f}, {
+			{at(0), +1.0f},
+			{at(1), -4.0f},
+			{at(2), +6.0f},
+			{at(3), -4.0f},
+			{at(4), +1.0f},
 		});
 	}
 
-	if (weights.gradient_smoothness > 0 && 0 <= dim_cord && dim_cord + 1 < size) {
+	if (weights.gradient_smoothness > 0 && 0 <= dim_cord && (wraps || dim_cord + 1 < size)) {
 		// The gradient along d should be equal in two neighboring edges:
-		for (int orthogonal_dim = 0; orthogonal_dim < field->sizes.size(); ++orthogonal_dim) {
+		for (int orthogonal_dim = 0; orthogonal_dim < field.sizes.size(); ++orthogonal_dim) {
 			if (d == orthogonal_dim) { continue; }
-			if (coordinate[orthogonal_dim] + 1 >= field->sizes[orthogonal_dim]) { continue; }
-			add_equation(&field->eq, Weight{weights.gradient_smoothness}, Rhs{0.0f}, {
-				{index + 0 * field->strides[orthogonal_dim] + 0 * field->strides[d], -1.0f},
-				{index + 0 * field->strides[orthogonal_dim] + 1 * field->strides[d], +1.0f},
-				{index + 1 * field->strides[orthogonal_dim] + 0 * field->strides[d], +1.0f},
-				{index + 1 * field->strides[orthogonal_dim] + 1 * field->strides[d], -1.0f},
+			if (!field.is_periodic(orthogonal_dim) && coordinate[orthogonal_dim] + 1 >= field.sizes[orthogonal_dim]) { continue; }
+			const float mixed_weight = weights.gradient_smoothness / (h * field.axis_spacing(orthogonal_dim));
+			const Index step_d = at(1) - index;
+			const Index next_o = step_index(field, coordinate, index, orthogonal_dim, 1);
+			add_equation(eq, Weight{mixed_weight}, Rhs{0.0f}, {
+				{index,           -1.0f},
+				{index  + step_d, +1.0f},
+				{next_o,          +1.0f},
+				{next_o + step_d, -1.0f},
 			});
 		}
 	}
 }
 
-void coordinate_from_index(const LatticeField& field, int coordinate[MAX_DIM], int index)
+void coordinate_from_index(const LatticeField& field, int coordinate[MAX_DIM], Index index)
 {
 	for (int d = 0; d < field.sizes.size(); ++d) {
 		coordinate[d] = index % field.sizes[d];
@@ -334,76 +481,934 @@ void coordinate_from_index(const LatticeField& field, int coordinate[MAX_DIM], i
 	}
 }
 
+/// Number of lattice cells or data points assembled by each parallel job.
+const size_t ASSEMBLY_CHUNK_SIZE = 4096;
+
+size_t num_assembly_chunks(size_t num_items)
+{
+	return (num_items + ASSEMBLY_CHUNK_SIZE - 1) / ASSEMBLY_CHUNK_SIZE;
+}
+
+/// Empty `eq`, keeping its memory.
+void clear_equation(LinearEquation* eq)
+{
+	eq->row_starts.resize(1);
+	eq->cols.clear();
+	eq->values.clear();
+	eq->rhs.clear();
+}
+
+/// Append the equations of `num_items` items (e.g. lattice cells or data points) to `eq`, in item order.
+/// add_item(&item_eq, item) adds the equations of one item to an empty equation.
+/// The items are assembled twice, in parallel chunks: first to count the rows and non-zeros of each chunk,
+/// which gives where in `eq` each chunk goes, then to write them straight there.
+/// `item_eq` only ever holds one item, so it stays in cache, and no chunk is staged in a buffer of its own.
+template<typename AddItem>
+void assemble_in_place(LinearEquation* eq, size_t num_items, const AddItem& add_item)
+{
+	const size_t num_chunks = num_assembly_chunks(num_items);
+	if (num_chunks == 0) { return; }
+
+	// chunk_rows[i] will be the first row of chunk i, chunk_rows[num_chunks] the end. Same for the entries.
+	std::vector<size_t> chunk_rows(num_chunks + 1, 0);
+	std::vector<size_t> chunk_entries(num_chunks + 1, 0);
+	parallel_for_chunks(num_items, num_chunks, [&](size_t chunk_index, size_t begin, size_t end) {
+		LinearEquation item_eq;
+		for (size_t item = begin; item < end; ++item) {
+			add_item(&item_eq, item);
+			chunk_rows[chunk_index + 1]    += item_eq.num_rows();
+			chunk_entries[chunk_index + 1] += item_eq.num_nonzeros();
+			clear_equation(&item_eq);
+		}
+	});
+
+	chunk_rows[0]    = eq->num_rows();
+	chunk_entries[0] = eq->num_nonzeros();
+	for (size_t i = 0; i < num_chunks; ++i) {
+		chunk_rows[i + 1]    += chunk_rows[i];
+		chunk_entries[i + 1] += chunk_entries[i];
+	}
+	const size_t num_rows    = chunk_rows[num_chunks];
+	const size_t num_entries = chunk_entries[num_chunks];
+
+	CHECK_LE_F(num_entries, std::numeric_limits<Index>::max(), "Too many non-zeros for Index type");
+	eq->row_starts.resize(num_rows + 1);
+	eq->cols.resize(num_entries);
+	eq->values.resize(num_entries);
+	eq->rhs.resize(num_rows);
+
+	parallel_for_chunks(num_items, num_chunks, [&](size_t chunk_index, size_t begin, size_t end) {
+		LinearEquation item_eq;
+		size_t row   = chunk_rows[chunk_index];
+		size_t entry = chunk_entries[chunk_index];
+		for (size_t item = begin; item < end; ++item) {
+			add_item(&item_eq, item);
+			for (size_t item_row = 0; item_row < item_eq.num_rows(); ++item_row) {
+				eq->row_starts[row + item_row + 1] = entry + item_eq.row_starts[item_row + 1];
+			}
+			std::copy(item_eq.cols.begin(),   item_eq.cols.end(),   eq->cols.begin()   + entry);
+			std::copy(item_eq.values.begin(), item_eq.values.end(), eq->values.begin() + entry);
+			std::copy(item_eq.rhs.begin(),    item_eq.rhs.end(),    eq->rhs.begin()    + row);
+			row   += item_eq.num_rows();
+			entry += item_eq.num_nonzeros();
+			clear_equation(&item_eq);
+		}
+		CHECK_EQ_F(row,   chunk_rows[chunk_index + 1],    "Assembly is not deterministic");
+		CHECK_EQ_F(entry, chunk_entries[chunk_index + 1], "Assembly is not deterministic");
+	});
+}
+
+/// `weights` with all classes but the given one set to zero.
+Weights only_class_weights(const Weights& weights, ConstraintClass constraint_class)
+{
+	Weights result = unit_weights(constraint_class, weights);
+	result.data_pos            *= weights.data_pos;
+	result.data_gradient       *= weights.data_gradient;
+	result.model_0             *= weights.model_0;
+	result.model_1             *= weights.model_1;
+	result.model_2             *= weights.model_2;
+	result.model_3             *= weights.model_3;
+	result.model_4             *= weights.model_4;
+	result.gradient_smoothness *= weights.gradient_smoothness;
+	return result;
+}
+
+/// Number of lattice points along `d` which has `num_after` more lattice points after them.
+/// Along a periodic axis that is all of them.
+size_t num_with_room_after(const std::vector<int>& sizes, const std::vector<bool>& periodic, int d, int num_after)
+{
+	if (!periodic.empty() && periodic[d]) { return sizes[d]; }
+	return static_cast<size_t>(std::max(0, sizes[d] - num_after));
+}
+
+/// Number of rows and non-zeros one lattice point can add for the given class (all dimensions).
+EquationCapacity model_capacity_per_cell(size_t num_dim, ConstraintClass constraint_class)
+{
+	if (constraint_class == ConstraintClass::kGradientSmoothness) {
+		const size_t rows = num_dim * (num_dim - 1);
+		return EquationCapacity{rows, 4 * rows};
+	} else {
+		const size_t order = static_cast<size_t>(constraint_class); // kModel0 - kModel4
+		return EquationCapacity{num_dim, num_dim * (order + 1)};
+	}
+}
+
+EquationCapacity model_capacity(const std::vector<int>& sizes, const Weights& weights, const std::vector<bool>& periodic)
+{
+	size_t num_cells = 1;
+	for (const int size : sizes) {
+		num_cells *= size;
+	}
+	if (num_cells == 0) { return {}; }
+
+	EquationCapacity capacity;
+	for (int i = 0; i < NUM_MODEL_CONSTRAINT_CLASSES; ++i) {
+		const auto constraint_class = static_cast<ConstraintClass>(i);
+		if (class_weight(weights, constraint_class) <= 0) { continue; }
+		for (int d = 0; d < sizes.size(); ++d) {
+			if (constraint_class == ConstraintClass::kGradientSmoothness) {
+				for (int o = 0; o < sizes.size(); ++o) {
+					if (o == d) { continue; }
+					const size_t rows = num_cells / sizes[d] / sizes[o]
+						* num_with_room_after(sizes, periodic, d, 1) * num_with_room_after(sizes, periodic, o, 1);
+					capacity.rows     += rows;
+					capacity.nonzeros += 4 * rows;
+				}
+			} else {
+				const int order = i; // kModel0 - kModel4
+				const size_t rows = num_cells / sizes[d] * num_with_room_after(sizes, periodic, d, order);
+				capacity.rows     += rows;
+				capacity.nonzeros += (order + 1) * rows;
+			}
+		}
+	}
+	return capacity;
+}
+
+/// Upper bound of the rows and non-zeros added by one point in add_data_constraints.
+EquationCapacity data_capacity_per_point(size_t num_dim, const Weights& weights, bool has_normals)
+{
+	EquationCapacity capacity;
+	const size_t num_corners = size_t(1) << num_dim;
+	if (weights.data_pos != 0) {
+		capacity.rows     += 1;
+		capacity.nonzeros += weights.value_kernel == ValueKernel::kNearestNeighbor ? 1 : num_corners;
+	}
+	if (has_normals && weights.data_gradient != 0) {
+		capacity.rows += num_dim;
+		switch (weights.gradient_kernel) {
+			case GradientKernel::kNearestNeighbor:     capacity.nonzeros += num_dim * 2;               break;
+			case GradientKernel::kCellEdges:           capacity.nonzeros += num_dim * num_corners;     break;
+			case GradientKernel::kLinearInteprolation: capacity.nonzeros += num_dim * 2 * num_corners; break;
+		}
+	}
+	return capacity;
+}
+
+EquationCapacity data_capacity(size_t num_dim, const Weights& weights, size_t num_points, bool has_normals)
+{
+	const EquationCapacity per_point = data_capacity_per_point(num_dim, weights, has_normals);
+	return EquationCapacity{num_points * per_point.rows, num_points * per_point.nonzeros};
+}
+
 void add_field_constraints(
 	LatticeField*  field,
 	const Weights& weights)
 {
-	int num_unknowns = 1;
-	for (auto dimension_size : field->sizes) {
-		num_unknowns *= dimension_size;
+	const Index num_unknowns = field->num_unknowns();
+	field->eq.reserve_additional(model_capacity(field->sizes, weights, field->periodic));
+
+	// Each class is assembled into its own block of rows, so that field->row_classes stays short:
+	for (int i = 0; i < NUM_MODEL_CONSTRAINT_CLASSES; ++i) {
+		const auto constraint_class = static_cast<ConstraintClass>(i);
+		if (class_weight(weights, constraint_class) == 0) { continue; }
+		const Weights class_weights = only_class_weights(weights, constraint_class);
+
+		const size_t first_row = field->eq.num_rows();
+		assemble_in_place(&field->eq, num_unknowns, [&](LinearEquation* cell_eq, size_t index) {
+			int coordinate[MAX_DIM];
+			coordinate_from_index(*field, coordinate, index);
+			for (int d = 0; d < field->sizes.size(); ++d) {
+				add_model_constraint(cell_eq, *field, class_weights, coordinate, index, d);
+			}
+		});
+		tag_rows(field, constraint_class, first_row);
+	}
+}
+
+void add_field_constraints_in_box(
+	LatticeField*  field,
+	const Weights& weights,
+	const int      box_min[],
+	const int      box_max[])
+{
+	const int num_dim = field->sizes.size();
+	size_t num_cells_in_box = 1;
+	for (int d = 0; d < num_dim; ++d) {
+		CHECK_LE_F(0, box_min[d]);
+		CHECK_LE_F(box_max[d], field->sizes[d]);
+		num_cells_in_box *= std::max(0, box_max[d] - box_min[d]);
 	}
-	for (int index = 0; index < num_unknowns; ++index) {
+	if (num_cells_in_box == 0) { return; }
+
+	for (int i = 0; i < NUM_MODEL_CONSTRAINT_CLASSES; ++i) {
+		const auto constraint_class = static_cast<ConstraintClass>(i);
+		if (class_weight(weights, constraint_class) == 0) { continue; }
+		const Weights class_weights = only_class_weights(weights, constraint_class);
+		const EquationCapacity per_cell = model_capacity_per_cell(num_dim, constraint_class);
+		field->eq.reserve_additional({num_cells_in_box * per_cell.rows, num_cells_in_box * per_cell.nonzeros});
+
+		const size_t first_row = field->eq.num_rows();
 		int coordinate[MAX_DIM];
-		coordinate_from_index(*field, coordinate, index);
-		for (int d = 0; d < field->sizes.size(); ++d) {
-			add_model_constraint(field, weights, coordinate, index, d);
+		std::copy(box_min, box_min + num_dim, coordinate);
+		for (size_t cell = 0; cell < num_cells_in_box; ++cell) {
+			Index index = 0;
+			for (int d = 0; d < num_dim; ++d) {
+				index += coordinate[d] * field->strides[d];
+			}
+			for (int d = 0; d < num_dim; ++d) {
+				add_model_constraint(&field->eq, *field, class_weights, coordinate, index, d);
+			}
+			// Next coordinate, first dimension fastest:
+			for (int d = 0; d < num_dim; ++d) {
+				if (++coordinate[d] < box_max[d]) { break; }
+				coordinate[d] = box_min[d];
+			}
 		}
+		tag_rows(field, constraint_class, first_row);
 	}
 }
 
+float class_weight(const Weights& weights, ConstraintClass constraint_class)
+{
+	switch (constraint_class) {
+		case ConstraintClass::kModel0:             return weights.model_0;
+		case ConstraintClass::kModel1:             return weights.model_1;
+		case ConstraintClass::kModel2:             return weights.model_2;
+		case ConstraintClass::kModel3:             return weights.model_3;
+		case ConstraintClass::kModel4:             return weights.model_4;
+		case ConstraintClass::kGradientSmoothness: return weights.gradient_smoothness;
+		case ConstraintClass::kDataPos:            return weights.data_pos;
+		case ConstraintClass::kDataGradient:       return weights.data_gradient;
+	}
+	ABORT_F("Unknown constraint class: %d", static_cast<int>(constraint_class));
+}
+
+const char* constraint_class_name(ConstraintClass constraint_class)
+{
+	switch (constraint_class) {
+		case ConstraintClass::kModel0:             return "model_0";
+		case ConstraintClass::kModel1:             return "model_1";
+		case ConstraintClass::kModel2:             return "model_2";
+		case ConstraintClass::kModel3:             return "model_3";
+		case ConstraintClass::kModel4:             return "model_4";
+		case ConstraintClass::kGradientSmoothness: return "gradient_smoothness";
+		case ConstraintClass::kDataPos:            return "data_pos";
+		case ConstraintClass::kDataGradient:       return "data_gradient";
+	}
+	ABORT_F("Unknown constraint class: %d", static_cast<int>(constraint_class));
+}
+
+Weights unit_weights(ConstraintClass constraint_class, const Weights& kernels)
+{
+	Weights weights;
+	weights.data_pos            = constraint_class == ConstraintClass::kDataPos            ? 1 : 0;
+	weights.data_gradient       = constraint_class == ConstraintClass::kDataGradient       ? 1 : 0;
+	weights.model_0             = constraint_class == ConstraintClass::kModel0             ? 1 : 0;
+	weights.model_1             = constraint_class == ConstraintClass::kModel1             ? 1 : 0;
+	weights.model_2             = constraint_class == ConstraintClass::kModel2             ? 1 : 0;
+	weights.model_3             = constraint_class == ConstraintClass::kModel3             ? 1 : 0;
+	weights.model_4             = constraint_class == ConstraintClass::kModel4             ? 1 : 0;
+	weights.gradient_smoothness = constraint_class == ConstraintClass::kGradientSmoothness ? 1 : 0;
+	weights.gradient_kernel     = kernels.gradient_kernel;
+	weights.value_kernel        = kernels.value_kernel;
+	return weights;
+}
+
+ComponentPtr make_component(ConstraintClass constraint_class, Index num_unknowns, LinearEquation&& eq)
+{
+	auto component = std::make_shared<ConstraintComponent>();
+	component->constraint_class = constraint_class;
+	component->normal = make_normal_equation(num_unknowns, eq);
+	component->eq = std::move(eq);
+	return component;
+}
+
+WeightedSystem::WeightedSystem(Index num_unknowns, std::vector<ComponentPtr> components)
+	: _num_unknowns(num_unknowns), _components(std::move(components))
+{
+	LOG_SCOPE_F(INFO, "WeightedSystem");
+
+	_AtA_pattern = SparseMatrix(num_unknowns, num_unknowns);
+	for (const auto& component : _components) {
+		CHECK_EQ_F(component->normal.AtA.rows(), num_unknowns);
+		_AtA_pattern += component->normal.AtA;
+	}
+	_AtA_pattern.makeCompressed();
+
+	// Both the pattern and the components have sorted inner indices, so we can merge column by column:
+	for (const auto& component : _components) {
+		const SparseMatrix& AtA = component->normal.AtA;
+		std::vector<float> values(_AtA_pattern.nonZeros(), 0.0f);
+		parallel_for_chunks(num_unknowns, num_assembly_chunks(num_unknowns), [&](size_t, size_t begin, size_t end) {
+			for (Index col = begin; col < end; ++col) {
+				Index pattern_i = _AtA_pattern.outerIndexPtr()[col];
+				for (Index i = AtA.outerIndexPtr()[col]; i < AtA.outerIndexPtr()[col + 1]; ++i) {
+					while (_AtA_pattern.innerIndexPtr()[pattern_i] != AtA.innerIndexPtr()[i]) { ++pattern_i; }
+					values[pattern_i] = AtA.valuePtr()[i];
+				}
+			}
+		});
+		_AtA_values.push_back(std::move(values));
+	}
+}
+
+NormalEquation WeightedSystem::normal_equation(const Weights& weights) const
+{
+	LOG_SCOPE_F(INFO, "WeightedSystem::normal_equation");
+
+	std::vector<float> weights_sq;
+	for (const auto& component : _components) {
+		const float weight = class_weight(weights, component->constraint_class);
+		weights_sq.push_back(weight * weight);
+	}
+
+	NormalEquation normal;
+	normal.AtA = _AtA_pattern;
+	normal.Atb = VectorXr::Zero(_num_unknowns);
+
+	float* AtA_values = normal.AtA.valuePtr();
+	const size_t nnz = normal.AtA.nonZeros();
+	parallel_for_chunks(nnz, num_assembly_chunks(nnz), [&](size_t, size_t begin, size_t end) {
+		std::fill(AtA_values + begin, AtA_values + end, 0.0f);
+		for (size_t k = 0; k < _components.size(); ++k) {
+			if (weights_sq[k] == 0) { continue; }
+			const float* component_values = _AtA_values[k].data();
+			for (size_t i = begin; i < end; ++i) {
+				AtA_values[i] += weights_sq[k] * component_values[i];
+			}
+		}
+	});
+
+	for (size_t k = 0; k < _components.size(); ++k) {
+		if (weights_sq[k] != 0) {
+			normal.Atb += weights_sq[k] * _components[k]->normal.Atb;
+		}
+	}
+
+	return normal;
+}
+
+/// Blame of one row: its squared error, split over its unknowns in proportion to their coefficient².
+/// Returns the scaled squared error of the row.
+template<typename Scatter>
+float scatter_row_error(const LinearEquation& eq, size_t row, const float* solution, const float* residuals,
+                        float scale, const Scatter& scatter)
+{
+	const Index row_begin = eq.row_starts[row];
+	const Index row_end   = eq.row_starts[row + 1];
+	float error = residuals ? residuals[row] : -eq.rhs[row];
+	float sum_of_value_sq = 0;
+	for (Index entry = row_begin; entry < row_end; ++entry) {
+		if (!residuals) { error += solution[eq.cols[entry]] * eq.values[entry]; }
+		sum_of_value_sq += eq.values[entry] * eq.values[entry];
+	}
+	const float error_sq = scale * error * error;
+	if (sum_of_value_sq == 0) { return error_sq; }
+	const float blame_per_value_sq = error_sq / sum_of_value_sq;
+	for (Index entry = row_begin; entry < row_end; ++entry) {
+		scatter(eq.cols[entry], blame_per_value_sq * eq.values[entry] * eq.values[entry]);
+	}
+	return error_sq;
+}
+
+/// heatmap += scale * generate_error_map(eq, solution) for the rows [row_begin, row_end),
+/// in parallel over those rows. Returns their total scaled squared error.
+/// The columns are split into one range per thread, and each row goes to the range of its first unknown.
+/// Rows are local, so nearly all of the blame lands in the range, which its thread owns and
+/// adds to `heatmap` directly. The little that spills over a range boundary is added afterwards.
+/// Rows are first counting-sorted by range, since e.g. data rows come in point order, not spatially.
+double add_error_map(
+	std::vector<float>*       heatmap,
+	const LinearEquation&     eq,
+	size_t                    row_begin,
+	size_t                    row_end,
+	const std::vector<float>& solution,
+	float                     scale,
+	const float*              residuals)
+{
+	CHECK_EQ_F(heatmap->size(), solution.size());
+	CHECK_LE_F(row_begin, row_end);
+	CHECK_LE_F(row_end, eq.num_rows());
+	const size_t num_rows = row_end - row_begin;
+	if (num_rows == 0) { return 0; }
+
+	const size_t num_chunks = std::min(num_worker_threads(), num_assembly_chunks(num_rows));
+	float* out = heatmap->data();
+
+	if (num_chunks <= 1) {
+		double total = 0;
+		for (size_t row = row_begin; row < row_end; ++row) {
+			total += scatter_row_error(eq, row, solution.data(), residuals, scale, [=](Index col, float blame) {
+				out[col] += blame;
+			});
+		}
+		return total;
+	}
+
+	const size_t num_cols    = heatmap->size();
+	const size_t num_ranges  = num_chunks;
+	const size_t range_width = (num_cols + num_ranges - 1) / num_ranges;
+	const auto range_of_row = [&](size_t row) -> size_t {
+		const size_t first = eq.row_starts[row];
+		return first == eq.row_starts[row + 1] ? 0 : eq.cols[first] / range_width;
+	};
+
+	// Counting sort of the rows by range, stable so that the summation order is deterministic.
+	// Both passes split the rows the same way, so each chunk knows where its rows of each range go:
+	std::vector<std::vector<size_t>> offsets(num_chunks, std::vector<size_t>(num_ranges, 0));
+	parallel_for_chunks(num_rows, num_chunks, [&](size_t chunk_index, size_t begin, size_t end) {
+		for (size_t row = row_begin + begin; row < row_begin + end; ++row) {
+			offsets[chunk_index][range_of_row(row)] += 1;
+		}
+	});
+
+	std::vector<size_t> range_starts(num_ranges + 1, 0);
+	for (size_t range = 0, offset = 0; range < num_ranges; ++range) {
+		range_starts[range] = offset;
+		for (auto& chunk_offsets : offsets) {
+			const size_t count = chunk_offsets[range];
+			chunk_offsets[range] = offset;
+			offset += count;
+		}
+	}
+	range_starts[num_ranges] = num_rows;
+
+	std::vector<size_t> sorted_rows(num_rows);
+	parallel_for_chunks(num_rows, num_chunks, [&](size_t chunk_index, size_t begin, size_t end) {
+		std::vector<size_t>& chunk_offsets = offsets[chunk_index];
+		for (size_t row = row_begin + begin; row < row_begin + end; ++row) {
+			sorted_rows[chunk_offsets[range_of_row(row)]++] = row;
+		}
+	});
+
+	std::vector<std::vector<std::pair<Index, float>>> spills(num_ranges);
+	std::vector<double> totals(num_ranges, 0.0);
+	parallel_for_chunks(num_ranges, num_ranges, [&](size_t range, size_t, size_t) {
+		const size_t col_begin = range * range_width;
+		const size_t col_end   = std::min(num_cols, col_begin + range_width);
+		std::vector<std::pair<Index, float>>& spill = spills[range];
+		for (size_t i = range_starts[range]; i < range_starts[range + 1]; ++i) {
+			totals[range] += scatter_row_error(eq, sorted_rows[i], solution.data(), residuals, scale,
+				[&](Index col, float blame) {
+					if (col_begin <= static_cast<size_t>(col) && static_cast<size_t>(col) < col_end) {
+						out[col] += blame;
+					} else {
+						spill.emplace_back(col, blame);
+					}
+				});
+		}
+	});
+
+	double total = 0;
+	for (size_t range = 0; range < num_ranges; ++range) {
+		for (const auto& col_and_blame : spills[range]) {
+			out[col_and_blame.first] += col_and_blame.second;
+		}
+		total += totals[range];
+	}
+	return total;
+}
+
+std::vector<float> WeightedSystem::error_map(const Weights& weights, const std::vector<float>& solution) const
+{
+	// The blame fractions does not depend on the weight of a row, and the squared error goes with w².
+	std::vector<float> heatmap(solution.size(), 0.0f);
+	for (const auto& component : _components) {
+		const float weight = class_weight(weights, component->constraint_class);
+		if (weight == 0) { continue; }
+		add_error_map(&heatmap, component->eq, 0, component->eq.num_rows(), solution, weight * weight, nullptr);
+	}
+	return heatmap;
+}
+
+/// Add a class heatmap to a breakdown, allocating it if needed.
+std::vector<float>* class_heatmap(ErrorBreakdown* breakdown, ConstraintClass constraint_class, size_t size)
+{
+	std::vector<float>& heatmap = breakdown->heatmaps[static_cast<int>(constraint_class)];
+	if (heatmap.empty()) { heatmap.resize(size, 0.0f); }
+	return &heatmap;
+}
+
+/// breakdown.heatmap = sum of breakdown.heatmaps
+void sum_class_heatmaps(ErrorBreakdown* breakdown, size_t size)
+{
+	breakdown->heatmap.assign(size, 0.0f);
+	parallel_for_chunks(size, num_assembly_chunks(size), [&](size_t, size_t begin, size_t end) {
+		for (const auto& heatmap : breakdown->heatmaps) {
+			if (heatmap.empty()) { continue; }
+			for (size_t i = begin; i < end; ++i) {
+				breakdown->heatmap[i] += heatmap[i];
+			}
+		}
+	});
+}
+
+/// Add the weighted components to the breakdown.
+void add_error_breakdown(
+	ErrorBreakdown*                  breakdown,
+	const std::vector<ComponentPtr>& components,
+	const Weights&                   weights,
+	const std::vector<float>&        solution)
+{
+	for (const auto& component : components) {
+		const float weight = class_weight(weights, component->constraint_class);
+		if (weight == 0) { continue; }
+		std::vector<float>* heatmap = class_heatmap(breakdown, component->constraint_class, solution.size());
+		breakdown->totals[static_cast<int>(component->constraint_class)] +=
+			add_error_map(heatmap, component->eq, 0, component->eq.num_rows(), solution, weight * weight, nullptr);
+	}
+}
+
+ErrorBreakdown WeightedSystem::error_breakdown(const Weights& weights, const std::vector<float>& solution) const
+{
+	ErrorBreakdown breakdown;
+	add_error_breakdown(&breakdown, _components, weights, solution);
+	sum_class_heatmaps(&breakdown, solution.size());
+	return breakdown;
+}
+
+size_t WeightedSystem::num_equations() const
+{
+	size_t num_equations = 0;
+	for (const auto& component : _components) {
+		num_equations += component->eq.num_rows();
+	}
+	return num_equations;
+}
+
+size_t WeightedSystem::num_nonzeros() const
+{
+	size_t num_nonzeros = 0;
+	for (const auto& component : _components) {
+		num_nonzeros += component->eq.num_nonzeros();
+	}
+	return num_nonzeros;
+}
+
+/// The model classes which have a non-zero weight.
+std::vector<ConstraintClass> active_model_classes(const Weights& weights)
+{
+	std::vector<ConstraintClass> classes;
+	for (int i = 0; i < NUM_MODEL_CONSTRAINT_CLASSES; ++i) {
+		const auto constraint_class = static_cast<ConstraintClass>(i);
+		if (class_weight(weights, constraint_class) > 0) {
+			classes.push_back(constraint_class);
+		}
+	}
+	return classes;
+}
+
+std::shared_ptr<const ModelSystem> ModelSystemCache::get(
+	const LatticeField& lattice,
+	const Weights&      weights)
+{
+	const std::vector<int>&   sizes    = lattice.sizes;
+	const std::vector<float>& spacing  = lattice.spacing;
+	const std::vector<bool>&  periodic = lattice.periodic;
+	const std::vector<ConstraintClass> classes = active_model_classes(weights);
+
+	SystemFuture future;
+	std::promise<std::shared_ptr<const WeightedSystem>> promise; // Set if this call assembles the system.
+	bool assemble = false;
+	std::vector<ComponentPtr> reusable; // Components of other entries with the same lattice.
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		auto it = _entries.begin();
+		for (; it != _entries.end(); ++it) {
+			if (it->sizes == sizes && it->spacing == spacing && it->periodic == periodic && it->classes == classes) { break; }
+		}
+
+		if (it != _entries.end()) {
+			_entries.splice(_entries.begin(), _entries, it);
+			future = it->system;
+		} else {
+			for (const auto& entry : _entries) {
+				if (entry.sizes != sizes || entry.spacing != spacing || entry.periodic != periodic) { continue; }
+				if (entry.system.wait_for(std::chrono::seconds(0)) != std::future_status::ready) { continue; }
+				for (const auto& existing : entry.system.get()->components()) {
+					reusable.push_back(existing);
+				}
+			}
+
+			// A placeholder, so that others asking for the same system wait for this one:
+			future = promise.get_future().share();
+			assemble = true;
+			_entries.push_front(Entry{sizes, spacing, periodic, classes, future});
+			if (_entries.size() > _capacity) {
+				_entries.pop_back();
+			}
+		}
+	}
+
+	if (assemble) {
+		LOG_SCOPE_F(INFO, "Assembling model system");
+		std::vector<ComponentPtr> components;
+		for (const auto constraint_class : classes) {
+			ComponentPtr component;
+			for (const auto& existing : reusable) {
+				if (existing->constraint_class == constraint_class) { component = existing; }
+			}
+			if (!component) {
+				LatticeField field = spacing.empty() ? LatticeField{sizes} : LatticeField{sizes, spacing};
+				field.periodic = periodic;
+				add_field_constraints(&field, unit_weights(constraint_class, weights));
+				component = make_component(constraint_class, field.num_unknowns(), std::move(field.eq));
+			}
+			components.push_back(component);
+		}
+
+		const Index num_unknowns = LatticeField{sizes}.num_unknowns();
+		const auto system = std::make_shared<const WeightedSystem>(num_unknowns, std::move(components));
+		promise.set_value(system);
+	}
+
+	auto model_system = std::make_shared<ModelSystem>();
+	model_system->components = future.get();
+	model_system->weights = weights;
+	return model_system;
+}
+
+void add_field_constraints(
+	LatticeField*     field,
+	const Weights&    weights,
+	ModelSystemCache* cache)
+{
+	CHECK_NOTNULL_F(cache);
+	CHECK_F(!field->model, "Field already has model constraints");
+	field->model = cache->get(*field, weights);
+}
+
 LatticeField sdf_from_points(
 	const std::vector<int>& sizes,
 	const Weights&          weights,
 	const int               num_points,
 	const float             positions[],
 	const float*            normals,
-	const float*            point_weights)
+	const float*            point_weights,
+	ModelSystemCache*       model_cache)
 {
 	LOG_SCOPE_F(INFO, "sdf_from_points");
 	CHECK_NOTNULL_F(positions);
 
-	int num_dim = sizes.size();
 	LatticeField field{sizes};
+	add_sdf_constraints(&field, weights, num_points, positions, normals, point_weights, model_cache);
+	return field;
+}
+
+void add_sdf_constraints(
+	LatticeField*     field,
+	const Weights&    weights,
+	const int         num_points,
+	const float       positions[],
+	const float*      normals,
+	const float*      point_weights,
+	ModelSystemCache* model_cache)
+{
+	CHECK_NOTNULL_F(positions);
+
+	// Reserve everything up front, so that the equation is never reallocated:
+	EquationCapacity capacity = data_capacity(field->sizes.size(), weights, num_points, normals != nullptr);
+	if (!model_cache) {
+		const EquationCapacity model = model_capacity(field->sizes, weights, field->periodic);
+		capacity.rows     += model.rows;
+		capacity.nonzeros += model.nonzeros;
+	}
+	field->eq.reserve_additional(capacity);
 
-	add_field_constraints(&field, weights);
+	if (model_cache) {
+		add_field_constraints(field, weights, model_cache);
+	} else {
+		add_field_constraints(field, weights);
+	}
 
-	for (int i = 0; i < num_points; ++i) {
-		float weight = point_weights ? point_weights[i] : 1.0f;
-		const float* pos = positions + i * num_dim;
-		add_value_constraint(&field, pos, 0.0f, weight * weights.data_pos);
-		if (normals) {
-			add_gradient_constraint(&field, pos, normals + i * num_dim, weight * weights.data_gradient, weights.gradient_kernel);
+	add_data_constraints(field, weights, num_points, positions, normals, point_weights);
+}
+
+void add_data_constraints(
+	LatticeField*  field,
+	const Weights& weights,
+	const int      num_points,
+	const float    positions[],
+	const float*   normals,
+	const float*   point_weights)
+{
+	CHECK_NOTNULL_F(positions);
+	const int num_dim = field->sizes.size();
+
+	field->eq.reserve_additional(data_capacity(num_dim, weights, num_points, normals != nullptr));
+
+	// All value constraints first, then all gradient constraints, so that they form one row range each:
+	if (weights.data_pos != 0) {
+		const size_t first_value_row = field->eq.num_rows();
+		assemble_in_place(&field->eq, num_points, [&](LinearEquation* point_eq, size_t i) {
+			const float weight = point_weights ? point_weights[i] : 1.0f;
+			const float* pos = positions + i * num_dim;
+			if (weights.value_kernel == ValueKernel::kNearestNeighbor) {
+				const float* normal = normals ? normals + i * num_dim : nullptr;
+				add_nearest_value_constraint(point_eq, *field, pos, 0.0f, normal, weight * weights.data_pos);
+			} else {
+				add_value_constraint(point_eq, *field, pos, 0.0f, weight * weights.data_pos);
+			}
+		});
+		tag_rows(field, ConstraintClass::kDataPos, first_value_row);
+	}
+
+	if (normals && weights.data_gradient != 0) {
+		const size_t first_gradient_row = field->eq.num_rows();
+		assemble_in_place(&field->eq, num_points, [&](LinearEquation* point_eq, size_t i) {
+			const float weight = point_weights ? point_weights[i] : 1.0f;
+			add_gradient_constraint(point_eq, *field, positions + i * num_dim, normals + i * num_dim,
+			                        weight * weights.data_gradient, weights.gradient_kernel);
+		});
+		tag_rows(field, ConstraintClass::kDataGradient, first_gradient_row);
+	}
+}
+
+/// Sum each cell of `grid` with its two neighbors along axis `d`.
+std::vector<float> box_sum_along(const std::vector<float>& grid, const std::vector<int>& grid_sizes, int d)
+{
+	size_t stride = 1;
+	for (int i = 0; i < d; ++i) {
+		stride *= grid_sizes[i];
+	}
+	const int size = grid_sizes[d];
+
+	std::vector<float> result(grid.size());
+	parallel_for_chunks(grid.size(), num_assembly_chunks(grid.size()), [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			const int coordinate = (i / stride) % size;
+			float sum = grid[i];
+			if (coordinate > 0)        { sum += grid[i - stride]; }
+			if (coordinate + 1 < size) { sum += grid[i + stride]; }
+			result[i] = sum;
 		}
+	});
+	return result;
+}
+
+std::vector<float> density_weights(
+	const std::vector<int>&     sizes,
+	const int                   num_points,
+	const float                 positions[],
+	const DensityWeightOptions& options)
+{
+	LOG_SCOPE_F(INFO, "density_weights");
+	CHECK_NOTNULL_F(positions);
+	CHECK_GT_F(options.cell_size, 0.0f);
+	CHECK_GE_F(options.strength, 0.0f);
+	CHECK_GT_F(options.max_weight, 0.0f);
+	const int num_dim = sizes.size();
+	CHECK_F(1 <= num_dim && num_dim <= MAX_DIM);
+
+	std::vector<int> grid_sizes(num_dim);
+	size_t num_cells = 1;
+	for (int d = 0; d < num_dim; ++d) {
+		grid_sizes[d] = std::max(1, static_cast<int>(std::ceil(sizes[d] / options.cell_size)));
+		num_cells *= grid_sizes[d];
 	}
 
-	return field;
+	// The cell of each point. Points outside the lattice are counted in the nearest cell:
+	std::vector<size_t> cells(num_points);
+	parallel_for_chunks(num_points, num_assembly_chunks(num_points), [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			size_t cell = 0;
+			size_t stride = 1;
+			for (int d = 0; d < num_dim; ++d) {
+				const int coordinate = static_cast<int>(std::floor(positions[i * num_dim + d] / options.cell_size));
+				cell += stride * std::min(std::max(coordinate, 0), grid_sizes[d] - 1);
+				stride *= grid_sizes[d];
+			}
+			cells[i] = cell;
+		}
+	});
+
+	// Each chunk counts into a histogram of its own, so no atomics are needed.
+	// A fine grid and few points would make that a lot of memory, so then use fewer chunks:
+	const size_t num_histograms = std::max<size_t>(1,
+		std::min(num_assembly_chunks(num_points), num_points / num_cells));
+	std::vector<std::vector<uint32_t>> histograms(num_histograms);
+	parallel_for_chunks(num_points, num_histograms, [&](size_t chunk_index, size_t begin, size_t end) {
+		std::vector<uint32_t>& histogram = histograms[chunk_index];
+		histogram.assign(num_cells, 0);
+		for (size_t i = begin; i < end; ++i) {
+			histogram[cells[i]] += 1;
+		}
+	});
+
+	std::vector<float> density(num_cells);
+	parallel_for_chunks(num_cells, num_assembly_chunks(num_cells), [&](size_t, size_t begin, size_t end) {
+		for (size_t cell = begin; cell < end; ++cell) {
+			uint32_t count = 0;
+			for (const auto& histogram : histograms) {
+				count += histogram[cell];
+			}
+			density[cell] = count;
+		}
+	});
+	histograms.clear();
+
+	// A cell which a surface only clips the corner of has few points, so would get a large weight.
+	// The points within a 3x3(x3...) block of cells are a much less noisy measure of the density:
+	for (int d = 0; d < num_dim; ++d) {
+		density = box_sum_along(density, grid_sizes, d);
+	}
+
+	// w = density^-strength, normalized so that the mean weight is one:
+	std::vector<float> weights(num_points);
+	const size_t num_chunks = num_assembly_chunks(num_points);
+	std::vector<double> chunk_sums(num_chunks, 0.0);
+	parallel_for_chunks(num_points, num_chunks, [&](size_t chunk_index, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			weights[i] = std::pow(density[cells[i]], -options.strength);
+			chunk_sums[chunk_index] += weights[i];
+		}
+	});
+
+	double sum = 0;
+	for (const double chunk_sum : chunk_sums) {
+		sum += chunk_sum;
+	}
+	const float scale = sum > 0 ? num_points / sum : 1.0f;
+
+	parallel_for_chunks(num_points, num_chunks, [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			weights[i] = std::min(scale * weights[i], options.max_weight);
+		}
+	});
+
+	LOG_F(1, "%d points in %lu histogram cells", num_points, num_cells);
+	return weights;
 }
 
-std::vector<float> generate_error_map(
-	const std::vector<Triplet>& triplets,
-	const std::vector<float>&   solution,
-	const std::vector<float>&   rhs)
+WeightedSystem sdf_system_from_points(
+	const std::vector<int>& sizes,
+	const Weights&          weights,
+	const int               num_points,
+	const float             positions[],
+	const float*            normals,
+	const float*            point_weights,
+	ModelSystemCache*       model_cache)
 {
-	std::vector<float> row_errors = rhs;
-	std::vector<float> sum_of_value_sq(rhs.size(), 0.0f);
+	LOG_SCOPE_F(INFO, "sdf_system_from_points");
+	CHECK_NOTNULL_F(model_cache);
+
+	std::vector<ComponentPtr> components = model_cache->get(LatticeField{sizes}, weights)->components->components();
 
-	for (const auto& triplet : triplets) {
-		row_errors[triplet.row] -= solution[triplet.col] * triplet.value;
-		sum_of_value_sq[triplet.row] += triplet.value * triplet.value;
+	for (const auto constraint_class : {ConstraintClass::kDataPos, ConstraintClass::kDataGradient}) {
+		if (class_weight(weights, constraint_class) == 0) { continue; }
+		if (constraint_class == ConstraintClass::kDataGradient && !normals) { continue; }
+		LatticeField field{sizes};
+		add_data_constraints(&field, unit_weights(constraint_class, weights),
+		                     num_points, positions, normals, point_weights);
+		components.push_back(make_component(constraint_class, field.num_unknowns(), std::move(field.eq)));
 	}
 
-	for (auto& error : row_errors) {
-		error *= error;
+	return WeightedSystem(LatticeField{sizes}.num_unknowns(), std::move(components));
+}
+
+NormalEquation make_normal_equation(const LatticeField& field)
+{
+	NormalEquation normal = make_normal_equation(field.num_unknowns(), field.eq);
+	if (field.model) {
+		add_normal_equation(&normal, field.model->components->normal_equation(field.model->weights));
 	}
+	return normal;
+}
 
+std::vector<float> generate_error_map(
+	const LinearEquation&     eq,
+	const std::vector<float>& solution,
+	const std::vector<float>* residuals)
+{
+	if (residuals) {
+		CHECK_EQ_F(residuals->size(), eq.num_rows());
+	}
 	std::vector<float> heatmap(solution.size(), 0.0f);
+	add_error_map(&heatmap, eq, 0, eq.num_rows(), solution, 1.0f, residuals ? residuals->data() : nullptr);
+	return heatmap;
+}
 
-	for (const auto& triplet : triplets) {
-		if (sum_of_value_sq[triplet.row] != 0) {
-			float blame_fraction = (triplet.value * triplet.value) / sum_of_value_sq[triplet.row];
-			heatmap[triplet.col] += blame_fraction * row_errors[triplet.row];
+std::vector<float> generate_error_map(
+	const LatticeField&       field,
+	const std::vector<float>& solution)
+{
+	std::vector<float> heatmap(solution.size(), 0.0f);
+	add_error_map(&heatmap, field.eq, 0, field.eq.num_rows(), solution, 1.0f, nullptr);
+	if (field.model) {
+		const std::vector<float> model_heatmap = field.model->components->error_map(field.model->weights, solution);
+		for (size_t i = 0; i < heatmap.size(); ++i) {
+			heatmap[i] += model_heatmap[i];
 		}
 	}
-
 	return heatmap;
 }
+
+ErrorBreakdown generate_error_breakdown(
+	const LatticeField&       field,
+	const std::vector<float>& solution)
+{
+	LOG_SCOPE_F(INFO, "generate_error_breakdown");
+	ErrorBreakdown breakdown;
+	for (const RowRange& range : field.row_classes) {
+		std::vector<float>* heatmap = class_heatmap(&breakdown, range.constraint_class, solution.size());
+		breakdown.totals[static_cast<int>(range.constraint_class)] +=
+			add_error_map(heatmap, field.eq, range.begin, range.end, solution, 1.0f, nullptr);
+	}
+	if (field.model) {
+		add_error_breakdown(&breakdown, field.model->components->components(), field.model->weights, solution);
+	}
+	sum_class_heatmaps(&breakdown, solution.size());
+	return breakdown;
+}
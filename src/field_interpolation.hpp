@@ -1,6 +1,10 @@
 #pragma once
 
+#include <future>
 #include <iosfwd>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include "sparse_linear.hpp"
@@ -33,13 +37,24 @@ Example use cases:
 	* Generate a signed distance field (sdf) from a set of surface points
 
 The lattice coordinates go from [0, 0, ...] to [width - 1, height - 1, ...] (inclusive).
+Positions are always given in lattice coordinates. The lattice points may however be further apart
+along some axes than others (see LatticeField::spacing), in which case gradients are per physical unit.
 */
 
 /// There is no technical limit to this,
-/// but note that add_value_constraint adds 2^D equations.
+/// but note that add_value_constraint adds 2^D terms per point.
 /// For this reason you may want to to spread your constraints
-/// with nearest-neighbor instead, if your dimensionality is high.
-const int MAX_DIM = 3;
+/// with nearest-neighbor instead, if your dimensionality is high
+/// (ValueKernel::kNearestNeighbor and GradientKernel::kNearestNeighbor keep it at O(D) per point).
+/// For space-time lattices, see also SolveOptions::tile_dims.
+const int MAX_DIM = 6;
+
+/// When adding a value constraint, how shall it be applied?
+enum class ValueKernel
+{
+	kMultilinear,     ///< Interpolate between the 2^D corners of the cell.
+	kNearestNeighbor, ///< Apply to the closest lattice point only. With a normal, the value is moved along it to that point.
+};
 
 /// When adding a gradient condition, how shall it be applied?
 enum class GradientKernel
@@ -54,7 +69,8 @@ enum class GradientKernel
 /// If your model is smooth, use a high model_2 and low everything else.
 /// If your data is trustworthy, you should lower the model weights (e.g. 1/10th of the data weights).
 /// If your data is noisy, you should use higher model weights.
-/// If your data is lopsided (a lot of points in one area, fewer in another) you should lower model_1.
+/// If your data is lopsided (a lot of points in one area, fewer in another) you should lower model_1,
+/// or even out the data with density_weights.
 /// Note that if you increase the resolution of your lattice, you should modify the model weights.
 /// In particular:
 ///     model_0 = constant_0 * resolution
@@ -62,6 +78,8 @@ enum class GradientKernel
 ///     model_2 = constant_2 / resolution
 ///     model_3 = constant_3 / resolution^2
 /// Where resolution is e.g. the width of your lattice.
+/// With a LatticeField::spacing the finite differences are scaled to physical units, so the weights
+/// behave the same along all axes, and scale with 1 / spacing in the same way.
 /// Higher orders of smoothness increases the computational cost!
 struct Weights
 {
@@ -81,38 +99,181 @@ struct Weights
 	float gradient_smoothness = 0.0f;
 
 	GradientKernel gradient_kernel = GradientKernel::kCellEdges;
-};
-
-/// Sparse Ax=b where A is described by `triplets` and `rhs` is b.
-struct LinearEquation
-{
-	std::vector<Triplet> triplets;
-	std::vector<float>   rhs;
+	ValueKernel    value_kernel    = ValueKernel::kMultilinear;
 };
 
 std::ostream& operator<<(std::ostream& os, const LinearEquation& eq);
 
 struct LinearEquationPair
 {
-	int   column;
+	Index column;
 	float value;
 };
 
+/// The different kinds of constraints, each with its own weight in Weights.
+enum class ConstraintClass
+{
+	kModel0,
+	kModel1,
+	kModel2,
+	kModel3,
+	kModel4,
+	kGradientSmoothness,
+	kDataPos,
+	kDataGradient,
+};
+
+const int NUM_CONSTRAINT_CLASSES = 8;
+const int NUM_MODEL_CONSTRAINT_CLASSES = 6; ///< kModel0 - kGradientSmoothness
+
+/// E.g. "model_2" or "data_pos".
+const char* constraint_class_name(ConstraintClass constraint_class);
+
+/// The weight that `weights` gives to the given constraint class.
+float class_weight(const Weights& weights, ConstraintClass constraint_class);
+
+/// A Weights where the given class has weight one, and all others zero.
+/// The kernels are those of `kernels`.
+Weights unit_weights(ConstraintClass constraint_class, const Weights& kernels);
+
+/// One class of constraints assembled with unit weight, together with its normal equations.
+struct ConstraintComponent
+{
+	ConstraintClass constraint_class;
+	LinearEquation  eq;
+	NormalEquation  normal;
+};
+
+using ComponentPtr = std::shared_ptr<const ConstraintComponent>;
+
+/// Back-projected error (see generate_error_map) split up by constraint class.
+struct ErrorBreakdown
+{
+	std::vector<float> heatmap;                          ///< Sum of all classes.
+	std::vector<float> heatmaps[NUM_CONSTRAINT_CLASSES]; ///< Empty for classes without any equations.
+	double             totals[NUM_CONSTRAINT_CLASSES] = {}; ///< Sum of squared (weighted) errors of each class.
+};
+
+/// A system kept as separately assembled unit-weight components:
+///     AtA = Σ w_k² · AtA_k,   Atb = Σ w_k² · Atb_k
+/// where w_k is the weight of the class of component k.
+/// All components are merged onto one sparsity pattern up front,
+/// so changing the weights only requires re-computing the values of AtA, not a re-assembly.
+class WeightedSystem
+{
+public:
+	WeightedSystem() = default;
+	WeightedSystem(Index num_unknowns, std::vector<ComponentPtr> components);
+
+	/// Classes without a component are ignored, whatever their weight.
+	NormalEquation normal_equation(const Weights& weights) const;
+
+	/// generate_error_map for the weighted sum of all components.
+	std::vector<float> error_map(const Weights& weights, const std::vector<float>& solution) const;
+
+	/// The same error map, split up by constraint class.
+	ErrorBreakdown error_breakdown(const Weights& weights, const std::vector<float>& solution) const;
+
+	const std::vector<ComponentPtr>& components() const { return _components; }
+	Index num_unknowns() const { return _num_unknowns; }
+	size_t num_equations() const;
+	size_t num_nonzeros() const;
+
+private:
+	Index                           _num_unknowns = 0;
+	std::vector<ComponentPtr>       _components;
+	SparseMatrix                    _AtA_pattern; ///< Union of the patterns of all components.
+	std::vector<std::vector<float>> _AtA_values;  ///< For each component: its AtA values in _AtA_pattern.
+};
+
+/// The model constraints of a lattice (see add_field_constraints) with some given weights.
+struct ModelSystem
+{
+	std::shared_ptr<const WeightedSystem> components; ///< One per model class with non-zero weight.
+	Weights                               weights;
+};
+
+/// The rows [begin, end) of an equation all belong to the same constraint class.
+struct RowRange
+{
+	ConstraintClass constraint_class;
+	size_t          begin;
+	size_t          end;
+};
+
 struct LatticeField
 {
-	LinearEquation   eq;      ///< Accumulated equations.
-	std::vector<int> sizes;   ///< sizes[d] == size of dimension `d`
-	std::vector<int> strides; ///< stride[d] == distance between adjacent values along dimension `d`
+	LinearEquation        eq;          ///< Accumulated equations.
+	std::vector<int>      sizes;       ///< sizes[d] == size of dimension `d`
+	std::vector<Index>    strides;     ///< stride[d] == distance between adjacent values along dimension `d`
+	std::vector<float>    spacing;     ///< spacing[d] == physical distance between adjacent lattice points along dimension `d`. Empty means all 1.
+	std::vector<bool>     periodic;    ///< periodic[d] == the lattice wraps around along dimension `d`. Empty means no axis wraps.
+	std::vector<RowRange> row_classes; ///< Class of the rows in `eq`. Rows added directly with add_equation are not covered.
+
+	/// Optional shared model constraints, coming from a ModelSystemCache.
+	/// These are NOT part of `eq`, but are still part of the system to solve.
+	std::shared_ptr<const ModelSystem> model;
 
 	LatticeField() = default;
-	explicit LatticeField(const std::vector<int>& sizes_arg) : sizes(sizes_arg)
+
+	/// Aborts if the number of unknowns does not fit in Index.
+	explicit LatticeField(const std::vector<int>& sizes_arg);
+
+	/// An anisotropic lattice, e.g. a thin volume with a coarser spacing along z than x and y.
+	/// The finite differences of the model constraints and the gradient constraints are scaled
+	/// by the spacing of their axis, so that fewer lattice points can be used along coarse axes.
+	LatticeField(const std::vector<int>& sizes_arg, const std::vector<float>& spacing_arg);
+
+	/// spacing[d], or 1 if there is no spacing.
+	float axis_spacing(int d) const { return spacing.empty() ? 1.0f : spacing[d]; }
+
+	/// Make the lattice wrap around along the axes where `periodic_arg` is true, e.g. for tileable textures.
+	/// The stencils of the model constraints then wrap around too, so the last lattice point along a periodic
+	/// axis is a neighbor of the first. Data constraints do not wrap: keep data within [0, size - 1] along them.
+	/// Call before adding any constraints.
+	void set_periodic(const std::vector<bool>& periodic_arg);
+
+	bool is_periodic(int d) const { return !periodic.empty() && periodic[d]; }
+
+	Index num_unknowns() const;
+
+	/// Including those in `model`.
+	size_t num_equations() const;
+	size_t num_nonzeros() const;
+};
+
+/// The unit-weight model components only depend on the lattice size, not on the data nor the weights.
+/// This is a least-recently-used cache of them, so that they don't need to be re-assembled
+/// when only the data or the weights change. Thread safe.
+class ModelSystemCache
+{
+public:
+	explicit ModelSystemCache(size_t capacity = 4) : _capacity(capacity) {}
+
+	/// Returns the model system of the lattice `lattice`, assembling it on a cache miss.
+	/// Only the geometry (sizes, spacing and periodic) of `lattice` is used, not its equations.
+	/// Only a change in which model weights are zero causes a miss.
+	/// The assembly happens without holding the lock, so other keys are not held up by it.
+	/// Concurrent calls with the same key wait for the first one to finish it instead of assembling it again.
+	std::shared_ptr<const ModelSystem> get(
+		const LatticeField& lattice,
+		const Weights&      weights);
+
+private:
+	using SystemFuture = std::shared_future<std::shared_ptr<const WeightedSystem>>;
+
+	struct Entry
 	{
-		int stride = 1;
-		for (int size : sizes) {
-			strides.push_back(stride);
-			stride *= size;
-		}
-	}
+		std::vector<int>             sizes;
+		std::vector<float>           spacing;
+		std::vector<bool>            periodic;
+		std::vector<ConstraintClass> classes;
+		SystemFuture                 system; ///< Not ready while the first get of the entry assembles it.
+	};
+
+	size_t           _capacity;
+	std::mutex       _mutex;
+	std::list<Entry> _entries; ///< Most recently used first.
 };
 
 struct Weight { float value; };
@@ -127,6 +288,23 @@ void add_field_constraints(
 	LatticeField*  field,
 	const Weights& weights);
 
+/// Like add_field_constraints, but only the equations of the lattice points in the box
+/// box_min[d] <= coordinate[d] < box_max[d]. An equation belongs to the lattice point
+/// with the lowest coordinates it involves, so boxes that partition the lattice also partition the equations.
+/// Runs on the calling thread only.
+void add_field_constraints_in_box(
+	LatticeField*  field,
+	const Weights& weights,
+	const int      box_min[],
+	const int      box_max[]);
+
+/// Like add_field_constraints, but the constraints are taken from the cache
+/// and put in `field->model` instead of `field->eq`.
+void add_field_constraints(
+	LatticeField*     field,
+	const Weights&    weights,
+	ModelSystemCache* cache);
+
 /// Add a value constraint:  f(pos) = value
 /// This is a no-op if pos is close to or outside of the field.
 /// Returns false if the position was ignored.
@@ -136,7 +314,20 @@ bool add_value_constraint(
 	float         value,
 	float         weight);
 
+/// Like add_value_constraint, but with a single term on the lattice point closest to `pos`, instead of 2^D.
+/// If `gradient` is given (e.g. the normal of a point on an SDF) the value is moved along it to that lattice point:
+///     f(closest) = value + gradient · (closest - pos)
+/// The gradient is per physical unit (see LatticeField::spacing), and may be null.
+/// Returns false if the position was ignored.
+bool add_nearest_value_constraint(
+	LatticeField* field,
+	const float   pos[],
+	float         value,
+	const float*  gradient,
+	float         weight);
+
 /// Add a gradient constraint:  ∇ f(pos) = gradient
+/// The gradient is per physical unit (see LatticeField::spacing).
 /// This is a no-op if pos is close to or outside of the field.
 /// Returns false if the position was ignored.
 bool add_gradient_constraint(
@@ -150,15 +341,91 @@ bool add_gradient_constraint(
 /// The resulting distances may be scaled arbitrarily, and only accurate near field=0.
 /// Still, it will be useful for finding the field=0 surface using e.g. marching cubes.
 LatticeField sdf_from_points(
-	const std::vector<int>& sizes,          // Lattice size: one for each dimension
+	const std::vector<int>& sizes,                   // Lattice size: one for each dimension
+	const Weights&          weights,
+	const int               num_points,
+	const float             positions[],             // Interleaved coordinates, e.g. xyxyxy...
+	const float*            normals,                 // Optional (may be null).
+	const float*            point_weights,           // Optional (may be null).
+	ModelSystemCache*       model_cache = nullptr);  // Optional (may be null).
+
+/// Like sdf_from_points, but adds the constraints to an existing field,
+/// e.g. one whose `eq` comes from an EquationPool.
+void add_sdf_constraints(
+	LatticeField*     field,
+	const Weights&    weights,
+	const int         num_points,
+	const float       positions[],
+	const float*      normals,
+	const float*      point_weights,
+	ModelSystemCache* model_cache);
+
+/// The exact size of the equations added by add_field_constraints (without a cache).
+/// `periodic` is that of the LatticeField (empty means no axis wraps).
+EquationCapacity model_capacity(const std::vector<int>& sizes, const Weights& weights, const std::vector<bool>& periodic = {});
+
+/// An upper bound of the size of the equations added by add_data_constraints.
+/// Points outside the lattice add fewer equations, as do points exactly on the lattice.
+EquationCapacity data_capacity(size_t num_dim, const Weights& weights, size_t num_points, bool has_normals);
+
+/// Add the value and gradient constraints of sdf_from_points.
+void add_data_constraints(
+	LatticeField*  field,
+	const Weights& weights,
+	const int      num_points,
+	const float    positions[],
+	const float*   normals,
+	const float*   point_weights);
+
+struct DensityWeightOptions
+{
+	float cell_size  =  4; ///< Side of the histogram cells, in lattice units.
+	float strength   =  1; ///< 1: every area of the surface gets the same total weight. 0: every point the same weight.
+	float max_weight = 10; ///< Upper limit of any weight, relative to the mean weight of one.
+};
+
+/// Per-point weights (the `point_weights` of sdf_from_points) which even out uneven sampling,
+/// so that densely sampled parts of the surface do not dominate the fit of sparsely sampled ones.
+/// The points are counted in a coarse histogram over the lattice (in parallel, each thread into its own),
+/// the counts summed over each 3x3(x3...) block of cells, and each point weighted by that count^-strength.
+/// The weights are scaled to a mean of one, so the data weights need no re-tuning.
+/// `positions` are interleaved lattice coordinates, as for sdf_from_points.
+std::vector<float> density_weights(
+	const std::vector<int>&     sizes,
+	const int                   num_points,
+	const float                 positions[],
+	const DensityWeightOptions& options = {});
+
+/// All the constraints of sdf_from_points, but kept as separate unit-weight components
+/// so the result can be cheaply re-weighted using WeightedSystem::normal_equation.
+/// Only classes with a non-zero weight in `weights` are assembled.
+/// The model components are taken from `model_cache`.
+WeightedSystem sdf_system_from_points(
+	const std::vector<int>& sizes,
 	const Weights&          weights,
 	const int               num_points,
-	const float             positions[],    // Interleaved coordinates, e.g. xyxyxy...
-	const float*            normals,        // Optional (may be null).
-	const float*            point_weights); // Optional (may be null).
+	const float             positions[],
+	const float*            normals,
+	const float*            point_weights,
+	ModelSystemCache*       model_cache);
+
+/// The normal equations of all the equations in the field, including `field.model`.
+NormalEquation make_normal_equation(const LatticeField& field);
 
 /// Calculate (Ax - b)^2 and distribute onto the solution space for a heatmap of blame.
+/// If you already have the residuals Ax - b (see row_residuals) you can pass them in to save some work.
+std::vector<float> generate_error_map(
+	const LinearEquation&     eq,
+	const std::vector<float>& solution,
+	const std::vector<float>* residuals = nullptr);
+
+/// Error map of all the equations in the field, including `field.model`.
 std::vector<float> generate_error_map(
-	const std::vector<Triplet>& triplets,
-	const std::vector<float>&   solution,
-	const std::vector<float>&   rhs);
+	const LatticeField&       field,
+	const std::vector<float>& solution);
+
+/// The error map of the field split up by constraint class, using `field.row_classes`, in a single pass.
+/// Includes `field.model`.
+ErrorBreakdown generate_error_breakdown(
+	const LatticeField&       field,
+	const std::vector<float>& solution);
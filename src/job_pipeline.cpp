@@ -0,0 +1,230 @@
+#include "job_pipeline.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+#include <loguru.hpp>
+
+#include "parallel.hpp"
+
+namespace {
+
+using JobPtr = std::unique_ptr<SdfJob>;
+
+struct Stage
+{
+	std::string        name;
+	SdfJobFunction     run;
+	bool               serial  = false;
+	std::deque<JobPtr> input;        ///< Unused by the first stage, which creates the jobs.
+	size_t             running = 0;
+	PipelineStageStats stats;
+};
+
+void assemble(SdfJob* job, EquationPool* pool)
+{
+	const size_t dim = job->sizes.size();
+	CHECK_EQ_F(job->positions.size() % dim, 0u);
+	const int num_points = job->positions.size() / dim;
+	if (job->normals.empty() && job->estimate_missing_normals) {
+		job->normals = estimate_normals(dim, num_points, job->positions.data(), job->normal_estimation);
+	}
+	if (job->point_weights.empty() && job->weigh_by_density) {
+		job->point_weights = density_weights(job->sizes, num_points, job->positions.data(), job->density_weighting);
+	}
+	job->field.reset(new LatticeField(job->sizes));
+	job->field->eq = pool->acquire(EquationCapacity{});
+	add_sdf_constraints(job->field.get(), job->weights, num_points, job->positions.data(),
+		job->normals.empty()       ? nullptr : job->normals.data(),
+		job->point_weights.empty() ? nullptr : job->point_weights.data(),
+		nullptr);
+	job->normal = make_normal_equation(*job->field);
+}
+
+void solve(SdfJob* job)
+{
+	if (job->exact_solve) {
+		job->sdf = solve_normal_equation(job->normal);
+	} else {
+		job->sdf = solve_normal_equation_approximate_lattice(job->normal, job->sizes, job->solve_options);
+	}
+	job->normal = NormalEquation{};
+}
+
+void extract(SdfJob* job, EquationPool* pool)
+{
+	if (!job->sdf.empty()) {
+		job->error_map = generate_error_map(*job->field, job->sdf);
+	}
+	pool->release(std::move(job->field->eq));
+	job->field.reset();
+}
+
+class Pipeline
+{
+public:
+	Pipeline(size_t num_jobs, std::vector<Stage> stages, const PipelineOptions& options)
+		: _num_jobs(num_jobs), _stages(std::move(stages)), _capacity(std::max<size_t>(1, options.queue_capacity))
+		, _pool(options.num_threads)
+	{
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		start_tasks();
+		_all_done.wait(lock, [this]() { return _num_done == _num_jobs; });
+	}
+
+	std::vector<PipelineStageStats> stats() const
+	{
+		std::vector<PipelineStageStats> result;
+		for (const auto& stage : _stages) {
+			result.push_back(stage.stats);
+		}
+		return result;
+	}
+
+	size_t num_threads() const { return _pool.num_threads(); }
+
+private:
+	bool has_input(size_t s) const
+	{
+		return s == 0 ? _next_job < _num_jobs : !_stages[s].input.empty();
+	}
+
+	/// Is there room in the next queue for everything running in this stage, plus one more?
+	bool has_room(size_t s) const
+	{
+		if (s + 1 == _stages.size()) { return true; }
+		return _stages[s + 1].input.size() + _stages[s].running < _capacity;
+	}
+
+	/// Call with _mutex locked.
+	void start_tasks()
+	{
+		// Later stages first, so that jobs drain before new ones are started:
+		for (size_t s = _stages.size(); s-- > 0;) {
+			Stage& stage = _stages[s];
+			while (has_input(s) && has_room(s) && !(stage.serial && stage.running > 0)) {
+				JobPtr job;
+				if (s == 0) {
+					job.reset(new SdfJob{});
+					job->index = _next_job++;
+				} else {
+					job = std::move(stage.input.front());
+					stage.input.pop_front();
+				}
+				stage.running += 1;
+				SdfJob* job_ptr = job.release();
+				_pool.add([this, s, job_ptr]() { run_task(s, JobPtr(job_ptr)); });
+			}
+		}
+	}
+
+	void run_task(size_t s, JobPtr job)
+	{
+		Stage& stage = _stages[s];
+		const auto start_time = std::chrono::steady_clock::now();
+		stage.run(job.get());
+		const auto end_time = std::chrono::steady_clock::now();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		stage.running -= 1;
+		stage.stats.num_jobs += 1;
+		stage.stats.busy_seconds += std::chrono::duration<double>(end_time - start_time).count();
+		if (s + 1 < _stages.size()) {
+			_stages[s + 1].input.push_back(std::move(job));
+		} else {
+			job.reset();
+			_num_done += 1;
+			if (_num_done == _num_jobs) {
+				_all_done.notify_all();
+			}
+		}
+		start_tasks();
+	}
+
+	const size_t            _num_jobs;
+	std::vector<Stage>      _stages;
+	const size_t            _capacity;
+	std::mutex              _mutex;
+	std::condition_variable _all_done;
+	size_t                  _next_job = 0;
+	size_t                  _num_done = 0;
+	ThreadPool              _pool; // Last, so it is destroyed (and joined) first.
+};
+
+} // namespace
+
+double PipelineStats::utilization() const
+{
+	double busy_seconds = 0;
+	for (const auto& stage : stages) {
+		busy_seconds += stage.busy_seconds;
+	}
+	const double available_seconds = wall_seconds * num_threads;
+	return available_seconds > 0 ? busy_seconds / available_seconds : 0;
+}
+
+PipelineStats run_sdf_pipeline(
+	size_t                 num_jobs,
+	const SdfJobFunction&  generate,
+	const SdfJobFunction&  output,
+	const PipelineOptions& options)
+{
+	LOG_SCOPE_F(INFO, "run_sdf_pipeline");
+	CHECK_F(generate != nullptr);
+
+	// Jobs are similar, so the equations of one job can be assembled in the memory of an earlier one:
+	EquationPool equation_pool(2 * options.queue_capacity + 2);
+
+	std::vector<Stage> stages(5);
+	stages[0].name = "generate";
+	stages[0].run  = generate;
+	stages[1].name = "assemble";
+	stages[1].run  = [&](SdfJob* job) { assemble(job, &equation_pool); };
+	stages[2].name = "solve";
+	stages[2].run  = solve;
+	stages[3].name = "extract";
+	stages[3].run  = [&](SdfJob* job) { extract(job, &equation_pool); };
+	stages[4].name = "output";
+	stages[4].run  = output ? output : [](SdfJob*) {};
+	stages[4].serial = true;
+	for (auto& stage : stages) {
+		stage.stats.name = stage.name;
+	}
+
+	PipelineStats stats;
+	const auto start_time = std::chrono::steady_clock::now();
+	if (num_jobs > 0) {
+		Pipeline pipeline(num_jobs, std::move(stages), options);
+		pipeline.run();
+		stats.stages = pipeline.stats();
+		stats.num_threads = pipeline.num_threads();
+	}
+	const auto end_time = std::chrono::steady_clock::now();
+	stats.wall_seconds = std::chrono::duration<double>(end_time - start_time).count();
+
+	LOG_F(INFO, "%lu jobs in %.3f s (%.0f%% utilization)", num_jobs, stats.wall_seconds, 100 * stats.utilization());
+	return stats;
+}
+
+std::string format_pipeline_stats(const PipelineStats& stats)
+{
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(3);
+	ss << std::left << std::setw(10) << "stage" << std::right << std::setw(8) << "jobs" << std::setw(12) << "busy (s)" << "\n";
+	for (const auto& stage : stats.stages) {
+		ss << std::left << std::setw(10) << stage.name
+		   << std::right << std::setw(8) << stage.num_jobs
+		   << std::setw(12) << stage.busy_seconds << "\n";
+	}
+	ss << stats.wall_seconds << " s on " << stats.num_threads << " threads, "
+	   << std::setprecision(0) << 100 * stats.utilization() << "% utilization\n";
+	return ss.str();
+}
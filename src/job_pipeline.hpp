@@ -0,0 +1,81 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "field_interpolation.hpp"
+#include "normal_estimation.hpp"
+#include "sparse_linear.hpp"
+
+/// One signed distance field to generate in a batch (see run_sdf_pipeline).
+struct SdfJob
+{
+	size_t index; ///< In [0, num_jobs).
+
+	// Set by the generate function:
+	std::vector<int>   sizes;
+	Weights            weights;
+	bool               exact_solve = false;
+	SolveOptions       solve_options;
+	std::vector<float> positions;     ///< Interleaved coordinates, e.g. xyxyxy...
+	std::vector<float> normals;       ///< Optional (may be empty).
+	std::vector<float> point_weights; ///< Optional (may be empty).
+
+	/// If set and `normals` is empty, they are estimated from the positions before assembly (see estimate_normals).
+	bool                    estimate_missing_normals = false;
+	NormalEstimationOptions normal_estimation;
+
+	/// If set and `point_weights` is empty, they are computed from the positions before assembly (see density_weights).
+	bool                 weigh_by_density = false;
+	DensityWeightOptions density_weighting;
+
+	// Set by the pipeline:
+	std::unique_ptr<LatticeField> field;  ///< Freed after the extraction stage.
+	NormalEquation                normal; ///< Freed after the solve stage.
+	std::vector<float>            sdf;
+	std::vector<float>            error_map;
+};
+
+/// Fill in the inputs of a job, e.g. generate the points.
+using SdfJobFunction = std::function<void(SdfJob* job)>;
+
+struct PipelineOptions
+{
+	size_t num_threads    = 0; ///< 0 means num_worker_threads().
+	size_t queue_capacity = 4; ///< Max number of jobs waiting between two stages.
+};
+
+struct PipelineStageStats
+{
+	std::string name;
+	size_t      num_jobs     = 0;
+	double      busy_seconds = 0; ///< Summed over all threads.
+};
+
+struct PipelineStats
+{
+	double                          wall_seconds = 0;
+	size_t                          num_threads  = 0;
+	std::vector<PipelineStageStats> stages;
+
+	/// Fraction of the available thread time spent doing work, in [0, 1].
+	double utilization() const;
+};
+
+/// Generate `num_jobs` signed distance fields, overlapping the stages of different jobs:
+///    generate → assemble (estimate_normals, density_weights, sdf_from_points) → solve → extract (generate_error_map) → output
+/// Each stage of each job is a task on one shared thread pool, so job N+1 can be assembled
+/// while job N is solved and job N-1 is written out.
+/// The queues between stages are bounded, so only a few jobs are in memory at once.
+/// `generate` may be called concurrently for different jobs.
+/// `output` (e.g. contouring and writing images) is called for one job at a time, in no particular order.
+PipelineStats run_sdf_pipeline(
+	size_t                 num_jobs,
+	const SdfJobFunction&  generate,
+	const SdfJobFunction&  output,
+	const PipelineOptions& options);
+
+/// Print stats as a table of how busy each stage was.
+std::string format_pipeline_stats(const PipelineStats& stats);
@@ -0,0 +1,302 @@
+#include "lattice_smoother.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+
+#include <loguru.hpp>
+
+#include "field_interpolation.hpp" // MAX_DIM
+#include "parallel.hpp"
+
+namespace {
+
+/// Points per parallel chunk. Smaller than this, threads cost more than they give.
+const size_t kPointsPerChunk = 4096;
+
+size_t num_chunks_for(size_t num_points)
+{
+	return (num_points + kPointsPerChunk - 1) / kPointsPerChunk;
+}
+
+void to_coordinate(const std::vector<int>& sizes, Index index, int coordinate[])
+{
+	for (size_t d = 0; d < sizes.size(); ++d) {
+		coordinate[d] = index % sizes[d];
+		index /= sizes[d];
+	}
+}
+
+/// How far the couplings of AtA reach along each axis.
+struct Reach
+{
+	std::vector<int>  linear;         ///< max |Δ| along each axis.
+	std::vector<int>  cyclic;         ///< max min(|Δ|, size - |Δ|), i.e. counting the couplings of periodic axes the short way around.
+	std::vector<char> wraps;          ///< Is some |Δ| more than half the size, i.e. does the axis wrap around?
+	bool              all_odd = true; ///< Are all couplings an odd number of (cyclic) steps apart (Manhattan distance)?
+
+	explicit Reach(int num_dim) : linear(num_dim, 0), cyclic(num_dim, 0), wraps(num_dim, false) {}
+};
+
+/// Colors along one axis, such that points closer than `period` steps apart get different colors.
+/// With the cyclic distance the colors repeat every `period` points up to `regular_end`,
+/// and the remaining (size % period) points each get a color of their own,
+/// so that the last points don't share colors with the first points they wrap around to.
+struct AxisColors
+{
+	int period;
+	int regular_end;
+	int num_colors;
+
+	int color(int coordinate) const
+	{
+		return coordinate < regular_end ? coordinate % period : period + coordinate - regular_end;
+	}
+};
+
+AxisColors axis_colors(int size, int linear_reach, int cyclic_reach)
+{
+	const AxisColors linear{linear_reach + 1, size, linear_reach + 1};
+	const int period = cyclic_reach + 1;
+	const int regular_end = size / period * period;
+	const AxisColors cyclic{period, regular_end, period + size - regular_end};
+	return cyclic.num_colors < linear.num_colors ? cyclic : linear;
+}
+
+/// Assign colors so that no two points of the same color are coupled in AtA.
+/// Periodic axes are not known here, but found from the couplings which wrap around.
+std::vector<std::vector<Index>> color_lattice(const SparseMatrix& AtA, const std::vector<int>& sizes)
+{
+	const int num_dim = sizes.size();
+	const Index num_unknowns = AtA.cols();
+
+	// Find how far (per axis) the couplings reach, and if they are all an odd number of steps:
+	const size_t num_chunks = num_chunks_for(num_unknowns);
+	std::vector<Reach> chunk_reach(num_chunks, Reach(num_dim));
+	parallel_for_chunks(num_unknowns, num_chunks, [&](size_t chunk_index, size_t begin, size_t end) {
+		Reach& reach = chunk_reach[chunk_index];
+		for (size_t col = begin; col < end; ++col) {
+			int col_coordinate[MAX_DIM];
+			to_coordinate(sizes, col, col_coordinate);
+			for (SparseMatrix::InnerIterator it(AtA, col); it; ++it) {
+				if (it.row() == static_cast<Index>(col)) { continue; }
+				int row_coordinate[MAX_DIM];
+				to_coordinate(sizes, it.row(), row_coordinate);
+				int manhattan = 0;
+				for (int d = 0; d < num_dim; ++d) {
+					const int distance = std::abs(row_coordinate[d] - col_coordinate[d]);
+					const int cyclic_distance = std::min(distance, sizes[d] - distance);
+					reach.linear[d] = std::max(reach.linear[d], distance);
+					reach.cyclic[d] = std::max(reach.cyclic[d], cyclic_distance);
+					reach.wraps[d] |= distance > cyclic_distance;
+					manhattan += cyclic_distance;
+				}
+				reach.all_odd &= manhattan % 2 == 1;
+			}
+		}
+	});
+
+	Reach reach(num_dim);
+	for (const Reach& chunk : chunk_reach) {
+		for (int d = 0; d < num_dim; ++d) {
+			reach.linear[d] = std::max(reach.linear[d], chunk.linear[d]);
+			reach.cyclic[d] = std::max(reach.cyclic[d], chunk.cyclic[d]);
+			reach.wraps[d] |= chunk.wraps[d];
+		}
+		reach.all_odd &= chunk.all_odd;
+	}
+
+	// Points of the same color are at least `period` apart along some axis:
+	std::vector<AxisColors> axes;
+	int num_colors = 1;
+	for (int d = 0; d < num_dim; ++d) {
+		axes.push_back(axis_colors(sizes[d], reach.linear[d], reach.cyclic[d]));
+		num_colors *= axes.back().num_colors;
+	}
+
+	// Or red-black, if fewer: points of the same parity are an even number of steps apart.
+	// Wrapping around an axis of odd size flips the parity, so there the last `cyclic` points
+	// (which is where all couplings wrapping around from the first points end up) get colors of their own.
+	std::vector<int> tail_axes;
+	bool red_black = reach.all_odd;
+	for (int d = 0; d < num_dim; ++d) {
+		if (reach.wraps[d] && sizes[d] % 2 == 1) {
+			red_black &= sizes[d] >= 2 * reach.cyclic[d]; // So that the first and last points are separate.
+			tail_axes.push_back(d);
+		}
+	}
+	const int num_red_black_colors = 2 << tail_axes.size();
+	red_black &= tail_axes.empty() || num_red_black_colors <= num_colors;
+	if (red_black) {
+		num_colors = num_red_black_colors;
+	}
+
+	std::vector<std::vector<Index>> points_by_color(num_colors);
+	for (Index index = 0; index < num_unknowns; ++index) {
+		int coordinate[MAX_DIM];
+		to_coordinate(sizes, index, coordinate);
+		int color = 0;
+		if (red_black) {
+			for (int d = 0; d < num_dim; ++d) {
+				color += coordinate[d];
+			}
+			color %= 2;
+			for (size_t i = 0; i < tail_axes.size(); ++i) {
+				const int d = tail_axes[i];
+				if (coordinate[d] >= sizes[d] - reach.cyclic[d]) {
+					color += 2 << i;
+				}
+			}
+		} else {
+			int stride = 1;
+			for (int d = 0; d < num_dim; ++d) {
+				color += stride * axes[d].color(coordinate[d]);
+				stride *= axes[d].num_colors;
+			}
+		}
+		points_by_color[color].push_back(index);
+	}
+
+	// E.g. the tails of several axes need not all meet:
+	points_by_color.erase(
+		std::remove_if(points_by_color.begin(), points_by_color.end(),
+		               [](const std::vector<Index>& points) { return points.empty(); }),
+		points_by_color.end());
+	return points_by_color;
+}
+
+} // namespace
+
+LatticeSmoother::LatticeSmoother(const SparseMatrix& AtA, const std::vector<int>& sizes) : _AtA(AtA)
+{
+	LOG_SCOPE_F(1, "LatticeSmoother setup");
+	CHECK_EQ_F(AtA.rows(), AtA.cols());
+	Index num_unknowns = 1;
+	for (const int size : sizes) {
+		num_unknowns *= size;
+	}
+	CHECK_EQ_F(AtA.cols(), num_unknowns);
+
+	// Points without any equations are left as they are:
+	_inv_diagonal = AtA.diagonal();
+	for (Index i = 0; i < num_unknowns; ++i) {
+		_inv_diagonal[i] = _inv_diagonal[i] > 0 ? 1 / _inv_diagonal[i] : 0;
+	}
+
+	_points_by_color = color_lattice(AtA, sizes);
+	LOG_F(1, "%d colors", num_colors());
+
+	// Power iteration for the largest eigenvalue of D⁻¹·AtA:
+	std::default_random_engine rng(0);
+	std::uniform_real_distribution<float> random(0, 1);
+	VectorXr v(num_unknowns);
+	for (Index i = 0; i < num_unknowns; ++i) {
+		v[i] = random(rng);
+	}
+	VectorXr Av(num_unknowns);
+	float eigenvalue = 1;
+	for (int iteration = 0; iteration < 15; ++iteration) {
+		const float norm = v.norm();
+		if (norm == 0) { break; }
+		v /= norm;
+		multiply(v, &Av);
+		v = _inv_diagonal.cwiseProduct(Av);
+		eigenvalue = v.norm();
+	}
+	// Power iteration approaches from below, so add a safety margin:
+	_max_eigenvalue = 1.1f * eigenvalue;
+	LOG_F(1, "max eigenvalue of D⁻¹·AtA: %f", _max_eigenvalue);
+}
+
+void LatticeSmoother::multiply(const VectorXr& x, VectorXr* out) const
+{
+	// AtA is symmetric, so we can go column by column and still write each element of `out` once:
+	out->resize(x.size());
+	parallel_for_chunks(x.size(), num_chunks_for(x.size()), [&](size_t, size_t begin, size_t end) {
+		for (size_t col = begin; col < end; ++col) {
+			float sum = 0;
+			for (SparseMatrix::InnerIterator it(_AtA, col); it; ++it) {
+				sum += it.value() * x[it.row()];
+			}
+			(*out)[col] = sum;
+		}
+	});
+}
+
+void LatticeSmoother::gauss_seidel(const VectorXr& Atb, VectorXr* x_ptr, int num_sweeps) const
+{
+	CHECK_NOTNULL_F(x_ptr);
+	VectorXr& x = *x_ptr;
+	CHECK_EQ_F(x.size(), Atb.size());
+	CHECK_EQ_F(x.size(), _inv_diagonal.size());
+
+	const auto relax_color = [&](const std::vector<Index>& points) {
+		parallel_for_chunks(points.size(), num_chunks_for(points.size()), [&](size_t, size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				const Index point = points[i];
+				float off_diagonal = 0;
+				for (SparseMatrix::InnerIterator it(_AtA, point); it; ++it) {
+					if (it.row() != point) {
+						off_diagonal += it.value() * x[it.row()];
+					}
+				}
+				if (_inv_diagonal[point] != 0) {
+					x[point] = (Atb[point] - off_diagonal) * _inv_diagonal[point];
+				}
+			}
+		});
+	};
+
+	for (int sweep = 0; sweep < num_sweeps; ++sweep) {
+		for (size_t color = 0; color < _points_by_color.size(); ++color) {
+			relax_color(_points_by_color[color]);
+		}
+		for (size_t color = _points_by_color.size(); color-- > 0;) {
+			relax_color(_points_by_color[color]);
+		}
+	}
+}
+
+void LatticeSmoother::chebyshev(const VectorXr& Atb, VectorXr* x_ptr, int degree, float eigenvalue_ratio) const
+{
+	CHECK_NOTNULL_F(x_ptr);
+	VectorXr& x = *x_ptr;
+	CHECK_EQ_F(x.size(), Atb.size());
+	CHECK_EQ_F(x.size(), _inv_diagonal.size());
+	CHECK_GT_F(eigenvalue_ratio, 1);
+	if (degree <= 0) { return; }
+
+	const float upper = _max_eigenvalue;
+	const float lower = _max_eigenvalue / eigenvalue_ratio;
+	const float theta = (upper + lower) / 2; // Center of the range
+	const float delta = (upper - lower) / 2; // Half width of the range
+
+	VectorXr Ax;
+	multiply(x, &Ax);
+	VectorXr residual = Atb - Ax;
+	VectorXr step = _inv_diagonal.cwiseProduct(residual) / theta;
+	x += step;
+
+	// The three-term recurrence of the Chebyshev polynomials (Saad, Iterative Methods, algorithm 12.1):
+	const float sigma = theta / delta;
+	float rho = 1 / sigma;
+	VectorXr A_step;
+	for (int k = 1; k < degree; ++k) {
+		multiply(step, &A_step);
+		residual -= A_step;
+		const float rho_next = 1 / (2 * sigma - rho);
+		step = (rho_next * rho) * step + (2 * rho_next / delta) * _inv_diagonal.cwiseProduct(residual);
+		x += step;
+		rho = rho_next;
+	}
+}
+
+void LatticeSmoother::smooth(Smoother smoother, const VectorXr& Atb, VectorXr* x, int num_sweeps) const
+{
+	if (smoother == Smoother::kGaussSeidel) {
+		gauss_seidel(Atb, x, num_sweeps);
+	} else {
+		chebyshev(Atb, x, 2 * num_sweeps);
+	}
+}
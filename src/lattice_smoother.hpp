@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+
+#include "sparse_linear.hpp"
+
+/// Smoothers for the normal equations AtA·x = Atb of a lattice.
+/// Smoothers quickly remove the high frequency parts of the error, e.g. the seams left by tile_solver,
+/// but do very little for the smooth parts. They are the building blocks of multigrid-like solvers,
+/// and can be used on their own as a cheap polish after the downscale and tile solvers.
+///
+/// The setup (coloring, diagonal and eigenvalue estimate) only depends on AtA,
+/// so one LatticeSmoother can be used for many right hand sides.
+/// All smoothing is multithreaded. Points of the same color are independent, and so are updated in parallel.
+class LatticeSmoother
+{
+public:
+	/// `AtA` must outlive the smoother. `sizes` is the size of the lattice.
+	LatticeSmoother(const SparseMatrix& AtA, const std::vector<int>& sizes);
+
+	/// Number of colors used by gauss_seidel. Two (red-black) if all couplings are between
+	/// lattice points an odd number of steps apart (e.g. first order models only), else more.
+	/// Periodic axes (found from the couplings wrapping around) are colored by the short way around,
+	/// with a few extra colors when their size is odd (red-black) or not a multiple of the reach + 1.
+	int num_colors() const { return _points_by_color.size(); }
+
+	/// Estimated largest eigenvalue of the Jacobi preconditioned operator D⁻¹·AtA.
+	float max_eigenvalue() const { return _max_eigenvalue; }
+
+	/// Multi-color Gauss–Seidel. Each sweep goes through the colors forward and then backward,
+	/// which makes it symmetric (so it can also be used as a preconditioner for CG).
+	void gauss_seidel(const VectorXr& Atb, VectorXr* x, int num_sweeps) const;
+
+	/// Chebyshev polynomial smoother of the given degree in D⁻¹·AtA.
+	/// Damps the error in the eigenvalue range [max_eigenvalue / eigenvalue_ratio, max_eigenvalue].
+	void chebyshev(const VectorXr& Atb, VectorXr* x, int degree, float eigenvalue_ratio = 30) const;
+
+	/// gauss_seidel or chebyshev. For Chebyshev the sweeps become one polynomial of degree 2·num_sweeps,
+	/// which costs about as much as the same number of (symmetric) Gauss–Seidel sweeps.
+	void smooth(Smoother smoother, const VectorXr& Atb, VectorXr* x, int num_sweeps) const;
+
+private:
+	/// out = AtA * x
+	void multiply(const VectorXr& x, VectorXr* out) const;
+
+	const SparseMatrix&             _AtA;
+	VectorXr                        _inv_diagonal;
+	std::vector<std::vector<Index>> _points_by_color;
+	float                           _max_eigenvalue = 1;
+};
@@ -1,5 +1,10 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <random>
 #include <sstream>
+#include <string>
 #include <vector>
 
 #include <SDL2/SDL.h>
@@ -23,12 +28,21 @@
 
 #include "dual_contouring_2d.hpp"
 #include "field_interpolation.hpp"
+#include "job_pipeline.hpp"
+#include "normal_estimation.hpp"
+#include "out_of_core.hpp"
+#include "parallel.hpp"
+#include "parameter_sweep.hpp"
+#include "periodic_solver.hpp"
+#include "sequence_solver.hpp"
 #include "serialize_configuru.hpp"
 #include "sparse_linear.hpp"
 
 VISITABLE_STRUCT(ImVec2, x, y);
 VISITABLE_STRUCT(Weights, data_pos, data_gradient, model_0, model_1, model_2, model_3, model_4, gradient_smoothness);
-VISITABLE_STRUCT(SolveOptions, downscale_factor, tile, tile_size, cg, error_tolerance);
+VISITABLE_STRUCT(SolveOptions, downscale_factor, tile, tile_size, tile_dims, smoothing_sweeps, cg, error_tolerance); // Enums are not serialized
+VISITABLE_STRUCT(RobustOptions, scale, iterations); // loss is an enum, so not serialized
+VISITABLE_STRUCT(DensityWeightOptions, cell_size, strength, max_weight);
 
 using Vec2List = std::vector<ImVec2>;
 
@@ -61,9 +75,14 @@ struct Options
 	std::vector<Shape> shapes;
 	float              pos_noise        =  0.005f;
 	float              dir_noise        =  0.05f;
+	bool               estimate_normals = false; ///< Ignore the normals of the points, and estimate them from the positions instead.
+	bool               weigh_by_density = false; ///< Weigh the points by their inverse sampling density (see density_weights).
+	DensityWeightOptions density_weighting;
 	Weights            weights;
 	bool               exact_solve      = false;
 	SolveOptions       solve_options;
+	RobustOptions      robust_options;
+	bool               warm_start       = false; ///< Start from the previous solution (see SequenceSolver).
 
 	Options()
 	{
@@ -78,15 +97,16 @@ struct Options
 	}
 };
 
-VISITABLE_STRUCT(Options, seed, resolution, shapes, pos_noise, dir_noise, weights, exact_solve, solve_options);
+VISITABLE_STRUCT(Options, seed, resolution, shapes, pos_noise, dir_noise, estimate_normals, weigh_by_density, density_weighting, weights, exact_solve, solve_options, robust_options, warm_start);
 
 struct Result
 {
 	Vec2List           point_positions;
 	Vec2List           point_normals;
-	LatticeField       field;
+	std::shared_ptr<const WeightedSystem> system;
 	std::vector<float> sdf;
 	std::vector<float> heatmap;
+	ErrorBreakdown     error_breakdown;
 	std::vector<RGBA>  sdf_image;
 	std::vector<RGBA>  blob_image;
 	std::vector<RGBA>  heatmap_image;
@@ -216,6 +236,46 @@ float area(const std::vector<Shape>& shapes)
 	return expected_area;
 }
 
+bool same_points(const Vec2List& a, const Vec2List& b)
+{
+	return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(ImVec2)) == 0;
+}
+
+/// Do the same constraint classes have non-zero weights?
+bool same_active_classes(const Weights& a, const Weights& b)
+{
+	for (int i = 0; i < NUM_CONSTRAINT_CLASSES; ++i) {
+		const auto constraint_class = static_cast<ConstraintClass>(i);
+		if ((class_weight(a, constraint_class) > 0) != (class_weight(b, constraint_class) > 0)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Would the two give the same density_weights (if any)?
+bool same_density_weighting(const Options& a, const Options& b)
+{
+	if (a.weigh_by_density != b.weigh_by_density) { return false; }
+	return !a.weigh_by_density
+		|| (a.density_weighting.cell_size  == b.density_weighting.cell_size
+		 && a.density_weighting.strength   == b.density_weighting.strength
+		 && a.density_weighting.max_weight == b.density_weighting.max_weight);
+}
+
+bool same_solve_options(const SolveOptions& a, const SolveOptions& b)
+{
+	return a.downscale_factor == b.downscale_factor
+		&& a.tile == b.tile
+		&& a.tile_size == b.tile_size
+		&& a.tile_dims == b.tile_dims
+		&& a.smoothing_sweeps == b.smoothing_sweeps
+		&& a.smoother == b.smoother
+		&& a.cg == b.cg
+		&& a.preconditioner == b.preconditioner
+		&& a.error_tolerance == b.error_tolerance;
+}
+
 auto generate_sdf(const Vec2List& positions, const Vec2List& normals, const Options& options)
 {
 	LOG_SCOPE_F(INFO, "generate_sdf");
@@ -224,24 +284,84 @@ auto generate_sdf(const Vec2List& positions, const Vec2List& normals, const Opti
 	const int width = options.resolution;
 	const int height = options.resolution;
 
-	static_assert(sizeof(ImVec2) == 2 * sizeof(float), "Pack");
-	const auto field = sdf_from_points(
-		{width, height}, options.weights, positions.size(), &positions[0].x, &normals[0].x, nullptr);
+	std::vector<float> point_weights;
+	if (options.weigh_by_density) {
+		point_weights = density_weights({width, height}, positions.size(), &positions[0].x, options.density_weighting);
+	}
+	const float* point_weights_ptr = point_weights.empty() ? nullptr : point_weights.data();
+
+	static ModelSystemCache s_model_cache;
+
+	// The system only depends on the points, the lattice and which weights are zero.
+	// Keep the last one around, so that changing a weight only needs a re-weighting.
+	static Vec2List                              s_positions;
+	static Vec2List                              s_normals;
+	static Options                               s_options;
+	static std::shared_ptr<const WeightedSystem> s_system;
+
+	const bool same_system = s_system
+		&& same_points(positions, s_positions)
+		&& same_points(normals, s_normals)
+		&& options.resolution == s_options.resolution
+		&& options.weights.gradient_kernel == s_options.weights.gradient_kernel
+		&& options.weights.value_kernel == s_options.weights.value_kernel
+		&& same_active_classes(options.weights, s_options.weights)
+		&& same_density_weighting(options, s_options);
+
+	if (!same_system) {
+		static_assert(sizeof(ImVec2) == 2 * sizeof(float), "Pack");
+		s_system = std::make_shared<WeightedSystem>(sdf_system_from_points(
+			{width, height}, options.weights, positions.size(), &positions[0].x, &normals[0].x, point_weights_ptr,
+			&s_model_cache));
+		s_positions = positions;
+		s_normals = normals;
+		s_options = options;
+	}
 
 	const size_t num_unknowns = width * height;
+	const NormalEquation normal = s_system->normal_equation(options.weights);
 	std::vector<float> sdf;
-	if (options.exact_solve) {
-		sdf = solve_sparse_linear(num_unknowns, field.eq.triplets, field.eq.rhs);
+	if (options.robust_options.loss != RobustLoss::kNone) {
+		// Only the data constraints are re-weighted, so keep them apart from the model:
+		const LatticeField field = sdf_from_points(
+			{width, height}, options.weights, positions.size(), &positions[0].x, &normals[0].x, point_weights_ptr,
+			&s_model_cache);
+		const NormalEquation model = field.model->components->normal_equation(field.model->weights);
+		const std::vector<int> sizes = options.exact_solve ? std::vector<int>{} : std::vector<int>{width, height};
+		sdf = solve_robust(
+			num_unknowns, field.eq, &model, sizes, options.solve_options, options.robust_options, nullptr);
+	} else if (options.exact_solve) {
+		sdf = solve_normal_equation(normal);
+	} else if (options.warm_start) {
+		// Consecutive solves while dragging a slider are a lot like consecutive frames:
+		static std::unique_ptr<SequenceSolver> s_sequence_solver;
+		static size_t                          s_sequence_resolution;
+		static SolveOptions                    s_sequence_solve_options;
+		if (!s_sequence_solver
+			|| options.resolution != s_sequence_resolution
+			|| !same_solve_options(options.solve_options, s_sequence_solve_options))
+		{
+			SequenceOptions sequence_options;
+			sequence_options.solve_options = options.solve_options;
+			s_sequence_solver.reset(new SequenceSolver({width, height}, sequence_options));
+			s_sequence_resolution = options.resolution;
+			s_sequence_solve_options = options.solve_options;
+		}
+		sdf = s_sequence_solver->solve(normal);
+		const FrameStats& stats = s_sequence_solver->last_frame();
+		LOG_F(INFO, "Frame %lu: %s start, %d CG iterations, %.1f ms",
+		      s_sequence_solver->num_frames(), stats.warm_start ? "warm" : "cold",
+		      stats.cg_iterations, 1000 * stats.seconds);
 	} else {
-		sdf = solve_sparse_linear_approximate_lattice(
-			field.eq.triplets, field.eq.rhs, {width, height}, options.solve_options);
+		sdf = solve_normal_equation_approximate_lattice(
+			normal, {width, height}, options.solve_options);
 	}
 	if (sdf.size() != num_unknowns) {
 		LOG_F(ERROR, "Failed to find a solution");
 		sdf.resize(num_unknowns, 0.0f);
 	}
 
-	return std::make_tuple(field, sdf);
+	return std::make_tuple(s_system, sdf);
 }
 
 void perturb_points(Vec2List* positions, Vec2List* normals, const Options& options)
@@ -262,6 +382,207 @@ void perturb_points(Vec2List* positions, Vec2List* normals, const Options& optio
 	}
 }
 
+/// 1 inside, 0 outside, antialiased.
+float calc_insideness(float dist)
+{
+	return 1 - std::max(0.0, std::min(1.0, (dist + 0.5) * 2));
+}
+
+/// Area of the sdf < 0 region, in the [0, 1] coordinate system.
+float calc_blob_area(const std::vector<float>& sdf, size_t resolution)
+{
+	double area_pixels = 0;
+	for (const float dist : sdf) {
+		area_pixels += calc_insideness(dist);
+	}
+	return area_pixels / math::sqr(resolution - 1);
+}
+
+Vec2List to_lattice_positions(const Vec2List& positions, size_t resolution)
+{
+	Vec2List lattice_positions;
+	for (const auto& pos : positions) {
+		ImVec2 on_lattice = pos;
+		on_lattice.x *= (resolution - 1.0f);
+		on_lattice.y *= (resolution - 1.0f);
+		lattice_positions.push_back(on_lattice);
+	}
+	return lattice_positions;
+}
+
+/// Try many combinations of model_1, model_2 and data_pos on the current points.
+/// They are ranked by how well the blob area matches the area of the shapes.
+std::string sweep_weights(const Options& options, const Result& result)
+{
+	const int resolution = options.resolution;
+	const Vec2List lattice_positions = to_lattice_positions(result.point_positions, resolution);
+
+	std::vector<SweepConfig> configs;
+	for (float model_1 : {0.0f, 0.03f, 0.1f, 0.3f, 1.0f}) {
+		for (float model_2 : {0.1f, 0.3f, 1.0f, 3.0f}) {
+			for (float data_pos : {1.0f, 10.0f}) {
+				SweepConfig config;
+				config.weights = options.weights;
+				config.weights.model_1 = model_1;
+				config.weights.model_2 = model_2;
+				config.weights.data_pos = data_pos;
+				config.exact_solve = options.exact_solve;
+				config.solve_options = options.solve_options;
+				configs.push_back(config);
+			}
+		}
+	}
+
+	const float expected_area = area(options.shapes);
+	const auto score_function = [=](const std::vector<float>& sdf) {
+		return std::abs(calc_blob_area(sdf, resolution) - expected_area);
+	};
+
+	const auto results = run_parameter_sweep(
+		{resolution, resolution}, lattice_positions.size(), &lattice_positions[0].x,
+		&result.point_normals[0].x, nullptr, configs, score_function, SweepOptions{});
+
+	std::stringstream ss;
+	print_sweep_table(ss, configs, results);
+	return ss.str();
+}
+
+/// Generate and contour many variations (seeds) of the current options as one batch.
+std::string run_batch(const Options& options, size_t num_jobs)
+{
+	const int resolution = options.resolution;
+
+	const auto generate_job = [&](SdfJob* job) {
+		Options job_options = options;
+		job_options.seed = options.seed + job->index;
+
+		Vec2List positions, normals;
+		for (const auto& shape : job_options.shapes) {
+			generate_points(&positions, &normals, shape, 0);
+		}
+		perturb_points(&positions, &normals, job_options);
+		const Vec2List lattice_positions = to_lattice_positions(positions, resolution);
+
+		job->sizes = {resolution, resolution};
+		job->weights = options.weights;
+		job->exact_solve = options.exact_solve;
+		job->solve_options = options.solve_options;
+		job->positions.assign(&lattice_positions[0].x, &lattice_positions[0].x + 2 * lattice_positions.size());
+		if (options.estimate_normals) {
+			job->estimate_missing_normals = true;
+		} else {
+			job->normals.assign(&normals[0].x, &normals[0].x + 2 * normals.size());
+		}
+		job->weigh_by_density = options.weigh_by_density;
+		job->density_weighting = options.density_weighting;
+	};
+
+	double total_area = 0;
+	const auto output_job = [&](SdfJob* job) {
+		if (job->sdf.empty()) { return; }
+		const auto lines = emilib::marching_squares(resolution, resolution, job->sdf.data());
+		total_area += emilib::calc_area(lines.size() / 4, lines.data()) / math::sqr(resolution - 1);
+	};
+
+	const PipelineStats stats = run_sdf_pipeline(num_jobs, generate_job, output_job, PipelineOptions{});
+
+	std::stringstream ss;
+	ss << format_pipeline_stats(stats);
+	ss << "Mean marching squares area: " << total_area / num_jobs << "\n";
+	return ss.str();
+}
+
+/// Random points (and their normals) on a sphere in the middle of a resolution^3 lattice.
+void sphere_points(int resolution, int num_points, std::vector<float>* positions, std::vector<float>* normals)
+{
+	std::default_random_engine rng(0);
+	std::normal_distribution<float> gaussian;
+	for (int i = 0; i < num_points; ++i) {
+		float dir[3] = {gaussian(rng), gaussian(rng), gaussian(rng)};
+		const float norm = std::sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]) + 1e-6f;
+		for (float& d : dir) {
+			d /= norm;
+			positions->push_back(0.5f * (resolution - 1) + 0.35f * resolution * d);
+			normals->push_back(d);
+		}
+	}
+}
+
+/// Time the approximate lattice solve of a 3D sphere for each memory placement, with and without pinned threads.
+/// Run with --benchmark-placement [resolution] on a multi-socket machine to see the NUMA effects.
+void benchmark_memory_placement(int resolution)
+{
+	LOG_SCOPE_F(INFO, "benchmark_memory_placement");
+	const std::vector<int> sizes(3, resolution);
+	const int num_points = 16 * resolution * resolution;
+	std::vector<float> positions, normals;
+	sphere_points(resolution, num_points, &positions, &normals);
+
+	const LatticeField field = sdf_from_points(sizes, Weights{}, num_points, positions.data(), normals.data(), nullptr);
+	const NormalEquation normal = make_normal_equation(field);
+
+	SolveOptions solve_options;
+	solve_options.cg = false; // Only the downscale and tile solvers are parallel.
+
+	const MemoryPlacement old_placement = memory_placement();
+	const bool old_pin_threads = pin_threads();
+
+	std::printf("%d^3 lattice, %lu threads\n", resolution, num_worker_threads());
+	std::printf("%-12s %-7s %s\n", "placement", "pinned", "best of 3 [s]");
+	for (const auto placement : {MemoryPlacement::kNaive, MemoryPlacement::kInterleaved, MemoryPlacement::kFirstTouch}) {
+		for (const bool pin : {false, true}) {
+			set_memory_placement(placement);
+			set_pin_threads(pin);
+			double best_seconds = INFINITY;
+			for (int i = 0; i < 3; ++i) {
+				emilib::Timer timer;
+				solve_normal_equation_approximate_lattice(normal, sizes, solve_options);
+				best_seconds = std::min(best_seconds, timer.secs());
+			}
+			std::printf("%-12s %-7s %.3f\n", memory_placement_name(placement), pin ? "yes" : "no", best_seconds);
+		}
+	}
+
+	set_memory_placement(old_placement);
+	set_pin_threads(old_pin_threads);
+}
+
+/// Time the out-of-core solve of a 3D sphere with its tile sweeps run by one process (threads only),
+/// and by several worker processes each bound to its share of the NUMA nodes.
+/// Run with --benchmark-processes [resolution] on a multi-socket machine to see the NUMA effects.
+void benchmark_processes(int resolution)
+{
+	LOG_SCOPE_F(INFO, "benchmark_processes");
+	const std::vector<int> sizes(3, resolution);
+	const int num_points = 16 * resolution * resolution;
+	std::vector<float> positions, normals;
+	sphere_points(resolution, num_points, &positions, &normals);
+
+	const int num_nodes = numa_node_cpus().size();
+	std::vector<int> process_counts = {1, 2, 4, num_nodes};
+	std::sort(process_counts.begin(), process_counts.end());
+	process_counts.erase(std::unique(process_counts.begin(), process_counts.end()), process_counts.end());
+
+	const std::string output_path = "benchmark_processes.bin";
+	std::printf("%d^3 lattice, %lu threads, %d NUMA nodes\n", resolution, num_worker_threads(), num_nodes);
+	std::printf("%-10s %s\n", "processes", "best of 3 [s]");
+	for (const int num_processes : process_counts) {
+		if (num_processes < 1 || static_cast<size_t>(num_processes) > num_worker_threads()) { continue; }
+		OutOfCoreOptions options;
+		options.num_processes = num_processes;
+		double best_seconds = INFINITY;
+		for (int i = 0; i < 3; ++i) {
+			emilib::Timer timer;
+			const bool success = sdf_from_points_out_of_core(
+				sizes, Weights{}, num_points, positions.data(), normals.data(), nullptr, output_path, options);
+			CHECK_F(success, "Out of core solve failed");
+			best_seconds = std::min(best_seconds, timer.secs());
+		}
+		std::printf("%-10d %.3f\n", num_processes, best_seconds);
+	}
+	std::remove(output_path.c_str());
+}
+
 Result generate(const Options& options)
 {
 	ERROR_CONTEXT("resolution", options.resolution);
@@ -276,22 +597,21 @@ Result generate(const Options& options)
 	}
 	perturb_points(&result.point_positions, &result.point_normals, options);
 
-	Vec2List lattice_positions;
+	const Vec2List lattice_positions = to_lattice_positions(result.point_positions, resolution);
 
-	for (const auto& pos : result.point_positions) {
-		ImVec2 on_lattice = pos;
-		on_lattice.x *= (resolution - 1.0f);
-		on_lattice.y *= (resolution - 1.0f);
-		lattice_positions.push_back(on_lattice);
+	if (options.estimate_normals) {
+		const std::vector<float> normals = estimate_normals(2, lattice_positions.size(), &lattice_positions[0].x);
+		for (size_t i = 0; i < result.point_normals.size(); ++i) {
+			result.point_normals[i] = ImVec2{normals[2 * i], normals[2 * i + 1]};
+		}
 	}
 
-	std::tie(result.field, result.sdf) = generate_sdf(lattice_positions, result.point_normals, options);
-	result.heatmap = generate_error_map(result.field.eq.triplets, result.sdf, result.field.eq.rhs);
+	std::tie(result.system, result.sdf) = generate_sdf(lattice_positions, result.point_normals, options);
+	result.error_breakdown = result.system->error_breakdown(options.weights, result.sdf);
+	result.heatmap = result.error_breakdown.heatmap;
 	result.heatmap_image = generate_heatmap(result.heatmap, 0, *max_element(result.heatmap.begin(), result.heatmap.end()));
 	CHECK_EQ_F(result.heatmap_image.size(), resolution * resolution);
 
-	double area_pixels = 0;
-
 	float max_abs_dist = 1e-6f;
 	for (const float dist : result.sdf) {
 		max_abs_dist = std::max(max_abs_dist, std::abs(dist));
@@ -306,14 +626,12 @@ Result generate(const Options& options)
 			result.sdf_image.emplace_back(RGBA{255, inv_dist_u8, inv_dist_u8, 255});
 		}
 
-		float insideness = 1 - std::max(0.0, std::min(1.0, (dist + 0.5) * 2));
+		const float insideness = calc_insideness(dist);
 		const uint8_t color = 255 * insideness;
 		result.blob_image.emplace_back(RGBA{color, color, color, 255});
-
-		area_pixels += insideness;
 	}
 
-	result.blob_area = area_pixels / math::sqr(resolution - 1);
+	result.blob_area = calc_blob_area(result.sdf, resolution);
 
 	result.duration_seconds = timer.secs();
 	return result;
@@ -347,6 +665,12 @@ bool show_weights(Weights* weights)
 	ImGui::SameLine();
 	changed |= ImGuiPP::RadioButtonEnum("n-linear-interpolation", &weights->gradient_kernel, GradientKernel::kLinearInteprolation);
 
+	ImGui::Text("Value kernel:");
+	ImGui::SameLine();
+	changed |= ImGuiPP::RadioButtonEnum("multilinear", &weights->value_kernel, ValueKernel::kMultilinear);
+	ImGui::SameLine();
+	changed |= ImGuiPP::RadioButtonEnum("nearest-neighbor##value", &weights->value_kernel, ValueKernel::kNearestNeighbor);
+
 	if (ImGui::Button("Reset weights")) {
 		*weights = {};
 		changed = true;
@@ -377,13 +701,43 @@ bool show_solve_options(SolveOptions* options)
 	if (options->tile) {
 		changed |= ImGui::SliderInt("tile_size", &options->tile_size, 2, 128);
 	}
+	changed |= ImGui::SliderInt("smoothing_sweeps", &options->smoothing_sweeps, 0, 50);
+	if (options->smoothing_sweeps > 0) {
+		ImGui::SameLine();
+		changed |= ImGuiPP::RadioButtonEnum("Gauss-Seidel", &options->smoother, Smoother::kGaussSeidel);
+		ImGui::SameLine();
+		changed |= ImGuiPP::RadioButtonEnum("Chebyshev", &options->smoother, Smoother::kChebyshev);
+	}
 	changed |= ImGui::Checkbox("cg", &options->cg);
 	if (options->cg) {
+		ImGui::SameLine();
+		changed |= ImGuiPP::RadioButtonEnum("Jacobi", &options->preconditioner, CgPreconditioner::kDiagonal);
+		ImGui::SameLine();
+		changed |= ImGuiPP::RadioButtonEnum("AMG", &options->preconditioner, CgPreconditioner::kAmg);
+		ImGui::SameLine();
+		changed |= ImGuiPP::RadioButtonEnum("Deflation", &options->preconditioner, CgPreconditioner::kDeflation);
 		changed |= ImGui::SliderFloat("error_tolerance", &options->error_tolerance, 1e-6f, 1, "%.6f", 4);
 	}
 	return changed;
 }
 
+bool show_robust_options(RobustOptions* options)
+{
+	bool changed = false;
+	ImGui::Text("Robust loss (for outliers):");
+	ImGui::SameLine();
+	changed |= ImGuiPP::RadioButtonEnum("none", &options->loss, RobustLoss::kNone);
+	ImGui::SameLine();
+	changed |= ImGuiPP::RadioButtonEnum("Huber", &options->loss, RobustLoss::kHuber);
+	ImGui::SameLine();
+	changed |= ImGuiPP::RadioButtonEnum("Tukey", &options->loss, RobustLoss::kTukey);
+	if (options->loss != RobustLoss::kNone) {
+		changed |= ImGui::SliderInt("IRLS iterations", &options->iterations, 1, 20);
+		changed |= ImGui::SliderFloat("Residual scale (0=auto)", &options->scale, 0, 1, "%.4f", 2);
+	}
+	return changed;
+}
+
 bool show_options(Options* options)
 {
 	bool changed = false;
@@ -413,13 +767,22 @@ bool show_options(Options* options)
 	ImGui::Separator();
 	changed |= ImGui::SliderFloat("pos_noise", &options->pos_noise, 0,   0.1, "%.4f");
 	changed |= ImGui::SliderAngle("dir_noise", &options->dir_noise, 0, 360);
+	changed |= ImGui::Checkbox("Estimate normals from positions", &options->estimate_normals);
+	changed |= ImGui::Checkbox("Weigh points by inverse density", &options->weigh_by_density);
+	if (options->weigh_by_density) {
+		changed |= ImGui::SliderFloat("density cell size", &options->density_weighting.cell_size,  1, 32, "%.1f");
+		changed |= ImGui::SliderFloat("density strength",  &options->density_weighting.strength,   0,  1);
+		changed |= ImGui::SliderFloat("max point weight",  &options->density_weighting.max_weight, 1, 100, "%.1f", 2);
+	}
 	ImGui::Separator();
 	changed |= show_weights(&options->weights);
 
 	changed |= ImGui::Checkbox("Exact solve", &options->exact_solve);
 	if (!options->exact_solve) {
 		changed |= show_solve_options(&options->solve_options);
+		changed |= ImGui::Checkbox("Warm start from previous solution", &options->warm_start);
 	}
+	changed |= show_robust_options(&options->robust_options);
 
 	return changed;
 }
@@ -528,8 +891,13 @@ void show_field_equations(const LatticeField& field)
 {
 	std::stringstream ss;
 	ss << field.eq;
+	if (field.model) {
+		for (const auto& component : field.model->components->components()) {
+			ss << component->eq; // NOTE: unit weight
+		}
+	}
 	std::string eq_str = ss.str();
-	ImGui::Text("%lu equations:\n", field.eq.rhs.size());
+	ImGui::Text("%lu equations:\n", field.num_equations());
 	ImGui::TextUnformatted(eq_str.c_str());
 }
 
@@ -599,6 +967,8 @@ bool show_options(Field1DInput* input)
 
 void show_1d_field_window(Field1DInput* input)
 {
+	static ModelSystemCache s_model_cache;
+
 	if (show_options(input)) {
 		configuru::dump_file("1d_field.json", to_config(*input), configuru::JSON);
 	}
@@ -612,10 +982,10 @@ void show_1d_field_window(Field1DInput* input)
 		add_gradient_constraint(&field, &pos_lattice, &gradient_lattice, input->weights.data_gradient, input->weights.gradient_kernel);
 	}
 
-	add_field_constraints(&field, input->weights);
+	add_field_constraints(&field, input->weights, &s_model_cache);
 
 	const size_t num_unknowns = input->resolution;
-	auto interpolated = solve_sparse_linear(num_unknowns, field.eq.triplets, field.eq.rhs);
+	auto interpolated = solve_normal_equation(make_normal_equation(field));
 	if (interpolated.size() != num_unknowns) {
 		LOG_F(ERROR, "Failed to find a solution");
 		interpolated.resize(num_unknowns, 0.0f);
@@ -670,14 +1040,20 @@ void show_2d_field_window()
 	};
 
 	static int         s_resolution = 64;
+	static bool        s_periodic   = false;
 	static Weights     s_weights;
 	static gl::Texture s_texture{"2d_field", gl::TexParams::clamped_nearest()};
+	static ModelSystemCache s_model_cache;
 
 	ImGui::SliderInt("resolution", &s_resolution, 4, 64);
+	ImGui::Checkbox("periodic (tileable, solved with FFT)", &s_periodic);
 	show_weights(&s_weights);
 
 	LatticeField field{{s_resolution, s_resolution}};
-	add_field_constraints(&field, s_weights);
+	if (s_periodic) {
+		field.set_periodic({true, true});
+	}
+	add_field_constraints(&field, s_weights, &s_model_cache);
 
 	for (int y = 0; y < 4; ++y) {
 		for (int x = 0; x < 4; ++x) {
@@ -692,7 +1068,9 @@ void show_2d_field_window()
 	}
 
 	const size_t num_unknowns = s_resolution * s_resolution;
-	auto interpolated = solve_sparse_linear(num_unknowns, field.eq.triplets, field.eq.rhs);
+	auto interpolated = s_periodic
+		? solve_periodic(field, s_weights)
+		: solve_normal_equation(make_normal_equation(field));
 	if (interpolated.size() != num_unknowns) {
 		LOG_F(ERROR, "Failed to find a solution");
 		interpolated.resize(num_unknowns, 0.0f);
@@ -721,6 +1099,9 @@ struct FieldGui
 	bool dual_contouring = false;
 	bool draw_blob = true;
 	bool draw_blob_normals = false;
+	int heatmap_class = -1; ///< ConstraintClass to show the error of, or -1 for all.
+	std::string sweep_table;
+	std::string batch_stats;
 
 	FieldGui()
 	{
@@ -737,7 +1118,40 @@ struct FieldGui
 		const auto image_size = gl::Size{static_cast<unsigned>(options.resolution), static_cast<unsigned>(options.resolution)};
 		sdf_texture.set_data(result.sdf_image.data(),         image_size, gl::ImageFormat::RGBA32);
 		blob_texture.set_data(result.blob_image.data(),       image_size, gl::ImageFormat::RGBA32);
-		heatmap_texture.set_data(result.heatmap_image.data(), image_size, gl::ImageFormat::RGBA32);
+		update_heatmap_texture();
+	}
+
+	void update_heatmap_texture()
+	{
+		const auto image_size = gl::Size{static_cast<unsigned>(options.resolution), static_cast<unsigned>(options.resolution)};
+		if (heatmap_class < 0 || result.error_breakdown.heatmaps[heatmap_class].empty()) {
+			heatmap_texture.set_data(result.heatmap_image.data(), image_size, gl::ImageFormat::RGBA32);
+		} else {
+			// Same scale as the total, so the classes can be compared:
+			const auto image = generate_heatmap(result.error_breakdown.heatmaps[heatmap_class], 0,
+				*max_element(result.heatmap.begin(), result.heatmap.end()));
+			heatmap_texture.set_data(image.data(), image_size, gl::ImageFormat::RGBA32);
+		}
+	}
+
+	void show_error_breakdown()
+	{
+		bool changed = ImGui::RadioButton("all", &heatmap_class, -1);
+		double total = 0;
+		for (int i = 0; i < NUM_CONSTRAINT_CLASSES; ++i) {
+			if (result.error_breakdown.heatmaps[i].empty()) { continue; }
+			total += result.error_breakdown.totals[i];
+			ImGui::SameLine();
+			changed |= ImGui::RadioButton(constraint_class_name(static_cast<ConstraintClass>(i)), &heatmap_class, i);
+		}
+		for (int i = 0; i < NUM_CONSTRAINT_CLASSES; ++i) {
+			if (result.error_breakdown.heatmaps[i].empty()) { continue; }
+			ImGui::Text("%-20s error: %10.4f (%4.1f%%)", constraint_class_name(static_cast<ConstraintClass>(i)),
+				result.error_breakdown.totals[i], total > 0 ? 100 * result.error_breakdown.totals[i] / total : 0.0);
+		}
+		if (changed) {
+			update_heatmap_texture();
+		}
 	}
 
 	void show_input()
@@ -771,8 +1185,8 @@ struct FieldGui
 		const float lines_area = emilib::calc_area(lines.size() / 4, lines.data()) / math::sqr(options.resolution - 1);
 
 		ImGui::Text("%lu unknowns", options.resolution * options.resolution);
-		ImGui::Text("%lu equations", result.field.eq.rhs.size());
-		ImGui::Text("%lu non-zero values in matrix", result.field.eq.triplets.size());
+		ImGui::Text("%lu equations", result.system->num_equations());
+		ImGui::Text("%lu non-zero values in matrix", result.system->num_nonzeros());
 		ImGui::Text("Calculated in %.3f s", result.duration_seconds);
 		ImGui::Text("Model area: %.3f, marching squares area: %.3f, sdf blob area: %.3f",
 			area(options.shapes), lines_area, result.blob_area);
@@ -808,6 +1222,7 @@ struct FieldGui
 		ImGui::Image(reinterpret_cast<ImTextureID>(heatmap_texture.id()), canvas_size);
 
 		ImGui::Text("Max error: %f", *max_element(result.heatmap.begin(), result.heatmap.end()));
+		show_error_breakdown();
 
 		ImGui::Image(reinterpret_cast<ImTextureID>(sdf_texture.id()), canvas_size);
 		ImGui::SameLine();
@@ -826,6 +1241,19 @@ struct FieldGui
 			CHECK_F(emilib::write_tga("sdf.tga",     res, res, result.sdf_image.data(),     alpha));
 			CHECK_F(emilib::write_tga("blob.tga",    res, res, result.blob_image.data(),    alpha));
 		}
+		ImGui::SameLine();
+		if (ImGui::Button("Sweep weights")) {
+			sweep_table = sweep_weights(options, result);
+		}
+		if (!sweep_table.empty()) {
+			ImGui::TextUnformatted(sweep_table.c_str());
+		}
+		if (ImGui::Button("Run batch of 256 seeds")) {
+			batch_stats = run_batch(options, 256);
+		}
+		if (!batch_stats.empty()) {
+			ImGui::TextUnformatted(batch_stats.c_str());
+		}
 	}
 };
 
@@ -849,6 +1277,16 @@ int main(int argc, char* argv[])
 {
 	loguru::g_colorlogtostderr = false;
 	loguru::init(argc, argv);
+
+	if (argc >= 2 && std::strcmp(argv[1], "--benchmark-placement") == 0) {
+		benchmark_memory_placement(argc >= 3 ? std::atoi(argv[2]) : 128);
+		return 0;
+	}
+	if (argc >= 2 && std::strcmp(argv[1], "--benchmark-processes") == 0) {
+		benchmark_processes(argc >= 3 ? std::atoi(argv[2]) : 128);
+		return 0;
+	}
+
 	emilib::sdl::Params sdl_params;
 	sdl_params.window_name = "2D SDF generator";
 	sdl_params.width_points = 1800;
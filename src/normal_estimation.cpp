@@ -0,0 +1,415 @@
+#include "normal_estimation.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <queue>
+
+#include <Eigen/Dense>
+#include <loguru.hpp>
+
+#include "field_interpolation.hpp"
+#include "parallel.hpp"
+
+namespace {
+
+/// Number of points handled by each parallel job.
+const size_t POINT_CHUNK_SIZE = 4096;
+
+/// Number of points the automatic cell size is measured on.
+const int CELL_SIZE_SAMPLES = 256;
+
+size_t num_point_chunks(size_t num_points)
+{
+	return (num_points + POINT_CHUNK_SIZE - 1) / POINT_CHUNK_SIZE;
+}
+
+struct Neighbor
+{
+	float distance_sq;
+	int   index;
+
+	bool operator<(const Neighbor& other) const { return distance_sq < other.distance_sq; }
+};
+
+/// A uniform grid of cubic cells, hashed into a table with about one bucket per point.
+/// Cells which collide in the table share a bucket, so points are checked against their cell when searching.
+/// The positions and cells are kept sorted by bucket, so that the search reads memory sequentially.
+class SpatialHash
+{
+public:
+	SpatialHash(int num_dim, int num_points, const float positions[], float cell_size)
+		: _num_dim(num_dim), _cell_size(cell_size)
+	{
+		CHECK_GT_F(cell_size, 0.0f);
+		size_t num_buckets = 1;
+		while (num_buckets < static_cast<size_t>(num_points)) { num_buckets *= 2; }
+		_bucket_mask = num_buckets - 1;
+
+		std::vector<int> cells(static_cast<size_t>(num_points) * num_dim);
+		std::vector<size_t> buckets(num_points);
+		parallel_for_chunks(num_points, num_point_chunks(num_points), [&](size_t, size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				int* cell = &cells[i * num_dim];
+				for (int d = 0; d < num_dim; ++d) {
+					cell[d] = static_cast<int>(std::floor(positions[i * num_dim + d] / cell_size));
+				}
+				buckets[i] = bucket(cell);
+			}
+		});
+
+		for (int d = 0; d < num_dim; ++d) {
+			_min_cell[d] = std::numeric_limits<int>::max();
+			_max_cell[d] = std::numeric_limits<int>::min();
+		}
+		for (int i = 0; i < num_points; ++i) {
+			for (int d = 0; d < num_dim; ++d) {
+				_min_cell[d] = std::min(_min_cell[d], cells[i * num_dim + d]);
+				_max_cell[d] = std::max(_max_cell[d], cells[i * num_dim + d]);
+			}
+		}
+
+		// Counting sort of the points by bucket:
+		_bucket_starts.assign(num_buckets + 1, 0);
+		for (const size_t b : buckets) { _bucket_starts[b + 1] += 1; }
+		std::partial_sum(_bucket_starts.begin(), _bucket_starts.end(), _bucket_starts.begin());
+		_points.resize(num_points);
+		std::vector<int> fill(_bucket_starts.begin(), _bucket_starts.end() - 1);
+		for (int i = 0; i < num_points; ++i) {
+			_points[fill[buckets[i]]++] = i;
+		}
+
+		_sorted_positions.resize(cells.size());
+		_sorted_cells.resize(cells.size());
+		for (int slot = 0; slot < num_points; ++slot) {
+			const int i = _points[slot];
+			std::copy_n(positions + static_cast<size_t>(i) * num_dim, num_dim, &_sorted_positions[static_cast<size_t>(slot) * num_dim]);
+			std::copy_n(&cells[static_cast<size_t>(i) * num_dim],      num_dim, &_sorted_cells[static_cast<size_t>(slot) * num_dim]);
+		}
+	}
+
+	/// Points are stored in slots, sorted by bucket, so points of the same cell are in consecutive slots.
+	/// Going through the points in slot order is the most cache friendly.
+	int point_in_slot(size_t slot) const { return _points[slot]; }
+
+	/// The (up to) `k` nearest points to the point in `slot`, not counting itself, closest first.
+	/// The grid is searched in growing shells of cells around the cell of the point,
+	/// until the k:th nearest is closer than any point in the next shell can be.
+	void nearest(size_t slot, int k, std::vector<Neighbor>* out) const
+	{
+		out->clear();
+		const int    i      = _points[slot];
+		const int*   center = &_sorted_cells[slot * _num_dim];
+		const float* pos    = &_sorted_positions[slot * _num_dim];
+
+		int max_radius = 0;
+		for (int d = 0; d < _num_dim; ++d) {
+			max_radius = std::max({max_radius, center[d] - _min_cell[d], _max_cell[d] - center[d]});
+		}
+
+		for (int radius = 0; radius <= max_radius; ++radius) {
+			// All cells with an offset in [-radius, radius] along each axis, and exactly ±radius along at least one:
+			int offset[MAX_DIM];
+			std::fill(offset, offset + _num_dim, -radius);
+			for (;;) {
+				bool on_shell = false;
+				bool inside   = true;
+				int cell[MAX_DIM];
+				for (int d = 0; d < _num_dim; ++d) {
+					on_shell |= std::abs(offset[d]) == radius;
+					cell[d] = center[d] + offset[d];
+					inside &= _min_cell[d] <= cell[d] && cell[d] <= _max_cell[d];
+				}
+				if (on_shell && inside) {
+					add_cell(i, pos, cell, k, out);
+				}
+
+				int d = 0;
+				for (; d < _num_dim && offset[d] == radius; ++d) { offset[d] = -radius; }
+				if (d == _num_dim) { break; }
+				offset[d] += 1;
+			}
+
+			// Points in cells further out are at least `radius` cells away:
+			const float covered = radius * _cell_size;
+			if (out->size() == static_cast<size_t>(k) && out->front().distance_sq <= covered * covered) { break; }
+		}
+
+		std::sort_heap(out->begin(), out->end());
+	}
+
+	/// The closest point above `pos` in the column of cells straight above it which passes `is_candidate`,
+	/// or -1 if there is none. Everything above the top surface is outside, so the normal of that point
+	/// tells if `pos` is inside or outside.
+	template<typename Predicate>
+	int first_above(const float* pos, const Predicate& is_candidate) const
+	{
+		const int last = _num_dim - 1;
+		int cell[MAX_DIM];
+		for (int d = 0; d < _num_dim; ++d) {
+			cell[d] = static_cast<int>(std::floor(pos[d] / _cell_size));
+		}
+
+		int   best = -1;
+		float best_height = std::numeric_limits<float>::infinity();
+		for (; cell[last] <= _max_cell[last]; ++cell[last]) {
+			const size_t b = bucket(cell);
+			for (int slot = _bucket_starts[b]; slot < _bucket_starts[b + 1]; ++slot) {
+				const int* cell_j = &_sorted_cells[static_cast<size_t>(slot) * _num_dim];
+				if (!std::equal(cell, cell + _num_dim, cell_j)) { continue; }
+				const float* pos_j = &_sorted_positions[static_cast<size_t>(slot) * _num_dim];
+				const float height = pos_j[last] - pos[last];
+				if (height <= 0 || height >= best_height || !is_candidate(_points[slot])) { continue; }
+				best = _points[slot];
+				best_height = height;
+			}
+			if (best >= 0) { break; }
+		}
+		return best;
+	}
+
+private:
+	size_t bucket(const int cell[]) const
+	{
+		static const uint64_t kPrimes[MAX_DIM] = {73856093, 19349663, 83492791, 49979687, 67867967, 86028121};
+		uint64_t hash = 0;
+		for (int d = 0; d < _num_dim; ++d) {
+			hash ^= static_cast<uint64_t>(static_cast<uint32_t>(cell[d])) * kPrimes[d];
+		}
+		return hash & _bucket_mask;
+	}
+
+	/// Add the points of `cell` to the max-heap `out` of the k nearest.
+	void add_cell(int i, const float* pos, const int cell[], int k, std::vector<Neighbor>* out) const
+	{
+		const size_t b = bucket(cell);
+		for (int slot = _bucket_starts[b]; slot < _bucket_starts[b + 1]; ++slot) {
+			const int* cell_j = &_sorted_cells[static_cast<size_t>(slot) * _num_dim];
+			if (!std::equal(cell, cell + _num_dim, cell_j)) { continue; }
+			const int j = _points[slot];
+			if (j == i) { continue; }
+
+			const float* pos_j = &_sorted_positions[static_cast<size_t>(slot) * _num_dim];
+			float distance_sq = 0;
+			for (int d = 0; d < _num_dim; ++d) {
+				const float delta = pos_j[d] - pos[d];
+				distance_sq += delta * delta;
+			}
+			if (out->size() < static_cast<size_t>(k)) {
+				out->push_back(Neighbor{distance_sq, j});
+				std::push_heap(out->begin(), out->end());
+			} else if (distance_sq < out->front().distance_sq) {
+				std::pop_heap(out->begin(), out->end());
+				out->back() = Neighbor{distance_sq, j};
+				std::push_heap(out->begin(), out->end());
+			}
+		}
+	}
+
+	int                _num_dim;
+	float              _cell_size;
+	size_t             _bucket_mask;
+	std::vector<int>   _bucket_starts;    ///< The points of bucket b are in slots [_bucket_starts[b], _bucket_starts[b + 1]).
+	std::vector<int>   _points;           ///< Point index of each slot.
+	std::vector<float> _sorted_positions; ///< Interleaved positions of each slot.
+	std::vector<int>   _sorted_cells;     ///< Interleaved cell coordinates of each slot.
+	int                _min_cell[MAX_DIM];
+	int                _max_cell[MAX_DIM];
+};
+
+/// The normal is the eigenvector of the smallest eigenvalue of the covariance of the point and its neighbors.
+/// Fixed-size for 2D and 3D, where the eigenvectors are solved for in closed form,
+/// which is much faster than the iterative solver used for Eigen::Dynamic.
+template<int Dim>
+void fit_normal(int num_dim, const float positions[], int i, const std::vector<Neighbor>& neighbors, float* out)
+{
+	using Vector = Eigen::Matrix<float, Dim, 1>;
+	using Matrix = Eigen::Matrix<float, Dim, Dim>;
+	const auto point = [&](int index) {
+		return Eigen::Map<const Vector>(positions + static_cast<size_t>(index) * num_dim, num_dim);
+	};
+
+	Vector mean = point(i);
+	for (const auto& neighbor : neighbors) {
+		mean += point(neighbor.index);
+	}
+	mean /= neighbors.size() + 1;
+
+	Matrix covariance = (point(i) - mean) * (point(i) - mean).transpose();
+	for (const auto& neighbor : neighbors) {
+		const Vector delta = point(neighbor.index) - mean;
+		covariance.noalias() += delta * delta.transpose();
+	}
+
+	Eigen::SelfAdjointEigenSolver<Matrix> solver;
+	solver.computeDirect(covariance); // Iterative for Eigen::Dynamic
+	Eigen::Map<Vector> normal(out, num_dim);
+	normal = solver.eigenvectors().col(0);
+}
+
+/// Twice the median distance to the k:th neighbor of a sample of the points.
+float automatic_cell_size(int num_dim, int num_points, const float positions[], int k)
+{
+	const SpatialHash hash(num_dim, num_points, positions, 1.0f);
+	const int num_samples = std::min(num_points, CELL_SIZE_SAMPLES);
+	std::vector<float> distances;
+	std::vector<Neighbor> nearest;
+	for (int sample = 0; sample < num_samples; ++sample) {
+		hash.nearest(static_cast<size_t>(sample) * num_points / num_samples, k, &nearest);
+		if (!nearest.empty()) {
+			distances.push_back(std::sqrt(nearest.back().distance_sq));
+		}
+	}
+	if (distances.empty()) { return 1.0f; }
+	std::nth_element(distances.begin(), distances.begin() + distances.size() / 2, distances.end());
+	const float median = distances[distances.size() / 2];
+	return median > 0 ? 2 * median : 1.0f;
+}
+
+float dot(int num_dim, const float* a, const float* b)
+{
+	float sum = 0;
+	for (int d = 0; d < num_dim; ++d) {
+		sum += a[d] * b[d];
+	}
+	return sum;
+}
+
+void flip(int num_dim, float* normal)
+{
+	for (int d = 0; d < num_dim; ++d) {
+		normal[d] = -normal[d];
+	}
+}
+
+/// Flip normals so that they agree with their parent in a minimum spanning tree of the neighbor graph,
+/// with the cost 1 - |n_a · n_b| of an edge (Prim's algorithm).
+/// The neighbor graph may fall apart into several parts, e.g. the outside of an object and the surface
+/// of a hole in it. The parts are oriented from the top down, each starting from its top point.
+/// That point's normal points up, unless the closest oriented point above it has an upward normal:
+/// then the top point is inside the object, and so on the surface of a hole.
+void orient_normals(int num_dim, int num_points, const float positions[], int k, const SpatialHash& hash,
+                    const std::vector<int>& neighbors, float* normals)
+{
+	// The k-nearest-neighbor relation is not symmetric, but the graph must be:
+	std::vector<int> edge_starts(num_points + 1, 0);
+	for (int i = 0; i < num_points; ++i) {
+		for (int n = 0; n < k; ++n) {
+			const int j = neighbors[static_cast<size_t>(i) * k + n];
+			if (j < 0) { continue; }
+			edge_starts[i + 1] += 1;
+			edge_starts[j + 1] += 1;
+		}
+	}
+	std::partial_sum(edge_starts.begin(), edge_starts.end(), edge_starts.begin());
+	std::vector<int> edges(edge_starts.back());
+	std::vector<int> fill(edge_starts.begin(), edge_starts.end() - 1);
+	for (int i = 0; i < num_points; ++i) {
+		for (int n = 0; n < k; ++n) {
+			const int j = neighbors[static_cast<size_t>(i) * k + n];
+			if (j < 0) { continue; }
+			edges[fill[i]++] = j;
+			edges[fill[j]++] = i;
+		}
+	}
+
+	const int last = num_dim - 1;
+	std::vector<int> seeds(num_points);
+	std::iota(seeds.begin(), seeds.end(), 0);
+	std::sort(seeds.begin(), seeds.end(), [&](int a, int b) {
+		return positions[static_cast<size_t>(a) * num_dim + last] > positions[static_cast<size_t>(b) * num_dim + last];
+	});
+
+	struct Edge
+	{
+		float cost;
+		int   from;
+		int   to;
+		bool operator<(const Edge& other) const { return cost > other.cost; } // Cheapest first
+	};
+
+	std::vector<bool> visited(num_points, false);
+	std::priority_queue<Edge> queue;
+	for (const int seed : seeds) {
+		if (visited[seed]) { continue; }
+		float* seed_normal = normals + static_cast<size_t>(seed) * num_dim;
+		const int above = hash.first_above(positions + static_cast<size_t>(seed) * num_dim,
+		                                   [&](int i) { return visited[i]; });
+		const bool inside = above >= 0 && normals[static_cast<size_t>(above) * num_dim + last] > 0;
+		if ((seed_normal[last] < 0) != inside) {
+			flip(num_dim, seed_normal);
+		}
+		queue.push(Edge{0, seed, seed});
+
+		while (!queue.empty()) {
+			const Edge edge = queue.top();
+			queue.pop();
+			if (visited[edge.to]) { continue; }
+			visited[edge.to] = true;
+
+			float* normal = normals + static_cast<size_t>(edge.to) * num_dim;
+			if (dot(num_dim, normal, normals + static_cast<size_t>(edge.from) * num_dim) < 0) {
+				flip(num_dim, normal);
+			}
+
+			for (int e = edge_starts[edge.to]; e < edge_starts[edge.to + 1]; ++e) {
+				const int next = edges[e];
+				if (visited[next]) { continue; }
+				const float cost = 1 - std::abs(dot(num_dim, normal, normals + static_cast<size_t>(next) * num_dim));
+				queue.push(Edge{cost, edge.to, next});
+			}
+		}
+	}
+}
+
+} // namespace
+
+std::vector<float> estimate_normals(
+	int                            num_dim,
+	int                            num_points,
+	const float                    positions[],
+	const NormalEstimationOptions& options)
+{
+	LOG_SCOPE_F(INFO, "estimate_normals");
+	CHECK_F(1 <= num_dim && num_dim <= MAX_DIM);
+	CHECK_GT_F(options.num_neighbors, 0);
+	if (num_points == 0) { return {}; }
+	CHECK_NOTNULL_F(positions);
+
+	const int k = options.num_neighbors;
+	const float cell_size = options.cell_size > 0
+		? options.cell_size
+		: automatic_cell_size(num_dim, num_points, positions, k);
+	LOG_F(INFO, "Cell size: %f", cell_size);
+	const SpatialHash hash(num_dim, num_points, positions, cell_size);
+
+	std::vector<float> normals(static_cast<size_t>(num_points) * num_dim);
+	std::vector<int>   neighbors(static_cast<size_t>(num_points) * k, -1);
+
+	parallel_for_chunks(num_points, num_point_chunks(num_points), [&](size_t, size_t begin, size_t end) {
+		std::vector<Neighbor> nearest;
+		for (size_t slot = begin; slot < end; ++slot) {
+			const size_t i = hash.point_in_slot(slot);
+			hash.nearest(slot, k, &nearest);
+			for (size_t n = 0; n < nearest.size(); ++n) {
+				neighbors[i * k + n] = nearest[n].index;
+			}
+			float* normal = &normals[i * num_dim];
+			if (num_dim == 2) {
+				fit_normal<2>(num_dim, positions, i, nearest, normal);
+			} else if (num_dim == 3) {
+				fit_normal<3>(num_dim, positions, i, nearest, normal);
+			} else {
+				fit_normal<Eigen::Dynamic>(num_dim, positions, i, nearest, normal);
+			}
+		}
+	});
+
+	if (options.orient) {
+		orient_normals(num_dim, num_points, positions, k, hash, neighbors, normals.data());
+	}
+
+	return normals;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+
+struct NormalEstimationOptions
+{
+	int   num_neighbors = 10;   ///< Number of nearest neighbors the plane (or line) at each point is fitted to.
+	float cell_size     =  0;   ///< Of the spatial hash, in the units of the positions. 0 means automatic (see estimate_normals).
+	bool  orient        = true; ///< Make the signs of neighboring normals agree. Else each sign is arbitrary.
+};
+
+/// Normals of an unoriented point cloud (e.g. LiDAR scans), to use as the `normals` of sdf_from_points.
+///   1. The k nearest neighbors of each point are found using a uniform grid, hashed so that the memory
+///      used is proportional to the number of points rather than to the volume.
+///      The search is fastest with cells about twice the distance to the k:th neighbor, so unless a cell size
+///      is given, that distance is measured on a sample of points using lattice sized cells (1) first.
+///   2. The normal is the eigenvector of the smallest eigenvalue of the covariance of the neighborhood (PCA).
+///   3. The signs are made consistent by propagating the orientation along a minimum spanning tree
+///      of the neighbor graph, in which edges between near-parallel normals are the cheapest
+///      (Hoppe et al. 1992, "Surface reconstruction from unorganized points").
+///      Each connected part starts from its point with the largest last coordinate,
+///      whose normal is made to point that way: out of a closed surface.
+/// The first two steps are multithreaded.
+/// `positions` are interleaved (xyzxyz...), and so are the returned unit normals.
+std::vector<float> estimate_normals(
+	int                            num_dim,
+	int                            num_points,
+	const float                    positions[],
+	const NormalEstimationOptions& options = {});
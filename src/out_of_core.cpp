@@ -0,0 +1,1021 @@
+#include "out_of_core.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <new>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+	#include <sched.h>
+	#include <sys/prctl.h>
+#endif
+
+#include <Eigen/SparseCholesky>
+
+#include <loguru.hpp>
+
+#include "amg.hpp"
+#include "cg_checkpoint.hpp"
+#include "parallel.hpp"
+
+MappedFloats::MappedFloats(const std::string& path, size_t size, bool create) : _size(size)
+{
+	const int fd = open(path.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+	if (fd < 0) {
+		LOG_F(ERROR, "Failed to open '%s'", path.c_str());
+		return;
+	}
+	const size_t num_bytes = std::max<size_t>(1, size * sizeof(float));
+	if (create && ftruncate(fd, num_bytes) != 0) {
+		LOG_F(ERROR, "Failed to resize '%s' to %lu bytes", path.c_str(), num_bytes);
+		close(fd);
+		return;
+	}
+	void* mapped = mmap(nullptr, num_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // The mapping keeps the file open.
+	if (mapped == MAP_FAILED) {
+		LOG_F(ERROR, "Failed to mmap '%s'", path.c_str());
+		return;
+	}
+	_data = static_cast<float*>(mapped);
+}
+
+MappedFloats::~MappedFloats()
+{
+	if (_data) {
+		munmap(_data, std::max<size_t>(1, _size * sizeof(float)));
+	}
+}
+
+namespace {
+
+/// Lattice split into tiles, tile_size^D big (smaller at the upper edges).
+struct TileGrid
+{
+	std::vector<int> sizes;
+	int              tile_size;
+	std::vector<int> num_tiles;
+	size_t           num_tiles_total = 1;
+
+	TileGrid(const std::vector<int>& sizes_arg, int tile_size_arg) : sizes(sizes_arg), tile_size(tile_size_arg)
+	{
+		for (const int size : sizes) {
+			num_tiles.push_back((size + tile_size - 1) / tile_size);
+			num_tiles_total *= num_tiles.back();
+		}
+	}
+
+	void tile_coordinate(size_t tile_index, int coordinate[]) const
+	{
+		for (size_t d = 0; d < sizes.size(); ++d) {
+			coordinate[d] = tile_index % num_tiles[d];
+			tile_index /= num_tiles[d];
+		}
+	}
+
+	size_t tile_index(const int coordinate[]) const
+	{
+		size_t index = 0;
+		size_t stride = 1;
+		for (size_t d = 0; d < sizes.size(); ++d) {
+			index += coordinate[d] * stride;
+			stride *= num_tiles[d];
+		}
+		return index;
+	}
+
+	/// The lattice points of a tile: box_min[d] <= coordinate[d] < box_max[d]
+	void tile_box(size_t tile_index, int box_min[], int box_max[]) const
+	{
+		int coordinate[MAX_DIM];
+		tile_coordinate(tile_index, coordinate);
+		for (size_t d = 0; d < sizes.size(); ++d) {
+			box_min[d] = coordinate[d] * tile_size;
+			box_max[d] = std::min(sizes[d], box_min[d] + tile_size);
+		}
+	}
+
+	/// The tile of the cell containing the point. Points outside the lattice go to the closest tile.
+	size_t tile_of_point(const float pos[]) const
+	{
+		int coordinate[MAX_DIM];
+		for (size_t d = 0; d < sizes.size(); ++d) {
+			const int cell = static_cast<int>(std::floor(pos[d]));
+			coordinate[d] = std::max(0, std::min(num_tiles[d] - 1, cell / tile_size));
+		}
+		return tile_index(coordinate);
+	}
+
+	/// Tiles are colored so that two tiles of the same color are at least one tile apart.
+	int tile_color(size_t tile_index) const
+	{
+		int coordinate[MAX_DIM];
+		tile_coordinate(tile_index, coordinate);
+		int color = 0;
+		for (size_t d = 0; d < sizes.size(); ++d) {
+			color |= (coordinate[d] % 2) << d;
+		}
+		return color;
+	}
+};
+
+/// The points of a set of tiles, as separate arrays ready for add_data_constraints.
+struct PointSet
+{
+	std::vector<float> positions;
+	std::vector<float> normals;
+	std::vector<float> weights;
+
+	size_t size() const { return weights.size(); }
+};
+
+/// Per-tile files of points. Each record is: position[D], normal[D] (if any), weight.
+class SpillFiles
+{
+public:
+	SpillFiles(const OutOfCoreOptions& options, const TileGrid& grid, bool has_normals)
+		: _directory(options.spill_directory)
+		, _max_buffered_floats(std::max<size_t>(1, options.spill_buffer_bytes / sizeof(float)))
+		, _num_dim(grid.sizes.size())
+		, _has_normals(has_normals)
+		, _buffers(grid.num_tiles_total)
+		, _has_file(grid.num_tiles_total, false)
+		, _pid(getpid())
+	{
+	}
+
+	~SpillFiles()
+	{
+		for (size_t tile = 0; tile < _has_file.size(); ++tile) {
+			if (_has_file[tile]) {
+				std::remove(path(tile).c_str());
+			}
+		}
+	}
+
+	size_t floats_per_point() const { return (_has_normals ? 2 : 1) * _num_dim + 1; }
+
+	void add(size_t tile, const float pos[], const float* normal, float weight)
+	{
+		auto& buffer = _buffers[tile];
+		buffer.insert(buffer.end(), pos, pos + _num_dim);
+		if (_has_normals) {
+			buffer.insert(buffer.end(), normal, normal + _num_dim);
+		}
+		buffer.push_back(weight);
+		_num_buffered_floats += floats_per_point();
+		if (_num_buffered_floats >= _max_buffered_floats) {
+			flush();
+		}
+	}
+
+	/// Write all buffered points to disk.
+	bool flush()
+	{
+		bool success = true;
+		for (size_t tile = 0; tile < _buffers.size(); ++tile) {
+			auto& buffer = _buffers[tile];
+			if (buffer.empty()) { continue; }
+			FILE* file = std::fopen(path(tile).c_str(), "ab");
+			if (!file) {
+				LOG_F(ERROR, "Failed to open '%s'", path(tile).c_str());
+				success = false;
+				continue;
+			}
+			_has_file[tile] = true;
+			success &= std::fwrite(buffer.data(), sizeof(float), buffer.size(), file) == buffer.size();
+			std::fclose(file);
+			buffer.clear();
+			buffer.shrink_to_fit();
+		}
+		_num_buffered_floats = 0;
+		return success;
+	}
+
+	/// Append the points of the given tile. Call flush first.
+	void read(size_t tile, PointSet* points) const
+	{
+		CHECK_F(_buffers[tile].empty(), "Not flushed");
+		if (!_has_file[tile]) { return; }
+		FILE* file = std::fopen(path(tile).c_str(), "rb");
+		CHECK_NOTNULL_F(file, "Failed to open '%s'", path(tile).c_str());
+		std::vector<float> record(floats_per_point());
+		while (std::fread(record.data(), sizeof(float), record.size(), file) == record.size()) {
+			points->positions.insert(points->positions.end(), record.begin(), record.begin() + _num_dim);
+			if (_has_normals) {
+				points->normals.insert(points->normals.end(), record.begin() + _num_dim, record.begin() + 2 * _num_dim);
+			}
+			points->weights.push_back(record.back());
+		}
+		std::fclose(file);
+	}
+
+private:
+	std::string path(size_t tile) const
+	{
+		return _directory + "/field_spill_" + std::to_string(_pid) + "_" + std::to_string(tile) + ".bin";
+	}
+
+	std::string                     _directory;
+	size_t                          _max_buffered_floats;
+	size_t                          _num_dim;
+	bool                            _has_normals;
+	std::vector<std::vector<float>> _buffers;
+	std::vector<bool>               _has_file;
+	size_t                          _num_buffered_floats = 0;
+	pid_t                           _pid; ///< Of the process which created the files, so that worker processes find them too.
+};
+
+/// Read the points of all tiles overlapping the box [box_min, box_max), keeping only those whose cell is in it.
+PointSet read_points_in_box(const SpillFiles& spill, const TileGrid& grid, const int box_min[], const int box_max[])
+{
+	const int num_dim = grid.sizes.size();
+	int tile_min[MAX_DIM], tile_max[MAX_DIM];
+	size_t num_tiles = 1;
+	for (int d = 0; d < num_dim; ++d) {
+		tile_min[d] = std::max(0, std::min(grid.num_tiles[d] - 1, box_min[d] / grid.tile_size));
+		tile_max[d] = std::max(0, std::min(grid.num_tiles[d] - 1, (box_max[d] - 1) / grid.tile_size)) + 1;
+		num_tiles *= tile_max[d] - tile_min[d];
+	}
+
+	PointSet all_points;
+	int coordinate[MAX_DIM];
+	std::copy(tile_min, tile_min + num_dim, coordinate);
+	for (size_t i = 0; i < num_tiles; ++i) {
+		spill.read(grid.tile_index(coordinate), &all_points);
+		for (int d = 0; d < num_dim; ++d) {
+			if (++coordinate[d] < tile_max[d]) { break; }
+			coordinate[d] = tile_min[d];
+		}
+	}
+
+	PointSet points;
+	for (size_t i = 0; i < all_points.size(); ++i) {
+		const float* pos = &all_points.positions[i * num_dim];
+		bool inside = true;
+		for (int d = 0; d < num_dim; ++d) {
+			const int cell = static_cast<int>(std::floor(pos[d]));
+			inside &= box_min[d] <= cell && cell < box_max[d];
+		}
+		if (!inside) { continue; }
+		points.positions.insert(points.positions.end(), pos, pos + num_dim);
+		if (!all_points.normals.empty()) {
+			const float* normal = &all_points.normals[i * num_dim];
+			points.normals.insert(points.normals.end(), normal, normal + num_dim);
+		}
+		points.weights.push_back(all_points.weights[i]);
+	}
+	return points;
+}
+
+/// The model equations of the lattice points in the box, and the data equations of the given points.
+/// Column indices are those of the full lattice.
+LatticeField assemble_box(
+	const std::vector<int>& sizes,
+	const Weights&          weights,
+	const int               box_min[],
+	const int               box_max[],
+	const PointSet&         points)
+{
+	LatticeField field{sizes};
+	add_field_constraints_in_box(&field, weights, box_min, box_max);
+	if (points.size() > 0) {
+		add_data_constraints(&field, weights, points.size(), points.positions.data(),
+			points.normals.empty() ? nullptr : points.normals.data(), points.weights.data());
+	}
+	return field;
+}
+
+/// A coarse lattice, with every `factor`:th lattice point of the full lattice.
+/// Values are upscaled to the full lattice using linear interpolation, which unlike the
+/// piecewise constant upscaling of downscale_solver can represent the smooth,
+/// weakly constrained, far-field well.
+struct Downscale
+{
+	std::vector<int> sizes_full;
+	std::vector<int> sizes_small;
+	int              factor;
+	Index            num_unknowns_small = 1;
+
+	Downscale(const std::vector<int>& sizes, int factor_arg) : sizes_full(sizes), factor(factor_arg)
+	{
+		for (const int size_full : sizes_full) {
+			sizes_small.push_back((size_full - 1 + factor - 1) / factor + 1);
+			num_unknowns_small *= sizes_small.back();
+		}
+	}
+
+	/// The coarse lattice points (and their weights) interpolated for the given full lattice point.
+	/// Returns the number of coarse lattice points, at most 2^D.
+	int interpolation(Index full_index, Index out_indices[], float out_weights[]) const
+	{
+		const int num_dim = sizes_full.size();
+		int floored[MAX_DIM];
+		float t[MAX_DIM];
+		for (int d = 0; d < num_dim; ++d) {
+			const int x = full_index % sizes_full[d];
+			floored[d] = x / factor;
+			t[d] = static_cast<float>(x % factor) / factor;
+			full_index /= sizes_full[d];
+		}
+
+		int num_samples = 0;
+		for (int corner = 0; corner < (1 << num_dim); ++corner) {
+			Index index = 0;
+			Index stride = 1;
+			float weight = 1;
+			for (int d = 0; d < num_dim; ++d) {
+				const int set = (corner >> d) & 1;
+				index += stride * (floored[d] + set);
+				weight *= set ? t[d] : 1 - t[d];
+				stride *= sizes_small[d];
+			}
+			if (weight != 0) {
+				out_indices[num_samples] = index;
+				out_weights[num_samples] = weight;
+				num_samples += 1;
+			}
+		}
+		return num_samples;
+	}
+};
+
+using Triplet = Eigen::Triplet<float, Index>;
+
+/// Sort `pending` and add it to `merged`, which is kept sorted (by column, then row) and free of duplicates.
+/// Clears `pending`.
+void merge_triplets(std::vector<Triplet>* merged, std::vector<Triplet>* pending)
+{
+	const auto less = [](const Triplet& a, const Triplet& b) {
+		return a.col() != b.col() ? a.col() < b.col() : a.row() < b.row();
+	};
+	const auto same = [](const Triplet& a, const Triplet& b) {
+		return a.col() == b.col() && a.row() == b.row();
+	};
+
+	std::sort(pending->begin(), pending->end(), less);
+	std::vector<Triplet> result;
+	result.reserve(merged->size() + pending->size());
+	auto a = merged->begin();
+	auto b = pending->begin();
+	while (a != merged->end() || b != pending->end()) {
+		const bool take_a = b == pending->end() || (a != merged->end() && !less(*b, *a));
+		const Triplet& next = take_a ? *a++ : *b++;
+		if (!result.empty() && same(result.back(), next)) {
+			result.back() = Triplet(next.row(), next.col(), result.back().value() + next.value());
+		} else {
+			result.push_back(next);
+		}
+	}
+	merged->swap(result);
+	pending->clear();
+}
+
+/// A vector over the coarse lattice points of a range of slabs along the last axis (the slowest).
+/// Grows to cover whatever is added to it.
+struct SlabVector
+{
+	Index              slab_size;      ///< Lattice points per slab.
+	Index              first_slab = 0;
+	Index              end_slab   = 0;
+	std::vector<float> values;         ///< Starting with the first point of first_slab.
+
+	SlabVector(Index slab_size_arg, Index first_slab_arg, Index end_slab_arg)
+		: slab_size(slab_size_arg), first_slab(first_slab_arg), end_slab(end_slab_arg),
+		  values((end_slab - first_slab) * slab_size, 0.0f)
+	{
+	}
+
+	Index first_index() const { return first_slab * slab_size; }
+
+	void add(Index index, float value)
+	{
+		if (index < first_index() || index >= end_slab * slab_size) {
+			grow(index / slab_size);
+		}
+		values[index - first_index()] += value;
+	}
+
+	void grow(Index slab)
+	{
+		const Index new_first = std::min(first_slab, slab);
+		const Index new_end   = std::max(end_slab, slab + 1);
+		std::vector<float> new_values((new_end - new_first) * slab_size, 0.0f);
+		std::copy(values.begin(), values.end(), new_values.begin() + (first_slab - new_first) * slab_size);
+		values.swap(new_values);
+		first_slab = new_first;
+		end_slab   = new_end;
+	}
+};
+
+/// Stream through all tiles, assembling the equations of each, and calculate
+///     residual_small = Pᵀ·Aᵀ·(b - A·x)
+/// where x is `out` and P is the upscaling from the coarse lattice.
+/// Optionally also the coarse normal matrix AtA_small = Pᵀ·Aᵀ·A·P.
+void assemble_coarse(
+	const TileGrid&   grid,
+	const SpillFiles& spill,
+	const Weights&    weights,
+	const Downscale&  downscale,
+	const float*      out,
+	SparseMatrix*     AtA_small,
+	VectorXr*         residual_small)
+{
+	LOG_SCOPE_F(INFO, "assemble_coarse");
+	const Index num_small = downscale.num_unknowns_small;
+
+	// Each chunk is a slab of tile layers along the last axis. Its equations only reach a few lattice points
+	// past the slab (model_4 and the gradient kernels), so its part of the residual only covers those coarse slabs.
+	const int    last            = grid.sizes.size() - 1;
+	const size_t num_layers      = grid.num_tiles[last];
+	const size_t tiles_per_layer = grid.num_tiles_total / num_layers;
+	const Index  small_slab_size = num_small / downscale.sizes_small[last];
+	const int    max_reach       = 4;
+
+	const size_t num_chunks = std::min(num_worker_threads(), num_layers);
+	std::vector<std::vector<Triplet>> chunk_triplets(AtA_small ? num_chunks : 0);
+	std::vector<SlabVector> chunk_residual;
+	for (size_t chunk_index = 0; chunk_index < num_chunks; ++chunk_index) {
+		const int full_begin = num_layers * chunk_index / num_chunks * grid.tile_size;
+		const int full_end   = std::min<int>(num_layers * (chunk_index + 1) / num_chunks * grid.tile_size, grid.sizes[last]);
+		const int first_slab = std::max(0, full_begin - max_reach) / downscale.factor;
+		const int end_slab   = std::min(downscale.sizes_small[last], (full_end + max_reach) / downscale.factor + 2);
+		chunk_residual.emplace_back(small_slab_size, first_slab, end_slab);
+	}
+
+	parallel_for_chunks(num_layers, num_chunks, [&](size_t chunk_index, size_t layer_begin, size_t layer_end) {
+		SlabVector& residual = chunk_residual[chunk_index];
+		const size_t begin = layer_begin * tiles_per_layer;
+		const size_t end   = layer_end * tiles_per_layer;
+
+		// Each row of A·P touches up to (stencil width / factor + 2)^D coarse lattice points, so the outer
+		// products pile up quickly. They are merged (summing the duplicates) into the coarse matrix of the chunk
+		// whenever they outnumber it, so each triplet is merged O(log) times.
+		const size_t min_pending = 1 << 22;
+		std::vector<Triplet> pending;
+		std::vector<Triplet> merged;
+
+		for (size_t tile = begin; tile < end; ++tile) {
+			int box_min[MAX_DIM], box_max[MAX_DIM];
+			grid.tile_box(tile, box_min, box_max);
+			PointSet points;
+			spill.read(tile, &points);
+			const LatticeField field = assemble_box(grid.sizes, weights, box_min, box_max, points);
+			const LinearEquation& eq = field.eq;
+
+			LinearEquation row_small; // One row of A·P
+			for (size_t row = 0; row < eq.num_rows(); ++row) {
+				row_small.row_starts.resize(1);
+				row_small.cols.clear();
+				row_small.values.clear();
+				row_small.rhs.clear();
+
+				float row_residual = eq.rhs[row];
+				for (Index a = eq.row_starts[row]; a < eq.row_starts[row + 1]; ++a) {
+					row_residual -= eq.values[a] * out[eq.cols[a]];
+					Index indices[1 << MAX_DIM];
+					float interpolation_weights[1 << MAX_DIM];
+					const int num_samples = downscale.interpolation(eq.cols[a], indices, interpolation_weights);
+					for (int i = 0; i < num_samples; ++i) {
+						row_small.add_entry(indices[i], interpolation_weights[i] * eq.values[a]);
+					}
+				}
+				row_small.end_row(0.0f); // Sums the duplicates
+
+				const size_t num_entries = row_small.num_nonzeros();
+				for (size_t i = 0; i < num_entries; ++i) {
+					residual.add(row_small.cols[i], row_small.values[i] * row_residual);
+					if (!AtA_small) { continue; }
+					for (size_t j = 0; j < num_entries; ++j) {
+						pending.emplace_back(row_small.cols[i], row_small.cols[j], row_small.values[i] * row_small.values[j]);
+					}
+				}
+				if (pending.size() > std::max(min_pending, merged.size())) {
+					merge_triplets(&merged, &pending);
+				}
+			}
+		}
+
+		if (AtA_small) {
+			merge_triplets(&merged, &pending);
+			chunk_triplets[chunk_index].swap(merged);
+		}
+	});
+
+	*residual_small = VectorXr::Zero(num_small);
+	for (auto& residual : chunk_residual) {
+		residual_small->segment(residual.first_index(), residual.values.size()) +=
+			Eigen::Map<const VectorXr>(residual.values.data(), residual.values.size());
+		std::vector<float>().swap(residual.values);
+	}
+	if (AtA_small) {
+		// The chunks only overlap along their borders, so this is about the size of the coarse matrix:
+		std::vector<Triplet> triplets;
+		for (auto& chunk : chunk_triplets) {
+			triplets.insert(triplets.end(), chunk.begin(), chunk.end());
+			std::vector<Triplet>().swap(chunk);
+		}
+		*AtA_small = SparseMatrix(num_small, num_small);
+		AtA_small->setFromTriplets(triplets.begin(), triplets.end());
+		AtA_small->makeCompressed();
+	}
+}
+
+/// Rough peak memory of the coarse system for the given downscale factor:
+/// the assembly triplets, the coarse matrix and the AMG hierarchy on top of it.
+size_t coarse_system_bytes(const std::vector<int>& sizes, int factor)
+{
+	// AtA couples lattice points up to 4 apart (model_4), so with the linear interpolation
+	// the coarse matrix couples coarse lattice points up to 4 / factor + 2 apart (exclusive):
+	const int reach = (4 + factor - 1) / factor + 1;
+	size_t nonzeros_per_row = 1;
+	for (size_t d = 0; d < sizes.size(); ++d) {
+		nonzeros_per_row *= 2 * reach + 1;
+	}
+	const size_t bytes_per_nonzero = 3 * sizeof(Triplet) + 2 * (sizeof(float) + sizeof(Index));
+	return Downscale(sizes, factor).num_unknowns_small * nonzeros_per_row * bytes_per_nonzero;
+}
+
+/// The smallest downscale factor, starting at options.downscale_factor, with which the coarse system fits in
+/// options.coarse_memory_bytes.
+int coarse_downscale_factor(const std::vector<int>& sizes, const OutOfCoreOptions& options)
+{
+	const int max_size = *std::max_element(sizes.begin(), sizes.end());
+	int factor = options.downscale_factor;
+	while (coarse_system_bytes(sizes, factor) > options.coarse_memory_bytes && factor < max_size) {
+		factor += 1;
+	}
+	LOG_IF_F(WARNING, factor != options.downscale_factor,
+	         "downscale_factor raised from %d to %d to fit the coarse system in %.1f GB",
+	         options.downscale_factor, factor, options.coarse_memory_bytes / 1e9);
+	LOG_F(INFO, "Coarse system: about %.1f GB", coarse_system_bytes(sizes, factor) / 1e9);
+	return factor;
+}
+
+/// The in-memory coarse level: assembled once, and then solved with AMG preconditioned CG for every coarse correction.
+/// Unlike a Cholesky factorization, its memory use is proportional to that of the coarse matrix, even in 3D.
+class CoarseSolver
+{
+public:
+	CoarseSolver(const TileGrid& grid, const SpillFiles& spill, const Weights& weights, int downscale_factor)
+		: _grid(grid), _spill(spill), _weights(weights), _downscale(grid.sizes, downscale_factor)
+	{
+	}
+
+	/// x += P · (PᵀAᵀAP)⁻¹ · Pᵀ·Aᵀ·(b - A·x), where x is `out`.
+	/// The first call also assembles the coarse system and sets up its preconditioner.
+	bool correct(float* out)
+	{
+		LOG_SCOPE_F(INFO, "Coarse correction");
+		VectorXr residual_small;
+		if (!_assembled) {
+			assemble_coarse(_grid, _spill, _weights, _downscale, out, &_AtA_small, &residual_small);
+			_preconditioner.compute(_AtA_small);
+			if (_preconditioner.info() != Eigen::Success) {
+				LOG_F(WARNING, "Coarse AMG setup failed");
+				return false;
+			}
+			_assembled = true;
+		} else {
+			assemble_coarse(_grid, _spill, _weights, _downscale, out, nullptr, &residual_small);
+		}
+
+		// Every CG step reduces the error (in the AtA norm), so an unconverged correction still helps:
+		const float error_tolerance = 1e-4f;
+		VectorXr correction_small = VectorXr::Zero(residual_small.size());
+		Eigen::Index iterations = std::max<Eigen::Index>(2 * _AtA_small.cols(), 1);
+		float error = error_tolerance;
+		checkpointed_conjugate_gradient(
+			_AtA_small.selfadjointView<Eigen::Lower>(), residual_small, &correction_small, _preconditioner,
+			&iterations, &error, nullptr);
+		LOG_F(INFO, "Coarse CG: %ld iterations, error: %f", static_cast<long>(iterations), error);
+		LOG_IF_F(WARNING, error > error_tolerance, "Coarse CG did not converge");
+		if (!correction_small.allFinite()) { return false; }
+
+		size_t num_unknowns = 1;
+		for (const int size : _grid.sizes) {
+			num_unknowns *= size;
+		}
+		parallel_for_chunks(num_unknowns, std::min(num_worker_threads(), num_unknowns), [&](size_t, size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				Index indices[1 << MAX_DIM];
+				float interpolation_weights[1 << MAX_DIM];
+				const int num_samples = _downscale.interpolation(i, indices, interpolation_weights);
+				for (int k = 0; k < num_samples; ++k) {
+					out[i] += interpolation_weights[k] * correction_small[indices[k]];
+				}
+			}
+		});
+		return true;
+	}
+
+private:
+	const TileGrid&   _grid;
+	const SpillFiles& _spill;
+	const Weights&    _weights;
+	const Downscale   _downscale;
+	SparseMatrix      _AtA_small;
+	AmgPreconditioner _preconditioner;
+	bool              _assembled = false;
+};
+
+/// Solve the unknowns in tile + halo, with everything else fixed at the values in `out`.
+/// Writes the result for the tile (but not its halo) to `out`.
+bool solve_tile(
+	const TileGrid&         grid,
+	const SpillFiles&       spill,
+	const Weights&          weights,
+	const OutOfCoreOptions& options,
+	size_t                  tile,
+	float*                  out)
+{
+	const int num_dim = grid.sizes.size();
+	int tile_min[MAX_DIM], tile_max[MAX_DIM];
+	grid.tile_box(tile, tile_min, tile_max);
+
+	// The free unknowns:
+	int free_min[MAX_DIM], free_max[MAX_DIM], free_size[MAX_DIM];
+	// Equations involving the free unknowns start at most 4 lattice points before them (model_4):
+	int rows_min[MAX_DIM];
+	// Data points touch lattice points from two before their cell to one after it (the linear interpolation gradient kernel):
+	int points_min[MAX_DIM], points_max[MAX_DIM];
+	Index num_free = 1;
+	for (int d = 0; d < num_dim; ++d) {
+		free_min[d]   = std::max(0, tile_min[d] - options.halo);
+		free_max[d]   = std::min(grid.sizes[d], tile_max[d] + options.halo);
+		free_size[d]  = free_max[d] - free_min[d];
+		rows_min[d]   = std::max(0, free_min[d] - 4);
+		points_min[d] = free_min[d] - 2;
+		points_max[d] = free_max[d] + 1;
+		num_free *= free_size[d];
+	}
+
+	const PointSet points = read_points_in_box(spill, grid, points_min, points_max);
+	const LatticeField field = assemble_box(grid.sizes, weights, rows_min, free_max, points);
+
+	const auto as_free_index = [&](Index full_index) -> Index {
+		Index free_index = 0;
+		Index stride = 1;
+		for (int d = 0; d < num_dim; ++d) {
+			const int x = full_index % grid.sizes[d] - free_min[d];
+			if (x < 0 || x >= free_size[d]) { return -1; }
+			free_index += x * stride;
+			full_index /= grid.sizes[d];
+			stride *= free_size[d];
+		}
+		return free_index;
+	};
+
+	// Move the fixed unknowns to the right hand side:
+	const LinearEquation& eq = field.eq;
+	LinearEquation free_eq;
+	free_eq.reserve_additional({eq.num_rows(), eq.num_nonzeros()});
+	for (size_t row = 0; row < eq.num_rows(); ++row) {
+		float rhs = eq.rhs[row];
+		bool any_free = false;
+		for (Index entry = eq.row_starts[row]; entry < eq.row_starts[row + 1]; ++entry) {
+			const Index free_index = as_free_index(eq.cols[entry]);
+			if (free_index >= 0) {
+				free_eq.add_entry(free_index, eq.values[entry]);
+				any_free = true;
+			} else {
+				rhs -= eq.values[entry] * out[eq.cols[entry]];
+			}
+		}
+		if (any_free) {
+			free_eq.end_row(rhs);
+		}
+	}
+
+	NormalEquation normal = make_normal_equation(num_free, free_eq);
+	// Small regularization, like in tile_solver, for unknowns without any equations:
+	for (Index i = 0; i < num_free; ++i) {
+		normal.AtA.coeffRef(i, i) += 1e-6f;
+	}
+
+	Eigen::SimplicialLLT<SparseMatrix> solver(normal.AtA);
+	if (solver.info() != Eigen::Success) { return false; }
+	const VectorXr solution = solver.solve(normal.Atb);
+	if (solver.info() != Eigen::Success) { return false; }
+
+	for (Index free_index = 0; free_index < num_free; ++free_index) {
+		Index remainder = free_index;
+		Index full_index = 0;
+		Index stride = 1;
+		bool in_tile = true;
+		for (int d = 0; d < num_dim; ++d) {
+			const int x = free_min[d] + remainder % free_size[d];
+			in_tile &= tile_min[d] <= x && x < tile_max[d];
+			full_index += x * stride;
+			remainder /= free_size[d];
+			stride *= grid.sizes[d];
+		}
+		if (in_tile) {
+			out[full_index] = solution[free_index];
+		}
+	}
+	return true;
+}
+
+/// The tiles of each color, each list in increasing tile index.
+std::vector<std::vector<size_t>> tiles_by_color(const TileGrid& grid)
+{
+	std::vector<std::vector<size_t>> tiles(1 << grid.sizes.size());
+	for (size_t tile = 0; tile < grid.num_tiles_total; ++tile) {
+		tiles[grid.tile_color(tile)].push_back(tile);
+	}
+	return tiles;
+}
+
+/// Solve the given tiles (of the same color) using at most `num_threads` threads.
+/// Returns the number of tiles which failed.
+size_t solve_tiles(
+	const TileGrid&            grid,
+	const SpillFiles&          spill,
+	const Weights&             weights,
+	const OutOfCoreOptions&    options,
+	const std::vector<size_t>& tiles,
+	size_t                     num_threads,
+	float*                     out)
+{
+	std::atomic<size_t> num_failures{0};
+	parallel_for_chunks(tiles.size(), std::min(num_threads, tiles.size()), [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			if (!solve_tile(grid, spill, weights, options, tiles[i], out)) {
+				num_failures += 1;
+			}
+		}
+	});
+	return num_failures;
+}
+
+// ----------------------------------------------------------------------------
+// Multi-process sweeps
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Process shared atomics must be lock free");
+
+/// Lives in memory shared between the coordinating process and its workers.
+struct SharedControl
+{
+	std::atomic<int> num_arrived;
+	std::atomic<int> generation;
+	std::atomic<int> num_failures;
+	std::atomic<int> aborted;
+};
+
+/// Block until all `num_participants` processes have called this.
+/// The coordinator passes `workers`, and gives up (returning false) if any of them dies.
+bool barrier(SharedControl* control, int num_participants, const std::vector<pid_t>* workers = nullptr)
+{
+	const int generation = control->generation.load();
+	if (control->num_arrived.fetch_add(1) + 1 == num_participants) {
+		control->num_arrived = 0;
+		control->generation += 1;
+		return true;
+	}
+
+	// Barriers are only hit a few times per sweep, so polling is fine:
+	while (control->generation.load() == generation) {
+		if (control->aborted.load()) { return false; }
+		if (workers) {
+			for (const pid_t worker : *workers) {
+				int status;
+				if (waitpid(worker, &status, WNOHANG) == worker) {
+					LOG_F(ERROR, "Worker process %d died", worker);
+					control->aborted = 1;
+					return false;
+				}
+			}
+		}
+		usleep(100);
+	}
+	return true;
+}
+
+/// Which worker process owns the tile: the tiles are split into slabs along the last axis,
+/// so that each process mostly touches its own part of the field (and, through bind_worker, its own NUMA node).
+int tile_owner(const TileGrid& grid, size_t tile, int num_processes)
+{
+	int coordinate[MAX_DIM];
+	grid.tile_coordinate(tile, coordinate);
+	const int last = grid.sizes.size() - 1;
+	return coordinate[last] * num_processes / grid.num_tiles[last];
+}
+
+/// Restrict the calling worker process (and the threads it starts later) to its share of the NUMA nodes,
+/// or if there are fewer nodes than processes, to a contiguous range of `threads_per_process` cores.
+/// Memory first touched by the worker then also ends up on its node(s). Linux only.
+void bind_worker(int process, int num_processes, size_t threads_per_process)
+{
+#ifdef __linux__
+	const auto nodes = numa_node_cpus();
+	std::vector<int> cpus;
+	if (nodes.size() >= static_cast<size_t>(num_processes)) {
+		for (size_t node = 0; node < nodes.size(); ++node) {
+			if (static_cast<int>(node * num_processes / nodes.size()) == process) {
+				cpus.insert(cpus.end(), nodes[node].begin(), nodes[node].end());
+			}
+		}
+	}
+	if (cpus.empty()) {
+		for (size_t i = 0; i < threads_per_process; ++i) {
+			cpus.push_back((process * threads_per_process + i) % num_worker_threads());
+		}
+	}
+
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	for (const int cpu : cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &cpu_set);
+		}
+	}
+	if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+		LOG_F(WARNING, "Failed to bind worker process %d to its cores", process);
+	}
+#else
+	(void)process;
+	(void)num_processes;
+	(void)threads_per_process;
+#endif
+}
+
+/// Number of threads in this process, or 0 if unknown (Linux only).
+int num_process_threads()
+{
+	int num_threads = 0;
+#ifdef __linux__
+	if (FILE* file = std::fopen("/proc/self/status", "r")) {
+		char line[256];
+		while (std::fgets(line, sizeof(line), file)) {
+			if (std::sscanf(line, "Threads: %d", &num_threads) == 1) { break; }
+		}
+		std::fclose(file);
+	}
+#endif
+	return num_threads;
+}
+
+/// Run the tile sweeps in `options.num_processes` forked worker processes.
+/// The field in `out` must be in shared memory (MAP_SHARED), through which the workers see each others halo values.
+/// This process coordinates: between sweeps it does the coarse corrections while the workers wait.
+/// The workers allocate and start threads after the fork, which is only safe if this process is single-threaded:
+/// a lock held by any other thread at the time of the fork (malloc, logging, ...) would stay locked forever in the child.
+bool run_sweeps_in_processes(
+	const TileGrid&         grid,
+	const SpillFiles&       spill,
+	const Weights&          weights,
+	const OutOfCoreOptions& options,
+	CoarseSolver*           coarse,
+	float*                  out)
+{
+	CHECK_F(!is_pool_thread(), "num_processes > 1 can not be used from a ThreadPool job: the process must be single-threaded");
+	stop_worker_threads();
+	const int num_threads = num_process_threads();
+	CHECK_F(num_threads <= 1, "num_processes > 1 requires a single-threaded process, but it has %d threads", num_threads);
+
+	const int num_processes = options.num_processes;
+	const int num_participants = num_processes + 1;
+	const auto tiles = tiles_by_color(grid);
+	const size_t threads_per_process = std::max<size_t>(1, num_worker_threads() / num_processes);
+
+	void* mapped = mmap(nullptr, sizeof(SharedControl), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED) {
+		LOG_F(ERROR, "Failed to map shared memory");
+		return false;
+	}
+	SharedControl* control = new (mapped) SharedControl{};
+
+	// Fork while this is the only thread touching our state (stop_worker_threads joined the others).
+	std::vector<pid_t> workers;
+	for (int process = 0; process < num_processes; ++process) {
+		const pid_t pid = fork();
+		if (pid < 0) {
+			LOG_F(ERROR, "fork failed");
+			control->aborted = 1;
+			break;
+		}
+		if (pid == 0) {
+#ifdef __linux__
+			prctl(PR_SET_PDEATHSIG, SIGKILL); // Don't outlive the coordinator.
+#endif
+			bind_worker(process, num_processes, threads_per_process);
+			std::vector<std::vector<size_t>> my_tiles(tiles.size());
+			for (size_t color = 0; color < tiles.size(); ++color) {
+				for (const size_t tile : tiles[color]) {
+					if (tile_owner(grid, tile, num_processes) == process) {
+						my_tiles[color].push_back(tile);
+					}
+				}
+			}
+
+			for (int sweep = 0; sweep < options.num_sweeps; ++sweep) {
+				if (!barrier(control, num_participants)) { _exit(1); } // Wait for the coarse correction.
+				for (const auto& color_tiles : my_tiles) {
+					control->num_failures += solve_tiles(grid, spill, weights, options, color_tiles, threads_per_process, out);
+					if (!barrier(control, num_participants)) { _exit(1); } // Wait for the neighbors.
+				}
+			}
+			_exit(0); // Skip destructors: the spill files etc belong to the coordinator.
+		}
+		workers.push_back(pid);
+	}
+
+	bool success = !control->aborted;
+	for (int sweep = 0; success && sweep < options.num_sweeps; ++sweep) {
+		LOG_SCOPE_F(INFO, "Tile sweep %d (%d processes)", sweep, num_processes);
+		if (sweep > 0 && !coarse->correct(out)) {
+			success = false;
+			break;
+		}
+		for (size_t i = 0; success && i < 1 + tiles.size(); ++i) {
+			success = barrier(control, num_participants, &workers);
+		}
+	}
+
+	if (!success) {
+		control->aborted = 1;
+		for (const pid_t worker : workers) {
+			kill(worker, SIGKILL);
+		}
+	}
+	for (const pid_t worker : workers) {
+		int status = 0;
+		waitpid(worker, &status, 0);
+		success = success && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+
+	LOG_IF_F(WARNING, control->num_failures > 0, "%d tiles failed", control->num_failures.load());
+	control->~SharedControl();
+	munmap(mapped, sizeof(SharedControl));
+	return success;
+}
+
+} // namespace
+
+bool sdf_from_points_out_of_core(
+	const std::vector<int>& sizes,
+	const Weights&          weights,
+	const int               num_points,
+	const float             positions[],
+	const float*            normals,
+	const float*            point_weights,
+	const std::string&      output_path,
+	const OutOfCoreOptions& options)
+{
+	LOG_SCOPE_F(INFO, "sdf_from_points_out_of_core");
+	CHECK_NOTNULL_F(positions);
+	CHECK_F(1 <= sizes.size() && sizes.size() <= MAX_DIM);
+	CHECK_GE_F(options.downscale_factor, 2);
+	CHECK_GE_F(options.halo, 0);
+	// Tiles of the same color must not see each others values being written:
+	CHECK_GE_F(options.tile_size, options.halo + 4, "tile_size must be at least halo + 4");
+
+	const Index num_unknowns = LatticeField{sizes}.num_unknowns();
+	const int num_dim = sizes.size();
+	const TileGrid grid(sizes, options.tile_size);
+	LOG_F(INFO, "%lu tiles", grid.num_tiles_total);
+
+	SpillFiles spill(options, grid, normals != nullptr);
+	{
+		LOG_SCOPE_F(INFO, "Spilling points");
+		for (int i = 0; i < num_points; ++i) {
+			const float* pos = positions + i * num_dim;
+			spill.add(grid.tile_of_point(pos), pos, normals ? normals + i * num_dim : nullptr,
+			          point_weights ? point_weights[i] : 1.0f);
+		}
+		if (!spill.flush()) { return false; }
+	}
+
+	MappedFloats out(output_path, num_unknowns, true); // Starts out as all zeros.
+	if (!out.is_open()) { return false; }
+
+	// A two-level method: coarse corrections for the low frequencies, tile solves for the high.
+	CoarseSolver coarse(grid, spill, weights, coarse_downscale_factor(sizes, options));
+	if (!coarse.correct(out.data())) { return false; }
+
+	if (options.num_processes > 1) {
+		return run_sweeps_in_processes(grid, spill, weights, options, &coarse, out.data());
+	}
+
+	const auto tiles = tiles_by_color(grid);
+	for (int sweep = 0; sweep < options.num_sweeps; ++sweep) {
+		if (sweep > 0 && !coarse.correct(out.data())) { return false; }
+
+		LOG_SCOPE_F(INFO, "Tile sweep %d", sweep);
+		size_t num_failures = 0;
+		for (const auto& color_tiles : tiles) {
+			num_failures += solve_tiles(grid, spill, weights, options, color_tiles, color_tiles.size(), out.data());
+		}
+		LOG_IF_F(WARNING, num_failures > 0, "%lu/%lu tiles failed", num_failures, grid.num_tiles_total);
+	}
+
+	return true;
+}
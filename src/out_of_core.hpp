@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "field_interpolation.hpp"
+
+struct OutOfCoreOptions
+{
+	std::string spill_directory     = ".";              ///< Temporary files with the points of each tile go here.
+	int         tile_size           = 32;               ///< Lattice points along each side of a tile. At least halo + 4.
+	int         halo                = 4;                ///< Tiles are solved with this many extra lattice points on each side, which are then discarded.
+	int         downscale_factor    = 4;                ///< Of the in-memory coarse solve which gives the initial guess. Raised if need be to fit in coarse_memory_bytes.
+	size_t      coarse_memory_bytes = size_t(8) << 30;  ///< Memory budget of the coarse system: its matrix, assembly and AMG hierarchy.
+	int         num_sweeps          = 4;                ///< Number of passes over all tiles.
+	size_t      spill_buffer_bytes  = 64 << 20;         ///< Points are kept in memory up to this size before being written to the spill files.
+	int         num_processes       = 1;                ///< If more than one, the tile sweeps are split across this many worker processes (POSIX only).
+};
+
+/// A file of floats mapped into memory (POSIX).
+class MappedFloats
+{
+public:
+	/// If `create` the file is created (or truncated) to hold `size` floats, else it must already be that large.
+	MappedFloats(const std::string& path, size_t size, bool create);
+	~MappedFloats();
+
+	MappedFloats(const MappedFloats&) = delete;
+	MappedFloats& operator=(const MappedFloats&) = delete;
+
+	/// False if the file could not be opened or mapped.
+	bool is_open() const { return _data != nullptr; }
+
+	float*       data()       { return _data; }
+	const float* data() const { return _data; }
+	size_t       size() const { return _size; }
+
+private:
+	float* _data = nullptr;
+	size_t _size = 0;
+};
+
+/// Like sdf_from_points followed by an approximate lattice solve, but for lattices
+/// where the full system does not fit in memory. Only the points and a coarse system are kept in memory:
+///   1. The points are bucketed by tile into spill files.
+///   2. A downscaled version of the system is assembled one tile at a time and solved in memory,
+///      with AMG preconditioned CG. The downscale factor is raised until it fits in `coarse_memory_bytes`.
+///      Upscaled with linear interpolation, this is the initial guess.
+///   3. Each tile is assembled and solved together with a halo of surrounding lattice points,
+///      with the values outside of it held fixed. Tiles not touching each other are solved in parallel.
+///      This is repeated `num_sweeps` times, with a coarse correction before each sweep after the first.
+/// The field is written as raw floats to `output_path`, which is memory mapped while solving.
+///
+/// With `num_processes > 1` the sweeps are instead run by forked worker processes, e.g. one per NUMA node,
+/// each owning a slab of tiles along the last axis. On Linux each worker binds itself to its share of the
+/// NUMA nodes (or, with fewer nodes than processes, to a range of cores). They share the memory mapped field,
+/// through which they see each others halo values. This process coordinates: it runs the coarse corrections
+/// between sweeps, and the processes synchronize between tile colors. Since the workers start threads after the fork,
+/// the calling process must then be single-threaded: not called from a ThreadPool job, nor with any other threads alive.
+/// Lattices with more than 2^31 points require FIELD_INTERPOLATION_64BIT_INDEX.
+/// Returns false on failure.
+bool sdf_from_points_out_of_core(
+	const std::vector<int>& sizes,
+	const Weights&          weights,
+	const int               num_points,
+	const float             positions[],    // Interleaved coordinates, e.g. xyxyxy...
+	const float*            normals,        // Optional (may be null).
+	const float*            point_weights,  // Optional (may be null).
+	const std::string&      output_path,
+	const OutOfCoreOptions& options);
@@ -0,0 +1,373 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+size_t num_worker_threads()
+{
+	return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+namespace {
+
+/// Set on ThreadPool threads and on the threads of WorkerThreads. These already keep all cores busy,
+/// so parallel_for_chunks runs serially there instead of oversubscribing.
+thread_local bool s_is_pool_thread = false;
+
+std::atomic<bool>            s_pin_threads{false};
+std::atomic<MemoryPlacement> s_memory_placement{MemoryPlacement::kFirstTouch};
+
+thread_local bool s_is_pinned = false;
+#ifdef __linux__
+thread_local cpu_set_t s_unpinned_cpu_set; ///< The affinity of the calling thread before it was pinned.
+#endif
+
+/// Pin the calling thread to `core`, so that it never runs (and first-touches memory) anywhere else,
+/// or restore the affinity it had before.
+void set_this_thread_pinned(bool pin, size_t core)
+{
+	if (pin == s_is_pinned) { return; }
+#ifdef __linux__
+	if (pin) {
+		pthread_getaffinity_np(pthread_self(), sizeof(s_unpinned_cpu_set), &s_unpinned_cpu_set);
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		CPU_SET(core % std::thread::hardware_concurrency(), &cpu_set);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+	} else {
+		pthread_setaffinity_np(pthread_self(), sizeof(s_unpinned_cpu_set), &s_unpinned_cpu_set);
+	}
+#else
+	(void)core;
+#endif
+	s_is_pinned = pin;
+}
+
+/// The threads of parallel_for_chunks and parallel_for_static, kept between calls:
+/// iterative solvers call these for every small vector operation, and starting
+/// and joining a thread per core each time would cost more than the work itself.
+/// Thread i always runs chunk i of parallel_for_static.
+class WorkerThreads
+{
+public:
+	using Job = std::function<void(size_t worker)>;
+
+	~WorkerThreads() { stop(); }
+
+	/// Claim the threads for one call. False if they are already in use, by another thread or further up the stack.
+	bool try_acquire()
+	{
+		bool expected = false;
+		return _busy.compare_exchange_strong(expected, true);
+	}
+
+	void release() { _busy = false; }
+
+	/// Run job(worker) on threads [0, num_workers), starting them as needed, and return without waiting.
+	void start(size_t num_workers, const Job* job)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		while (_threads.size() < num_workers) {
+			_threads.emplace_back(&WorkerThreads::run, this, _threads.size(), _generation);
+		}
+		_job         = job;
+		_num_workers = num_workers;
+		_num_done    = 0;
+		_generation += 1;
+		_job_started.notify_all();
+	}
+
+	/// Block until the job of the last start() is done.
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_job_done.wait(lock, [this]() { return _num_done == _num_workers; });
+	}
+
+	/// Join all threads. They are started again by the next start().
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_job_started.notify_all();
+		for (auto& thread : _threads) {
+			thread.join();
+		}
+		_threads.clear();
+		_quit = false;
+	}
+
+private:
+	void run(size_t worker, uint64_t generation)
+	{
+		s_is_pool_thread = true;
+		for (;;) {
+			const Job* job;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_job_started.wait(lock, [&]() { return _quit || _generation != generation; });
+				if (_quit) { return; }
+				generation = _generation;
+				if (worker >= _num_workers) { continue; }
+				job = _job;
+			}
+
+			(*job)(worker);
+
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_num_done += 1;
+			}
+			_job_done.notify_all();
+		}
+	}
+
+	std::atomic<bool>        _busy{false};
+	std::mutex               _mutex;
+	std::condition_variable  _job_started;
+	std::condition_variable  _job_done;
+	const Job*               _job         = nullptr;
+	size_t                   _num_workers = 0; ///< Threads working on _job.
+	size_t                   _num_done    = 0;
+	uint64_t                 _generation  = 0; ///< Incremented for each job.
+	bool                     _quit        = false;
+	std::vector<std::thread> _threads;
+};
+
+WorkerThreads& worker_threads()
+{
+	static WorkerThreads s_worker_threads;
+	return s_worker_threads;
+}
+
+} // namespace
+
+bool is_pool_thread()
+{
+	return s_is_pool_thread;
+}
+
+void parallel_for_chunks(
+	size_t num_items,
+	size_t num_chunks,
+	const std::function<void(size_t chunk_index, size_t begin, size_t end)>& job)
+{
+	if (num_chunks == 0) { return; }
+
+	std::atomic<size_t> next_chunk{0};
+
+	const auto work = [&]() {
+		for (;;) {
+			const size_t chunk_index = next_chunk++;
+			if (chunk_index >= num_chunks) { return; }
+			const size_t begin = num_items * chunk_index / num_chunks;
+			const size_t end   = num_items * (chunk_index + 1) / num_chunks;
+			job(chunk_index, begin, end);
+		}
+	};
+
+	const size_t num_threads = s_is_pool_thread ? 1 : std::min(num_chunks, num_worker_threads());
+	WorkerThreads& threads = worker_threads();
+	if (num_threads == 1 || !threads.try_acquire()) {
+		work();
+		return;
+	}
+
+	const WorkerThreads::Job helper = [&](size_t) { work(); };
+	threads.start(num_threads - 1, &helper);
+	work(); // The calling thread helps out.
+	threads.wait();
+	threads.release();
+}
+
+void parallel_for_static(
+	size_t num_items,
+	const std::function<void(size_t chunk_index, size_t begin, size_t end)>& job)
+{
+	const size_t num_chunks = num_worker_threads();
+	const auto run_chunk = [&](size_t chunk_index) {
+		const size_t begin = num_items * chunk_index / num_chunks;
+		const size_t end   = num_items * (chunk_index + 1) / num_chunks;
+		job(chunk_index, begin, end);
+	};
+
+	WorkerThreads& threads = worker_threads();
+	if (s_is_pool_thread || num_chunks == 1 || !threads.try_acquire()) {
+		for (size_t chunk_index = 0; chunk_index < num_chunks; ++chunk_index) {
+			run_chunk(chunk_index);
+		}
+		return;
+	}
+
+	// The calling thread only waits, so that it never needs to be pinned itself.
+	// Each thread (un)pins itself before touching any memory:
+	const bool pin = s_pin_threads;
+	const WorkerThreads::Job chunk_job = [&](size_t chunk_index) {
+		set_this_thread_pinned(pin, chunk_index);
+		run_chunk(chunk_index);
+	};
+	threads.start(num_chunks, &chunk_job);
+	threads.wait();
+	threads.release();
+}
+
+void stop_worker_threads()
+{
+	WorkerThreads& threads = worker_threads();
+	while (!threads.try_acquire()) {
+		std::this_thread::yield();
+	}
+	threads.stop();
+	threads.release();
+}
+
+void set_pin_threads(bool pin)
+{
+	s_pin_threads = pin;
+}
+
+bool pin_threads()
+{
+	return s_pin_threads;
+}
+
+std::vector<std::vector<int>> numa_node_cpus()
+{
+	std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+	for (int node = 0;; ++node) {
+		char path[128];
+		std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE* file = std::fopen(path, "r");
+		if (!file) { break; }
+
+		// E.g. "0-15,32-47"
+		std::vector<int> cpus;
+		int first, last;
+		while (std::fscanf(file, "%d", &first) == 1) {
+			last = first;
+			if (std::fscanf(file, "-%d", &last) != 1) { last = first; }
+			for (int cpu = first; cpu <= last; ++cpu) {
+				cpus.push_back(cpu);
+			}
+			if (std::fgetc(file) != ',') { break; }
+		}
+		std::fclose(file);
+		nodes.push_back(cpus);
+	}
+#endif
+	return nodes;
+}
+
+void set_memory_placement(MemoryPlacement placement)
+{
+	s_memory_placement = placement;
+}
+
+MemoryPlacement memory_placement()
+{
+	return s_memory_placement;
+}
+
+const char* memory_placement_name(MemoryPlacement placement)
+{
+	switch (placement) {
+		case MemoryPlacement::kNaive:       return "naive";
+		case MemoryPlacement::kFirstTouch:  return "first-touch";
+		case MemoryPlacement::kInterleaved: return "interleaved";
+	}
+	return "unknown";
+}
+
+void place_pages(float* data, size_t size)
+{
+	const MemoryPlacement placement = s_memory_placement;
+	if (placement == MemoryPlacement::kNaive) {
+		std::memset(data, 0, size * sizeof(float));
+	} else if (placement == MemoryPlacement::kInterleaved) {
+		const size_t floats_per_page = 4096 / sizeof(float);
+		const size_t num_pages = (size + floats_per_page - 1) / floats_per_page;
+		const size_t num_threads = num_worker_threads();
+		parallel_for_static(num_threads, [&](size_t, size_t thread_begin, size_t thread_end) {
+			for (size_t thread = thread_begin; thread < thread_end; ++thread) {
+				for (size_t page = thread; page < num_pages; page += num_threads) {
+					const size_t begin = page * floats_per_page;
+					const size_t end = std::min(size, begin + floats_per_page);
+					std::memset(data + begin, 0, (end - begin) * sizeof(float));
+				}
+			}
+		});
+	}
+}
+
+ThreadPool::ThreadPool(size_t num_threads)
+{
+	if (num_threads == 0) { num_threads = num_worker_threads(); }
+	for (size_t i = 0; i < num_threads; ++i) {
+		_threads.emplace_back(&ThreadPool::run, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	wait();
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+	}
+	_job_added.notify_all();
+	for (auto& thread : _threads) {
+		thread.join();
+	}
+}
+
+void ThreadPool::add(Job job)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_jobs.push_back(std::move(job));
+	}
+	_job_added.notify_one();
+}
+
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_job_done.wait(lock, [this]() { return _jobs.empty() && _num_running == 0; });
+}
+
+void ThreadPool::run()
+{
+	s_is_pool_thread = true;
+	for (;;) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_job_added.wait(lock, [this]() { return _quit || !_jobs.empty(); });
+			if (_jobs.empty()) { return; } // _quit
+			job = std::move(_jobs.front());
+			_jobs.pop_front();
+			_num_running += 1;
+		}
+
+		job();
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_num_running -= 1;
+		}
+		_job_done.notify_all();
+	}
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Number of threads to use for parallel work. At least one.
+size_t num_worker_threads();
+
+/// Split [0, num_items) into `num_chunks` contiguous ranges of (almost) equal size
+/// and call job(chunk_index, begin, end) once for each, in parallel.
+/// Returns once all chunks are done.
+/// The split only depends on `num_items` and `num_chunks`, not on the number of threads.
+/// The threads are started on first use and then kept waiting for the next call, so calling this
+/// for every iteration of a solver is cheap.
+/// When called from a ThreadPool job or from within another parallel_for_chunks/parallel_for_static
+/// (or while another thread is using the threads) all chunks are run on the calling thread.
+void parallel_for_chunks(
+	size_t num_items,
+	size_t num_chunks,
+	const std::function<void(size_t chunk_index, size_t begin, size_t end)>& job);
+
+/// Is the calling thread one of the threads of a ThreadPool, or of parallel_for_chunks?
+bool is_pool_thread();
+
+/// Split [0, num_items) into num_worker_threads() contiguous ranges, and run job(chunk_index, begin, end)
+/// for each on its own thread. Unlike parallel_for_chunks the assignment is static: chunk i is always
+/// run by thread i, which is pinned to core i if pin_threads(). So two passes over the same number of items
+/// touch the same memory from the same core, which keeps NUMA first-touch placement useful.
+/// Shares its threads with parallel_for_chunks, and runs serially in the same cases.
+void parallel_for_static(
+	size_t num_items,
+	const std::function<void(size_t chunk_index, size_t begin, size_t end)>& job);
+
+/// Join the threads kept by parallel_for_chunks and parallel_for_static, e.g. so that
+/// the process is single-threaded before a fork. They are started again when next needed.
+void stop_worker_threads();
+
+/// Pin the threads of parallel_for_static to a core each. Linux only.
+void set_pin_threads(bool pin);
+bool pin_threads();
+
+/// The CPUs of each NUMA node (Linux). Empty if unknown, e.g. on other platforms.
+std::vector<std::vector<int>> numa_node_cpus();
+
+/// On NUMA machines each page of memory is placed on the node of the thread which first writes to it.
+/// This decides who writes first to large, lattice-sized, buffers (see place_pages).
+enum class MemoryPlacement
+{
+	kNaive,       ///< The allocating thread, so all pages end up on its node.
+	kFirstTouch,  ///< Whichever parallel_for_static chunk first writes to it: the one which will work on it later.
+	kInterleaved, ///< The pages are dealt out round-robin to the parallel_for_static threads, and so spread over all nodes.
+};
+
+void set_memory_placement(MemoryPlacement placement);
+MemoryPlacement memory_placement();
+const char* memory_placement_name(MemoryPlacement placement);
+
+/// Place the pages of a newly allocated buffer according to memory_placement(), zero-filling them.
+/// With kFirstTouch nothing is done: the caller must then write all of it from parallel_for_static
+/// chunks split the same way as the later work on it.
+void place_pages(float* data, size_t size);
+
+/// A fixed set of threads running jobs in the order they were added.
+class ThreadPool
+{
+public:
+	using Job = std::function<void()>;
+
+	/// 0 means num_worker_threads().
+	explicit ThreadPool(size_t num_threads = 0);
+
+	/// Waits for all jobs to finish.
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void add(Job job);
+
+	/// Block until all added jobs have finished.
+	void wait();
+
+	size_t num_threads() const { return _threads.size(); }
+
+private:
+	void run();
+
+	std::mutex               _mutex;
+	std::condition_variable  _job_added;
+	std::condition_variable  _job_done;
+	std::deque<Job>          _jobs;
+	size_t                   _num_running = 0;
+	bool                     _quit = false;
+	std::vector<std::thread> _threads;
+};
@@ -0,0 +1,183 @@
+#include "parameter_sweep.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <ostream>
+#include <utility>
+
+#include <loguru.hpp>
+
+#include "parallel.hpp"
+
+/// The kernels decide how the data components are assembled, so configurations can only share a system if both agree.
+using Kernels = std::pair<GradientKernel, ValueKernel>;
+
+Kernels kernels_of(const Weights& weights)
+{
+	return {weights.gradient_kernel, weights.value_kernel};
+}
+
+/// A Weights with the given kernels, where every class has the largest weight it has in any of the configurations.
+Weights max_weights(const Kernels& kernels, const std::vector<const SweepConfig*>& configs)
+{
+	Weights result = unit_weights(ConstraintClass::kDataPos, Weights{});
+	result.data_pos        = 0;
+	result.gradient_kernel = kernels.first;
+	result.value_kernel    = kernels.second;
+	for (const SweepConfig* config : configs) {
+		const Weights& weights = config->weights;
+		result.data_pos            = std::max(result.data_pos,            weights.data_pos);
+		result.data_gradient       = std::max(result.data_gradient,       weights.data_gradient);
+		result.model_0             = std::max(result.model_0,             weights.model_0);
+		result.model_1             = std::max(result.model_1,             weights.model_1);
+		result.model_2             = std::max(result.model_2,             weights.model_2);
+		result.model_3             = std::max(result.model_3,             weights.model_3);
+		result.model_4             = std::max(result.model_4,             weights.model_4);
+		result.gradient_smoothness = std::max(result.gradient_smoothness, weights.gradient_smoothness);
+	}
+	return result;
+}
+
+/// Rough estimate of the peak memory use of solving one configuration.
+size_t estimate_solve_bytes(const WeightedSystem& system, const SweepConfig& config)
+{
+	size_t AtA_nnz = 0;
+	for (const auto& component : system.components()) {
+		AtA_nnz = std::max<size_t>(AtA_nnz, component->normal.AtA.nonZeros());
+	}
+	// The exact solver suffers from fill-in. The approximate one holds a few copies of AtA (tiles, coarse, CG).
+	const size_t matrix_copies = config.exact_solve ? 8 : 3;
+	const size_t bytes_per_nonzero = sizeof(float) + sizeof(Index);
+	const size_t vector_bytes = 8 * sizeof(float) * system.num_unknowns();
+	return matrix_copies * bytes_per_nonzero * AtA_nnz + vector_bytes;
+}
+
+std::vector<SweepResult> run_parameter_sweep(
+	const std::vector<int>&         sizes,
+	const int                       num_points,
+	const float                     positions[],
+	const float*                    normals,
+	const float*                    point_weights,
+	const std::vector<SweepConfig>& configs,
+	const SweepScoreFunction&       score_function,
+	const SweepOptions&             options)
+{
+	LOG_SCOPE_F(INFO, "run_parameter_sweep");
+	if (configs.empty()) { return {}; }
+
+	// Each combination of gradient and value kernel needs its own data components:
+	std::map<Kernels, std::vector<const SweepConfig*>> configs_per_kernels;
+	for (const auto& config : configs) {
+		configs_per_kernels[kernels_of(config.weights)].push_back(&config);
+	}
+
+	ModelSystemCache model_cache;
+	std::map<Kernels, std::shared_ptr<const WeightedSystem>> systems;
+	for (const auto& kernels_and_configs : configs_per_kernels) {
+		systems[kernels_and_configs.first] = std::make_shared<WeightedSystem>(sdf_system_from_points(
+			sizes, max_weights(kernels_and_configs.first, kernels_and_configs.second),
+			num_points, positions, normals, point_weights, &model_cache));
+	}
+
+	size_t max_solve_bytes = 1;
+	for (const auto& config : configs) {
+		const auto& system = *systems.at(kernels_of(config.weights));
+		max_solve_bytes = std::max(max_solve_bytes, estimate_solve_bytes(system, config));
+	}
+	const size_t num_threads = options.num_threads > 0 ? options.num_threads : num_worker_threads();
+	const size_t max_concurrent = std::max<size_t>(1, std::min(num_threads, options.memory_budget_bytes / max_solve_bytes));
+	LOG_F(INFO, "Solving %lu configurations, %lu at a time", configs.size(), max_concurrent);
+
+	std::vector<SweepResult> results(configs.size());
+
+	{
+		ThreadPool pool(max_concurrent);
+		for (size_t config_index = 0; config_index < configs.size(); ++config_index) {
+			pool.add([&, config_index]() {
+				const SweepConfig& config = configs[config_index];
+				const WeightedSystem& system = *systems.at(kernels_of(config.weights));
+
+				const auto start_time = std::chrono::steady_clock::now();
+				const NormalEquation normal = system.normal_equation(config.weights);
+				std::vector<float> field = config.exact_solve
+					? solve_normal_equation(normal)
+					: solve_normal_equation_approximate_lattice(normal, sizes, config.solve_options);
+				const auto end_time = std::chrono::steady_clock::now();
+
+				if (field.size() != system.num_unknowns()) {
+					LOG_F(WARNING, "Configuration %lu failed to solve", config_index);
+					field.resize(system.num_unknowns(), 0.0f);
+				}
+
+				Weights data_weights = unit_weights(ConstraintClass::kDataPos, config.weights);
+				data_weights.data_gradient = 1;
+				const std::vector<float> data_error_map = system.error_map(data_weights, field);
+
+				SweepResult& result = results[config_index];
+				result.config_index = config_index;
+				result.data_error = std::accumulate(data_error_map.begin(), data_error_map.end(), 0.0f);
+				result.score = score_function ? score_function(field) : 0.0f;
+				result.duration_seconds = std::chrono::duration<double>(end_time - start_time).count();
+			});
+		}
+	}
+
+	std::stable_sort(results.begin(), results.end(), [&](const SweepResult& a, const SweepResult& b) {
+		return score_function ? a.score < b.score : a.data_error < b.data_error;
+	});
+
+	return results;
+}
+
+const char* kernel_name(GradientKernel kernel)
+{
+	switch (kernel) {
+		case GradientKernel::kNearestNeighbor:     return "nearest";
+		case GradientKernel::kCellEdges:           return "edges";
+		case GradientKernel::kLinearInteprolation: return "lerp";
+	}
+	return "?";
+}
+
+const char* kernel_name(ValueKernel kernel)
+{
+	switch (kernel) {
+		case ValueKernel::kMultilinear:     return "lerp";
+		case ValueKernel::kNearestNeighbor: return "nearest";
+	}
+	return "?";
+}
+
+void print_sweep_table(
+	std::ostream&                   os,
+	const std::vector<SweepConfig>& configs,
+	const std::vector<SweepResult>& results)
+{
+	os << "rank      score data_error    seconds | data_pos data_grad  model_0  model_1  model_2  model_3  model_4 grad_smooth  kernel   value exact\n";
+	for (size_t rank = 0; rank < results.size(); ++rank) {
+		const SweepResult& result = results[rank];
+		const SweepConfig& config = configs[result.config_index];
+		const Weights& w = config.weights;
+		os << std::setw(4) << rank
+		   << std::setw(11) << result.score
+		   << std::setw(11) << result.data_error
+		   << std::setw(11) << result.duration_seconds
+		   << " |"
+		   << std::setw(9) << w.data_pos
+		   << std::setw(10) << w.data_gradient
+		   << std::setw(9) << w.model_0
+		   << std::setw(9) << w.model_1
+		   << std::setw(9) << w.model_2
+		   << std::setw(9) << w.model_3
+		   << std::setw(9) << w.model_4
+		   << std::setw(12) << w.gradient_smoothness
+		   << std::setw(8) << kernel_name(w.gradient_kernel)
+		   << std::setw(8) << kernel_name(w.value_kernel)
+		   << std::setw(6) << (config.exact_solve ? "yes" : "no")
+		   << "\n";
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <functional>
+#include <iosfwd>
+#include <vector>
+
+#include "field_interpolation.hpp"
+#include "sparse_linear.hpp"
+
+/// One configuration to try in a parameter sweep.
+struct SweepConfig
+{
+	Weights      weights;
+	bool         exact_solve = false;
+	SolveOptions solve_options;
+};
+
+struct SweepResult
+{
+	size_t config_index;     ///< Index into the configs given to run_parameter_sweep.
+	float  data_error;       ///< Sum of squared data residuals, measured with unit data weights.
+	float  score;            ///< From the score function (lower is better), or zero.
+	double duration_seconds; ///< Time to re-weight and solve this configuration.
+};
+
+/// Given a solved field, return how bad it is, e.g. compared to some ground truth. Lower is better.
+using SweepScoreFunction = std::function<float(const std::vector<float>& field)>;
+
+struct SweepOptions
+{
+	size_t num_threads         = 0;         ///< 0 means num_worker_threads().
+	size_t memory_budget_bytes = 1ul << 30; ///< Limits how many configurations are solved at once.
+};
+
+/// Generate a signed distance field (see sdf_from_points) for each configuration, using the same points.
+/// The points are only ingested once per combination of gradient and value kernel,
+/// and the sparsity pattern is shared by all configurations (see WeightedSystem).
+/// The configurations are then solved concurrently.
+/// Returns the results ranked best first: by score if there is a score_function, else by data_error.
+std::vector<SweepResult> run_parameter_sweep(
+	const std::vector<int>&         sizes,
+	const int                       num_points,
+	const float                     positions[],    // Interleaved coordinates, e.g. xyxyxy...
+	const float*                    normals,        // Optional (may be null).
+	const float*                    point_weights,  // Optional (may be null).
+	const std::vector<SweepConfig>& configs,
+	const SweepScoreFunction&       score_function, // Optional (may be empty).
+	const SweepOptions&             options);
+
+/// Print ranked results as a table of accuracy and time.
+void print_sweep_table(
+	std::ostream&                   os,
+	const std::vector<SweepConfig>& configs,
+	const std::vector<SweepResult>& results);
@@ -0,0 +1,151 @@
+#include "periodic_solver.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include <loguru.hpp>
+
+#include "cg_checkpoint.hpp"
+
+namespace {
+
+const double kPi = 3.14159265358979323846;
+
+/// The symbol of the normal equations of the model constraints added by add_model_constraint:
+/// the eigenvalue of M for each point of the spectrum of `fft`.
+/// Along an axis with spacing h the n:th difference has the eigenvalues (2 - 2·cos θ)^(n/2) / hⁿ
+/// in magnitude, where θ = 2π·k/size is the angular frequency.
+std::vector<double> model_symbol(const LatticeFft& fft, const LatticeField& field, const Weights& weights)
+{
+	const std::vector<int>& sizes          = fft.sizes();
+	const std::vector<int>& spectrum_sizes = fft.spectrum_sizes();
+	const int num_dim = sizes.size();
+
+	const double model_weights[] = {weights.model_1, weights.model_2, weights.model_3, weights.model_4};
+	const double smoothness = weights.gradient_smoothness;
+
+	std::vector<double> symbol(fft.spectrum_size());
+	for (size_t i = 0; i < symbol.size(); ++i) {
+		// s[d] is the eigenvalue of the (spacing-scaled) second difference along d: 1 - 2 + 1.
+		double s[MAX_DIM];
+		size_t rest = i;
+		for (int d = 0; d < num_dim; ++d) {
+			const int k = rest % spectrum_sizes[d];
+			rest /= spectrum_sizes[d];
+			const double h = field.axis_spacing(d);
+			s[d] = (2 - 2 * std::cos(2 * kPi * k / sizes[d])) / (h * h);
+		}
+
+		double value = num_dim * double(weights.model_0) * weights.model_0;
+		for (int d = 0; d < num_dim; ++d) {
+			double power = 1;
+			for (const double model_weight : model_weights) {
+				power *= s[d];
+				value += model_weight * model_weight * power;
+			}
+			for (int o = 0; o < num_dim; ++o) {
+				if (o == d) { continue; }
+				value += smoothness * smoothness * s[d] * s[o];
+			}
+		}
+		symbol[i] = value;
+	}
+	return symbol;
+}
+
+} // namespace
+
+PeriodicSolver::PeriodicSolver(const LatticeField& field, const Weights& weights, const SparseMatrix& AtA)
+	: _fft(field.sizes)
+{
+	for (int d = 0; d < field.sizes.size(); ++d) {
+		CHECK_F(field.is_periodic(d), "PeriodicSolver needs a lattice which is periodic along every axis");
+	}
+	const Index num_unknowns = field.num_unknowns();
+	CHECK_EQ_F(AtA.rows(), num_unknowns);
+	CHECK_EQ_F(AtA.cols(), num_unknowns);
+
+	_symbol = model_symbol(_fft, field, weights);
+
+	// Every diagonal element of M is the same, so whatever is left of the diagonal of AtA comes from the data:
+	VectorXr unit = VectorXr::Zero(num_unknowns);
+	unit[0] = 1;
+	const double model_diagonal = apply_in_frequency_domain(unit, _symbol)[0];
+	_data_diagonal = static_cast<float>(AtA.diagonal().cast<double>().mean() - model_diagonal);
+	_data_diagonal = std::max(_data_diagonal, 0.0f);
+
+	double max_symbol = 0;
+	for (double& value : _symbol) {
+		value += _data_diagonal;
+		max_symbol = std::max(max_symbol, value);
+	}
+	_inverse_symbol.resize(_symbol.size());
+	for (size_t i = 0; i < _symbol.size(); ++i) {
+		_inverse_symbol[i] = _symbol[i] > 1e-9 * max_symbol ? 1 / _symbol[i] : 0;
+	}
+
+	// Compare AtA with M + c·I on a random vector:
+	std::default_random_engine rng(0);
+	std::uniform_real_distribution<float> distribution(-1, 1);
+	VectorXr probe(num_unknowns);
+	for (Index i = 0; i < num_unknowns; ++i) {
+		probe[i] = distribution(rng);
+	}
+	const VectorXr expected = AtA.selfadjointView<Eigen::Lower>() * probe;
+	const float difference = (expected - multiply(probe)).norm();
+	_exact = difference <= 1e-4f * expected.norm();
+
+	LOG_F(INFO, "Periodic solver: data diagonal %f, relative difference to AtA: %g (%s)",
+	      _data_diagonal, difference / std::max(expected.norm(), std::numeric_limits<float>::min()),
+	      _exact ? "exact" : "preconditioner only");
+}
+
+VectorXr PeriodicSolver::apply_in_frequency_domain(const VectorXr& x, const std::vector<double>& factors) const
+{
+	CHECK_EQ_F(static_cast<size_t>(x.size()), _fft.num_values());
+	std::vector<LatticeFft::Complex> spectrum(_fft.spectrum_size());
+	_fft.forward(x.data(), spectrum.data());
+	for (size_t i = 0; i < spectrum.size(); ++i) {
+		spectrum[i] *= factors[i];
+	}
+	VectorXr result(x.size());
+	_fft.inverse(spectrum.data(), result.data());
+	return result;
+}
+
+VectorXr PeriodicSolver::solve(const VectorXr& rhs) const
+{
+	return apply_in_frequency_domain(rhs, _inverse_symbol);
+}
+
+VectorXr PeriodicSolver::multiply(const VectorXr& x) const
+{
+	return apply_in_frequency_domain(x, _symbol);
+}
+
+std::vector<float> solve_periodic(const LatticeField& field, const Weights& weights, float error_tolerance)
+{
+	LOG_SCOPE_F(INFO, "solve_periodic");
+	const NormalEquation normal = make_normal_equation(field);
+	const PeriodicSolver solver(field, weights, normal.AtA);
+	VectorXr solution = solver.solve(normal.Atb);
+
+	if (!solver.is_exact()) {
+		Eigen::Index iterations = std::max<Eigen::Index>(2 * normal.AtA.cols(), 1);
+		float error = error_tolerance;
+		checkpointed_conjugate_gradient(
+			normal.AtA.selfadjointView<Eigen::Lower>(), normal.Atb, &solution, solver, &iterations, &error, nullptr);
+
+		LOG_F(INFO, "CG iterations: %lu", iterations);
+		LOG_F(INFO, "CG error:      %f",  error);
+
+		if (error > error_tolerance) {
+			LOG_F(WARNING, "CG did not converge");
+			return {};
+		}
+	}
+
+	return std::vector<float>(solution.data(), solution.data() + solution.size());
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include "fft.hpp"
+#include "field_interpolation.hpp"
+
+/// Solver for lattices which wrap around along every axis (see LatticeField::set_periodic).
+///
+/// The model constraints of a fully periodic lattice are the same at every lattice point, so their normal
+/// equations M form a circulant matrix. The Fourier transform diagonalizes it: M = F⁻¹·diag(m)·F,
+/// where the symbol m is known in closed form from the model weights and the lattice spacing.
+/// A constant diagonal c·I is diagonalized along with it, so (M + c·I)⁻¹ is applied in O(N log N).
+///
+/// If the data constraints add exactly such a diagonal (a value constraint on every lattice point with the
+/// same weight, or no data and a model_0 weight) then AtA = M + c·I and the solve is exact,
+/// without any factorization. Otherwise c is the mean data weight per lattice point, and (M + c·I)⁻¹
+/// is a good preconditioner for conjugate gradient on AtA.
+class PeriodicSolver
+{
+public:
+	/// `field` must be periodic along every axis, and `weights` those of its model constraints.
+	/// `AtA` is the normal equation of all of `field` (model and data).
+	PeriodicSolver(const LatticeField& field, const Weights& weights, const SparseMatrix& AtA);
+
+	/// Is AtA == M + c·I (to float precision), so that solve() gives the exact solution?
+	bool is_exact() const { return _exact; }
+
+	/// The constant diagonal c added to the model.
+	float data_diagonal() const { return _data_diagonal; }
+
+	/// (M + c·I)⁻¹·rhs. If M + c·I is singular (no model_0 nor data) the constant is left out of the solution.
+	VectorXr solve(const VectorXr& rhs) const;
+
+	/// (M + c·I)·x
+	VectorXr multiply(const VectorXr& x) const;
+
+	Eigen::ComputationInfo info() { return Eigen::Success; }
+
+private:
+	/// Multiply the spectrum of `x` by `factors`.
+	VectorXr apply_in_frequency_domain(const VectorXr& x, const std::vector<double>& factors) const;
+
+	LatticeFft          _fft;
+	std::vector<double> _symbol;         ///< m + c, for each point of the spectrum.
+	std::vector<double> _inverse_symbol; ///< 1 / (m + c), or zero where that is singular.
+	float               _data_diagonal = 0;
+	bool                _exact = false;
+};
+
+/// Solve the normal equations of a field which is periodic along every axis.
+/// Directly if the PeriodicSolver is exact, else with conjugate gradient preconditioned by it.
+/// `weights` are those of the model constraints of `field`.
+/// Returns an empty vector if CG does not converge.
+std::vector<float> solve_periodic(const LatticeField& field, const Weights& weights, float error_tolerance = 1e-3f);
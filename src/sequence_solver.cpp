@@ -0,0 +1,137 @@
+#include "sequence_solver.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include <Eigen/IterativeLinearSolvers>
+
+#include <loguru.hpp>
+
+#include "cg_checkpoint.hpp"
+
+using Preconditioner = Eigen::IncompleteCholesky<float, Eigen::Lower, Eigen::AMDOrdering<Index>>;
+
+struct SequenceSolver::State
+{
+	VectorXr           solution;
+	std::vector<Index> outer_pattern; ///< AtA.outerIndexPtr() of the frame the preconditioner was made for.
+	std::vector<Index> inner_pattern; ///< AtA.innerIndexPtr() of the frame the preconditioner was made for.
+	Preconditioner     preconditioner;
+	bool               has_preconditioner = false;
+	int                frames_since_refresh = 0;
+	int                iterations_after_refresh = 0; ///< CG iterations needed right after the last refresh.
+};
+
+namespace {
+
+bool same_pattern(const SparseMatrix& AtA, const std::vector<Index>& outer, const std::vector<Index>& inner)
+{
+	return static_cast<size_t>(AtA.outerSize()) + 1 == outer.size()
+	    && static_cast<size_t>(AtA.nonZeros()) == inner.size()
+	    && std::equal(outer.begin(), outer.end(), AtA.outerIndexPtr())
+	    && std::equal(inner.begin(), inner.end(), AtA.innerIndexPtr());
+}
+
+} // namespace
+
+SequenceSolver::SequenceSolver(const std::vector<int>& sizes, const SequenceOptions& options)
+	: _sizes(sizes), _options(options), _state(new State)
+{
+}
+
+SequenceSolver::~SequenceSolver() = default;
+
+void SequenceSolver::reset()
+{
+	_state.reset(new State);
+}
+
+std::vector<float> SequenceSolver::solve(const NormalEquation& normal)
+{
+	LOG_SCOPE_F(INFO, "SequenceSolver::solve");
+	const auto start_time = std::chrono::steady_clock::now();
+
+	const SparseMatrix& AtA = normal.AtA;
+	const VectorXr&     Atb = normal.Atb;
+	CHECK_F(AtA.isCompressed());
+
+	State& state = *_state;
+	_last_frame = FrameStats{};
+	_last_frame.initial_residual = 1;
+
+	if (state.solution.size() == Atb.size()) {
+		const float rhs_norm = Atb.norm();
+		_last_frame.initial_residual = rhs_norm > 0 ? (Atb - AtA * state.solution).norm() / rhs_norm : 0;
+	}
+	_last_frame.warm_start = _last_frame.initial_residual <= _options.warm_tolerance;
+
+	std::vector<float> result;
+
+	if (_last_frame.warm_start) {
+		// Note that a preconditioner made for an earlier frame is still a valid preconditioner
+		// even if the sparsity pattern has since changed (e.g. points moving between cells).
+		const bool refresh =
+			!state.has_preconditioner
+			|| state.frames_since_refresh >= _options.preconditioner_refresh_interval;
+
+		if (refresh) {
+			if (!same_pattern(AtA, state.outer_pattern, state.inner_pattern)) {
+				state.outer_pattern.assign(AtA.outerIndexPtr(), AtA.outerIndexPtr() + AtA.outerSize() + 1);
+				state.inner_pattern.assign(AtA.innerIndexPtr(), AtA.innerIndexPtr() + AtA.nonZeros());
+				state.preconditioner.analyzePattern(AtA);
+			}
+			state.preconditioner.factorize(AtA);
+			state.has_preconditioner = state.preconditioner.info() == Eigen::Success;
+			state.frames_since_refresh = 0;
+			_last_frame.refreshed_preconditioner = true;
+		}
+
+		if (state.has_preconditioner) {
+			// Run preconditioned CG using the (possibly slightly stale) preconditioner:
+			VectorXr x = state.solution;
+			Eigen::Index iterations = std::max<Eigen::Index>(2 * AtA.cols(), 1);
+			float error = _options.solve_options.error_tolerance;
+			checkpointed_conjugate_gradient(
+				AtA.selfadjointView<Eigen::Lower>(), Atb, &x, state.preconditioner, &iterations, &error, nullptr);
+			_last_frame.cg_iterations = static_cast<int>(iterations);
+			state.frames_since_refresh += 1;
+
+			if (refresh) {
+				state.iterations_after_refresh = _last_frame.cg_iterations;
+			} else if (_last_frame.cg_iterations > 2 * state.iterations_after_refresh + 10) {
+				// The frames have drifted too far from the preconditioner:
+				state.frames_since_refresh = _options.preconditioner_refresh_interval;
+			}
+
+			LOG_F(INFO, "Warm start: residual %f, %d CG iterations, error: %f",
+			      _last_frame.initial_residual, _last_frame.cg_iterations, error);
+
+			if (error <= _options.solve_options.error_tolerance) {
+				result.assign(x.data(), x.data() + x.size());
+			} else {
+				LOG_F(WARNING, "Warm start did not converge, falling back to a cold solve");
+				state.frames_since_refresh = _options.preconditioner_refresh_interval;
+				_last_frame.warm_start = false;
+			}
+		} else {
+			LOG_F(WARNING, "Failed to compute preconditioner");
+			_last_frame.warm_start = false;
+		}
+	}
+
+	if (!_last_frame.warm_start) {
+		result = solve_normal_equation_approximate_lattice(normal, _sizes, _options.solve_options);
+	}
+
+	if (result.size() == static_cast<size_t>(Atb.size())) {
+		state.solution = Eigen::Map<const VectorXr>(result.data(), result.size());
+	} else {
+		state.solution.resize(0);
+	}
+
+	_num_frames += 1;
+	const auto end_time = std::chrono::steady_clock::now();
+	_last_frame.seconds = std::chrono::duration<double>(end_time - start_time).count();
+	LOG_F(INFO, "Frame %lu solved in %.3f ms", _num_frames, 1000 * _last_frame.seconds);
+	return result;
+}
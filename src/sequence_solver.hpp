@@ -0,0 +1,60 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "sparse_linear.hpp"
+
+struct SequenceOptions
+{
+	SolveOptions solve_options;
+
+	/// If the previous solution has a relative residual |Atb - AtA·x| / |Atb| below this
+	/// it is used directly as the initial guess for CG, skipping the downscale and tile stages.
+	float warm_tolerance = 0.1f;
+
+	/// Recompute the preconditioner at least this often (in warm frames).
+	/// In between, the preconditioner of an earlier frame is used, which is fine as long as the frames are similar.
+	int preconditioner_refresh_interval = 30;
+};
+
+/// How a frame was solved.
+struct FrameStats
+{
+	double seconds                  = 0;     ///< Latency of the solve.
+	bool   warm_start               = false; ///< Did we skip the downscale and tile stages?
+	bool   refreshed_preconditioner = false;
+	float  initial_residual         = 0;     ///< Relative residual of the previous solution (or 1 if none).
+	int    cg_iterations            = 0;
+};
+
+/// Solves a sequence of similar systems, e.g. one per frame from a moving sensor.
+/// Keeps the previous solution, sparsity pattern and preconditioner around.
+/// Frames with no good previous solution, or whose warm CG does not reach
+/// `solve_options.error_tolerance`, fall back to solve_normal_equation_approximate_lattice.
+class SequenceSolver
+{
+public:
+	explicit SequenceSolver(const std::vector<int>& sizes, const SequenceOptions& options = {});
+	~SequenceSolver();
+
+	/// Solve the next frame. Returns empty vector on failure.
+	std::vector<float> solve(const NormalEquation& normal);
+
+	/// Stats of the last call to solve.
+	const FrameStats& last_frame() const { return _last_frame; }
+
+	size_t num_frames() const { return _num_frames; }
+
+	/// Forget the previous frame, e.g. after a cut.
+	void reset();
+
+private:
+	struct State;
+
+	std::vector<int>       _sizes;
+	SequenceOptions        _options;
+	std::unique_ptr<State> _state;
+	FrameStats             _last_frame;
+	size_t                 _num_frames = 0;
+};
@@ -4,39 +4,144 @@
 #include <Eigen/IterativeLinearSolvers>
 #include <Eigen/Sparse>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+
 #include <loguru.hpp>
 
-using VectorXr = Eigen::Matrix<float, Eigen::Dynamic, 1>;
-using SparseMatrix = Eigen::SparseMatrix<float>;
+#include "amg.hpp"
+#include "cg_checkpoint.hpp"
+#include "coarse_space.hpp"
+#include "lattice_smoother.hpp"
+#include "parallel.hpp"
+
+using SparseMatrixRowMajor = Eigen::SparseMatrix<float, Eigen::RowMajor, Index>;
 
-SparseMatrix as_sparse_matrix(
-    const std::vector<Triplet>& triplets, size_t num_rows, size_t num_columns)
+/// Tiles are small, so they use 32-bit indices even when Index is 64-bit.
+using TileMatrix = Eigen::SparseMatrix<float, Eigen::ColMajor, int>;
+
+void LinearEquation::end_row(float row_rhs)
 {
-	LOG_SCOPE_F(INFO, "as_sparse_matrix");
-
-#if 0
-	std::vector<Eigen::Triplet<float>> eigen_triplets;
-	eigen_triplets.reserve(triplets.size());
-	for (const auto& triplet : triplets) {
-		CHECK_GE_F(triplet.col, 0);
-		CHECK_GE_F(triplet.row, 0);
-		CHECK_LT_F(triplet.col, num_columns);
-		CHECK_LT_F(triplet.row, num_rows);
-		if (triplet.value != 0.0f) {
-			eigen_triplets.emplace_back(triplet.row, triplet.col, triplet.value);
+	CHECK_LE_F(cols.size(), std::numeric_limits<Index>::max(), "Too many non-zeros for Index type");
+	const size_t row_start = row_starts.back();
+
+	// Rows are short, so insertion sort is the fastest. It is stable, so duplicates are summed in order.
+	for (size_t i = row_start + 1; i < cols.size(); ++i) {
+		const Index col   = cols[i];
+		const float value = values[i];
+		size_t j = i;
+		for (; j > row_start && cols[j - 1] > col; --j) {
+			cols[j]   = cols[j - 1];
+			values[j] = values[j - 1];
 		}
+		cols[j]   = col;
+		values[j] = value;
 	}
 
-	SparseMatrix A(num_rows, num_columns);
-	A.setFromTriplets(eigen_triplets.begin(), eigen_triplets.end());
-#else
-	static_assert(sizeof(Triplet) == sizeof(Eigen::Triplet<float>), "");
-	SparseMatrix A(num_rows, num_columns);
-	const Eigen::Triplet<float>* ptr = reinterpret_cast<const Eigen::Triplet<float>*>(triplets.data());
-	A.setFromTriplets(ptr, ptr + triplets.size());
-#endif
-	A.makeCompressed();
-	return A;
+	size_t row_end = row_start;
+	for (size_t i = row_start; i < cols.size(); ++i) {
+		if (row_end > row_start && cols[row_end - 1] == cols[i]) {
+			values[row_end - 1] += values[i];
+		} else {
+			cols[row_end]   = cols[i];
+			values[row_end] = values[i];
+			row_end += 1;
+		}
+	}
+	cols.resize(row_end);
+	values.resize(row_end);
+
+	row_starts.push_back(row_end);
+	rhs.push_back(row_rhs);
+}
+
+void LinearEquation::reserve_additional(const EquationCapacity& additional)
+{
+	row_starts.reserve(row_starts.size() + additional.rows);
+	rhs.reserve(rhs.size() + additional.rows);
+	cols.reserve(cols.size() + additional.nonzeros);
+	values.reserve(values.size() + additional.nonzeros);
+}
+
+size_t LinearEquation::allocated_bytes() const
+{
+	return row_starts.capacity() * sizeof(Index)
+	     + cols.capacity()       * sizeof(Index)
+	     + values.capacity()     * sizeof(float)
+	     + rhs.capacity()        * sizeof(float);
+}
+
+LinearEquation EquationPool::acquire(const EquationCapacity& capacity)
+{
+	LinearEquation eq;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_equations.empty()) {
+			const auto fits = [&](const LinearEquation& candidate) {
+				return candidate.rhs.capacity() >= capacity.rows && candidate.values.capacity() >= capacity.nonzeros;
+			};
+			const auto by_size = [](const LinearEquation& a, const LinearEquation& b) {
+				return a.allocated_bytes() < b.allocated_bytes();
+			};
+			// The smallest one that fits, else the largest one:
+			auto best = _equations.end();
+			for (auto it = _equations.begin(); it != _equations.end(); ++it) {
+				if (fits(*it) && (best == _equations.end() || by_size(*it, *best))) {
+					best = it;
+				}
+			}
+			if (best == _equations.end()) {
+				best = std::max_element(_equations.begin(), _equations.end(), by_size);
+			}
+			eq = std::move(*best);
+			_equations.erase(best);
+		}
+	}
+	eq.reserve_additional(capacity);
+	return eq;
+}
+
+void EquationPool::release(LinearEquation&& eq)
+{
+	eq.row_starts.resize(1);
+	eq.row_starts[0] = 0;
+	eq.cols.clear();
+	eq.values.clear();
+	eq.rhs.clear();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_equations.push_back(std::move(eq));
+	if (_equations.size() > _max_equations) {
+		// Drop the smallest:
+		auto smallest = std::min_element(_equations.begin(), _equations.end(),
+			[](const LinearEquation& a, const LinearEquation& b) { return a.allocated_bytes() < b.allocated_bytes(); });
+		_equations.erase(smallest);
+	}
+}
+
+size_t EquationPool::pooled_bytes() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	size_t bytes = 0;
+	for (const auto& eq : _equations) {
+		bytes += eq.allocated_bytes();
+	}
+	return bytes;
+}
+
+/// Zero-copy view of the A in Ax=b.
+/// Optionally with other `values` (same pattern).
+Eigen::Map<const SparseMatrixRowMajor> as_sparse_matrix(
+	const LinearEquation& eq, size_t num_columns, const float* values = nullptr)
+{
+	CHECK_EQ_F(eq.row_starts.size(), eq.rhs.size() + 1);
+	CHECK_EQ_F(eq.cols.size(), eq.values.size());
+	return Eigen::Map<const SparseMatrixRowMajor>(
+		eq.num_rows(), num_columns, eq.num_nonzeros(),
+		eq.row_starts.data(), eq.cols.data(), values ? values : eq.values.data());
 }
 
 VectorXr as_eigen_vector(const std::vector<float>& values)
@@ -49,7 +154,8 @@ std::vector<float> as_std_vector(const VectorXr& values)
 	return std::vector<float>(values.data(), values.data() + values.rows() * values.cols());
 }
 
-SparseMatrix make_square(const SparseMatrix& A)
+template<typename Matrix>
+SparseMatrix make_square(const Matrix& A)
 {
 	LOG_SCOPE_F(INFO, "AtA");
 	SparseMatrix AtA = A.transpose() * A;
@@ -58,18 +164,40 @@ SparseMatrix make_square(const SparseMatrix& A)
 	return AtA;
 }
 
-std::vector<float> solve_sparse_linear(
-	int                         num_columns,
-	const std::vector<Triplet>& triplets,
-	const std::vector<float>&   rhs)
+NormalEquation make_normal_equation(Index num_columns, const LinearEquation& eq)
 {
-	LOG_SCOPE_F(INFO, "solve_sparse_linear");
-	const SparseMatrix A = as_sparse_matrix(triplets, rhs.size(), num_columns);
-	const SparseMatrix AtA = make_square(A);
-	const VectorXr Atb = A.transpose() * as_eigen_vector(rhs);
+	LOG_SCOPE_F(INFO, "make_normal_equation");
+	const auto A = as_sparse_matrix(eq, num_columns);
 
 	LOG_F(INFO, "A nnz: %lu (%.3f%%)", A.nonZeros(),
 	      100.0f * A.nonZeros() / (A.rows() * A.cols()));
+
+	NormalEquation normal;
+	normal.AtA = make_square(A);
+	normal.Atb = A.transpose() * as_eigen_vector(eq.rhs);
+	return normal;
+}
+
+void add_normal_equation(NormalEquation* sum, const NormalEquation& term)
+{
+	CHECK_EQ_F(sum->Atb.size(), term.Atb.size());
+	sum->AtA += term.AtA;
+	sum->Atb += term.Atb;
+}
+
+std::vector<float> solve_sparse_linear(
+	Index                 num_columns,
+	const LinearEquation& eq)
+{
+	LOG_SCOPE_F(INFO, "solve_sparse_linear");
+	return solve_normal_equation(make_normal_equation(num_columns, eq));
+}
+
+std::vector<float> solve_normal_equation(const NormalEquation& normal)
+{
+	LOG_SCOPE_F(INFO, "solve_normal_equation");
+	const SparseMatrix& AtA = normal.AtA;
+
 	LOG_F(INFO, "AtA nnz: %lu (%.3f%%)", AtA.nonZeros(),
 	      100.0f * AtA.nonZeros() / (AtA.rows() * AtA.cols()));
 
@@ -88,7 +216,7 @@ std::vector<float> solve_sparse_linear(
 		return {};
 	}
 
-	VectorXr solution = solver.solve(Atb);
+	VectorXr solution = solver.solve(normal.Atb);
 	// VectorXr solution = solver.solve(as_eigen_vector(rhs));
 
 	if (solver.info() != Eigen::Success) {
@@ -102,16 +230,15 @@ std::vector<float> solve_sparse_linear(
 }
 
 std::vector<float> solve_sparse_linear_with_guess(
-	const std::vector<Triplet>& triplets,
-	const std::vector<float>&   rhs,
-	const std::vector<float>&   guess,
-	float                       error_tolerance)
+	const LinearEquation&     eq,
+	const std::vector<float>& guess,
+	float                     error_tolerance)
 {
 	LOG_SCOPE_F(INFO, "solve_sparse_linear_with_guess");
 
-	const SparseMatrix A = as_sparse_matrix(triplets, rhs.size(), guess.size());
+	const auto A = as_sparse_matrix(eq, guess.size());
 	const SparseMatrix AtA = make_square(A);
-	const VectorXr Atb = A.transpose() * as_eigen_vector(rhs);
+	const VectorXr Atb = A.transpose() * as_eigen_vector(eq.rhs);
 
 	LOG_SCOPE_F(INFO, "solveWithGuess");
 	Eigen::BiCGSTAB<SparseMatrix> solver(AtA);
@@ -129,6 +256,13 @@ std::vector<float> solve_sparse_linear_with_guess(
 	return as_std_vector(solution);
 }
 
+VectorXr placed_vector(Index size)
+{
+	VectorXr vector(size);
+	place_pages(vector.data(), size);
+	return vector;
+}
+
 VectorXr downscale_solver(
 	const SparseMatrix&     AtA_full,
 	const VectorXr&         Atb_full,
@@ -136,72 +270,16 @@ VectorXr downscale_solver(
 	int                     downscale_factor)
 {
 	LOG_SCOPE_F(INFO, "downscale_solver");
-	CHECK_GE_F(downscale_factor, 2);
-
-	std::vector<int> sizes_small;
-	int num_unknowns_small = 1;
-	for (int size_full : sizes_full) {
-		sizes_small.push_back((size_full + downscale_factor - 1) / downscale_factor);
-		num_unknowns_small *= sizes_small.back();
-	}
-
-	const auto as_small_index = [=](int full_index) {
-		int index_small = 0;
-		int stride_small = 1;
-		for (int d = 0; d < sizes_full.size(); ++d) {
-			int pos_full = full_index % sizes_full[d];
-			int pos_small = pos_full / downscale_factor;
-			index_small += stride_small * pos_small;
-			full_index /= sizes_full[d];
-			stride_small *= sizes_small[d];
-		}
-		return index_small;
-	};
-
-	std::vector<Eigen::Triplet<float>> AtA_triplets_small;
-	for (int k=0; k < AtA_full.outerSize(); ++k) {
-		for (SparseMatrix::InnerIterator it(AtA_full, k); it; ++it) {
-			AtA_triplets_small.emplace_back(as_small_index(it.row()), as_small_index(it.col()), it.value());
-		}
-	}
-
-	SparseMatrix AtA_small(num_unknowns_small, num_unknowns_small);
-	AtA_small.setFromTriplets(AtA_triplets_small.begin(), AtA_triplets_small.end());
-	AtA_small.makeCompressed();
-
-	VectorXr Atb_small = VectorXr::Zero(num_unknowns_small);
-	for (int full_i = 0; full_i < Atb_full.size(); ++full_i) {
-		Atb_small[as_small_index(full_i)] += Atb_full[full_i];
-	}
-
-	// ------------------------------------------------------------------------
-
-	LOG_F(INFO, "AtA_small nnz: %lu (%.3f%%)", AtA_small.nonZeros(),
-	      100.0f * AtA_small.nonZeros() / (AtA_small.rows() * AtA_small.cols()));
-
-	Eigen::SimplicialLLT<SparseMatrix> solver_small(AtA_small);
-
-	if (solver_small.info() != Eigen::Success) {
-		LOG_F(WARNING, "solver_small.compute failed");
+	const CoarseSpace coarse(AtA_full, sizes_full, downscale_factor);
+	if (!coarse.ok()) {
 		return {};
 	}
-
-	VectorXr solution_small = solver_small.solve(Atb_small);
-
-	if (solver_small.info() != Eigen::Success) {
-		LOG_F(WARNING, "solver_small.solve failed");
-		return {};
-	}
-
-	VectorXr guess_full = VectorXr::Zero(Atb_full.size());
-	for (int full_i = 0; full_i < guess_full.size(); ++full_i) {
-		guess_full[full_i] = solution_small[as_small_index(full_i)];
-	}
-
-	return guess_full;
+	return coarse.solve(Atb_full);
 }
 
 /// Break the lattice into tiles, each tile_size^D big.
+/// Along the axes after the first `tile_dims` the tiles are only one lattice point thick,
+/// so the tiles of e.g. a space-time lattice are 3D blocks within one time slice.
 /// Each tile is solved separately, and the results are combined.
 /// The produces a result where the high frequency components are very accurate.
 VectorXr tile_solver(
@@ -209,24 +287,28 @@ VectorXr tile_solver(
 	const VectorXr&         Atb_full,
 	const VectorXr&         guess_full,
 	const std::vector<int>& sizes_full,
-	int                     tile_size)
+	int                     tile_size,
+	int                     tile_dims)
 {
 	LOG_SCOPE_F(INFO, "tile_solver");
 	CHECK_GE_F(tile_size, 2);
+	CHECK_GE_F(tile_dims, 1);
 	CHECK_EQ_F(guess_full.size(), Atb_full.size());
 
+	std::vector<int> tile_sizes; // Along each axis
 	std::vector<int> num_tiles;
 	int num_tiles_total = 1;
-	int unknowns_per_tile = 1; // tile_size^D
-	for (auto size : sizes_full) {
-		num_tiles.push_back((size + tile_size - 1) / tile_size);
+	int unknowns_per_tile = 1;
+	for (int d = 0; d < sizes_full.size(); ++d) {
+		tile_sizes.push_back(d < tile_dims ? tile_size : 1);
+		num_tiles.push_back((sizes_full[d] + tile_sizes[d] - 1) / tile_sizes[d]);
 		num_tiles_total *= num_tiles.back();
-		unknowns_per_tile *= tile_size;
+		unknowns_per_tile *= tile_sizes[d];
 	}
 
 	LOG_F(INFO, "num_tiles_total: %d", num_tiles_total);
 
-	const auto calc_tile_and_index = [=](int full_index) -> std::tuple<int, int> {
+	const auto calc_tile_and_index = [=](Index full_index) -> std::tuple<int, int> {
 		int tile_index = 0;
 		int index_in_tile = 0;
 		int tile_index_stride = 1;
@@ -234,15 +316,15 @@ VectorXr tile_solver(
 
 		for (int d = 0; d < sizes_full.size(); ++d) {
 			int full_x = full_index % sizes_full[d];
-			int tile_x = full_x / tile_size;
-			int x_in_tile = full_x % tile_size;
+			int tile_x = full_x / tile_sizes[d];
+			int x_in_tile = full_x % tile_sizes[d];
 
 			tile_index += tile_x * tile_index_stride;
 			index_in_tile += x_in_tile * index_in_tile_stride;
 
 			full_index /= sizes_full[d];
 			tile_index_stride *= num_tiles[d];
-			index_in_tile_stride *= tile_size;
+			index_in_tile_stride *= tile_sizes[d];
 		}
 
 		CHECK_GE_F(index_in_tile, 0);
@@ -251,147 +333,554 @@ VectorXr tile_solver(
 		return std::make_tuple(tile_index, index_in_tile);
 	};
 
-	struct Tile
-	{
-		std::vector<Eigen::Triplet<float>> triplets;
-		VectorXr                           rhs;
-	};
+	// The full index of a lattice point in a tile, or -1 for the parts of edge tiles outside the lattice.
+	const auto calc_full_index = [=](int tile_index, int index_in_tile) -> Index {
+		Index stride = 1;
+		Index full_index = 0;
+		for (int d = 0; d < sizes_full.size(); ++d) {
+			int tile_x = tile_index % num_tiles[d];
+			int x_in_tile = index_in_tile % tile_sizes[d];
+			int full_x = tile_x * tile_sizes[d] + x_in_tile;
 
-	std::vector<Tile> tiles(num_tiles_total);
-	for (int tile_index = 0; tile_index < num_tiles_total; ++tile_index) {
-		ERROR_CONTEXT("tile_index", tile_index);
-		tiles[tile_index].rhs = VectorXr::Zero(unknowns_per_tile);
+			if (full_x >= sizes_full[d]) { return -1; }
 
-		// Add small regularization, needed for edge tiles which extends outside of lattice:
-		for (int i = 0; i < unknowns_per_tile; ++i) {
-			tiles[tile_index].triplets.emplace_back(i, i, 1e-6f);
+			full_index += full_x * stride;
+			tile_index /= num_tiles[d];
+			index_in_tile /= tile_sizes[d];
+			stride *= sizes_full[d];
 		}
-	}
-
-	for (int full_index = 0; full_index < Atb_full.size(); ++full_index) {
-		ERROR_CONTEXT("full_index", full_index);
-		int tile_index, index_in_tile;
-		std::tie(tile_index, index_in_tile) = calc_tile_and_index(full_index);
-		tiles[tile_index].rhs[index_in_tile] = Atb_full[full_index];
-	}
-
-	for (int k=0; k < AtA_full.outerSize(); ++k) {
-		for (SparseMatrix::InnerIterator it(AtA_full, k); it; ++it) {
-			int row_tile, row_index;
-			int col_tile, col_index;
+		return full_index;
+	};
 
-			std::tie(row_tile, row_index) = calc_tile_and_index(it.row());
-			std::tie(col_tile, col_index) = calc_tile_and_index(it.col());
+	// Every lattice point is written below by the thread solving its tile.
+	// Consecutive tiles cover (roughly) consecutive memory, so with MemoryPlacement::kFirstTouch
+	// that thread also places the page, and the same split is used by downscale_solver.
+	VectorXr solution_full = placed_vector(Atb_full.size());
 
-			if (row_tile == col_tile) {
-				// Equation describing a relationship within the same tile
-				tiles[row_tile].triplets.emplace_back(row_index, col_index, it.value());
-			} else {
-				// Between two tiles. We can't connect them, so we substitute in the value from the initial guesses.
-				tiles[row_tile].rhs[row_index] -= it.value() * guess_full[it.col()];
-				tiles[col_tile].rhs[col_index] -= it.value() * guess_full[it.row()];
-			}
-		}
-	}
+	std::atomic<int> num_failures{0};
 
 	LOG_SCOPE_F(INFO, "solving tiles");
-	VectorXr solution_full = guess_full;
-
-	int num_failures = 0;
-
-	for (int tile_index = 0; tile_index < num_tiles_total; ++tile_index) {
-		const auto& tile = tiles[tile_index];
-		SparseMatrix A_tile(unknowns_per_tile, unknowns_per_tile);
-		A_tile.setFromTriplets(tile.triplets.begin(), tile.triplets.end());
-		A_tile.makeCompressed();
+	parallel_for_static(num_tiles_total, [&](size_t, size_t tiles_begin, size_t tiles_end) {
+		// Built by the thread solving the tile, so they are on the same NUMA node:
+		std::vector<Eigen::Triplet<float>> triplets;
+		VectorXr rhs(unknowns_per_tile);
+
+		for (size_t tile = tiles_begin; tile < tiles_end; ++tile) {
+			const int tile_index = tile;
+			ERROR_CONTEXT("tile_index", tile_index);
+			triplets.clear();
+
+			// AtA is symmetric, so column `full_index` holds all equations coupling it to other unknowns:
+			for (int index_in_tile = 0; index_in_tile < unknowns_per_tile; ++index_in_tile) {
+				// Add small regularization, needed for edge tiles which extends outside of lattice:
+				triplets.emplace_back(index_in_tile, index_in_tile, 1e-6f);
+				rhs[index_in_tile] = 0;
+
+				const Index full_index = calc_full_index(tile_index, index_in_tile);
+				if (full_index < 0) { continue; }
+				rhs[index_in_tile] = Atb_full[full_index];
+
+				for (SparseMatrix::InnerIterator it(AtA_full, full_index); it; ++it) {
+					int other_tile, other_index;
+					std::tie(other_tile, other_index) = calc_tile_and_index(it.row());
+
+					if (other_tile == tile_index) {
+						// Equation describing a relationship within the same tile
+						triplets.emplace_back(other_index, index_in_tile, it.value());
+					} else {
+						// Between two tiles. We can't connect them, so we substitute in the value from the initial guesses.
+						// The coupling is counted from both triangles of AtA (as when this was a scatter over all of AtA),
+						// which over-relaxes the guess and measurably improves the result.
+						rhs[index_in_tile] -= 2 * it.value() * guess_full[it.row()];
+					}
+				}
+			}
 
-		Eigen::SimplicialLLT<SparseMatrix> solver_tile(A_tile);
-		if (solver_tile.info() != Eigen::Success) { num_failures += 1; continue; }
-		VectorXr solution_tile = solver_tile.solve(tile.rhs);
-		if (solver_tile.info() != Eigen::Success) { num_failures += 1; continue; }
+			TileMatrix A_tile(unknowns_per_tile, unknowns_per_tile);
+			A_tile.setFromTriplets(triplets.begin(), triplets.end());
+			A_tile.makeCompressed();
 
-		CHECK_GE_F(solution_tile.size(), unknowns_per_tile);
+			Eigen::SimplicialLLT<TileMatrix> solver_tile(A_tile);
+			VectorXr solution_tile;
+			if (solver_tile.info() == Eigen::Success) {
+				solution_tile = solver_tile.solve(rhs);
+			}
+			const bool success = solver_tile.info() == Eigen::Success;
+			num_failures += success ? 0 : 1;
+
+			for (int index_in_tile = 0; index_in_tile < unknowns_per_tile; ++index_in_tile) {
+				const Index full_index = calc_full_index(tile_index, index_in_tile);
+				if (full_index >= 0) {
+					solution_full[full_index] = success ? solution_tile[index_in_tile] : guess_full[full_index];
+				}
+			}
+		}
+	});
 
-		for (int index_in_tile = 0; index_in_tile < solution_tile.size(); ++index_in_tile) {
-			int tile_index_copy = tile_index;
-			int index_in_tile_copy = index_in_tile;
-			int stride = 1;
-			int full_index = 0;
-			bool inside = true;
+	LOG_IF_F(WARNING, num_failures > 0, "%d/%d tiles failed", num_failures.load(), num_tiles_total);
 
-			for (int d = 0; d < sizes_full.size(); ++d) {
-				int tile_x = tile_index_copy % num_tiles[d];
-				int x_in_tile = index_in_tile_copy % tile_size;
-				int full_x = tile_x * tile_size + x_in_tile;
+	return solution_full;
+}
 
-				inside &= (full_x < sizes_full[d]);
+/// Conjugate gradient on the normal equations, starting from `guess`, saved to and resumed from `checkpoint` (optional).
+/// Returns an empty vector on failure.
+template<typename Preconditioner>
+VectorXr solve_cg(
+	const SparseMatrix&   AtA,
+	const VectorXr&       Atb,
+	VectorXr              guess,
+	const Preconditioner& preconditioner,
+	float                 error_tolerance,
+	CgCheckpoint*         checkpoint)
+{
+	LOG_SCOPE_F(INFO, "solveWithGuess");
+	// Eigen::BiCGSTAB<SparseMatrix> solver(AtA); // Fails
+	// Eigen::LeastSquaresConjugateGradient<SparseMatrix> solver(AtA); // Ringing
+	// Eigen::ConjugateGradient<SparseMatrix, Eigen::Lower, Preconditioner> solver(AtA); // Good, but can't checkpoint
+	Eigen::Index iterations = std::max<Eigen::Index>(2 * AtA.cols(), 1);
+	float error = error_tolerance;
+	checkpointed_conjugate_gradient(
+		AtA.selfadjointView<Eigen::Lower>(), Atb, &guess, preconditioner, &iterations, &error, checkpoint);
 
-				full_index += full_x * stride;
-				tile_index_copy /= num_tiles[d];
-				index_in_tile_copy /= tile_size;
-				stride *= sizes_full[d];
-			}
+	LOG_F(INFO, "CG iterations: %lu", iterations);
+	LOG_F(INFO, "CG error:      %f",  error);
 
-			if (inside) {
-				solution_full[full_index] = solution_tile[index_in_tile];
-			}
-		}
+	if (error > error_tolerance) {
+		LOG_F(WARNING, "CG did not converge");
+		return {};
 	}
 
-	LOG_IF_F(WARNING, num_failures > 0, "%d/%d tiles failed", num_failures, num_tiles_total);
-
-	return solution_full;
+	return guess;
 }
 
 std::vector<float> solve_sparse_linear_approximate_lattice(
-	const std::vector<Triplet>& triplets,
-	const std::vector<float>&   rhs,
-	const std::vector<int>&     sizes,
-	const SolveOptions&         options)
+	const LinearEquation&   eq,
+	const std::vector<int>& sizes,
+	const SolveOptions&     options)
 {
 	LOG_SCOPE_F(INFO, "solve_sparse_linear_approximate_lattice");
-	int num_unknowns = 1;
+	Index num_unknowns = 1;
 	for (auto size : sizes) { num_unknowns *= size; }
 
-	const SparseMatrix A = as_sparse_matrix(triplets, rhs.size(), num_unknowns);
-	const SparseMatrix AtA = make_square(A);
-	const VectorXr Atb = A.transpose() * as_eigen_vector(rhs);
+	return solve_normal_equation_approximate_lattice(
+		make_normal_equation(num_unknowns, eq), sizes, options);
+}
 
-	LOG_F(INFO, "A nnz:   %lu (%.3f%%)", A.nonZeros(),
-	      100.0f * A.nonZeros() / (A.rows() * A.cols()));
+std::vector<float> solve_normal_equation_approximate_lattice(
+	const NormalEquation&   normal,
+	const std::vector<int>& sizes,
+	const SolveOptions&     options)
+{
+	LOG_SCOPE_F(INFO, "solve_normal_equation_approximate_lattice");
+	const SparseMatrix& AtA = normal.AtA;
+	const VectorXr&     Atb = normal.Atb;
 
 	LOG_F(INFO, "AtA nnz: %lu (%.3f%%)", AtA.nonZeros(),
 	      100.0f * AtA.nonZeros() / (AtA.rows() * AtA.cols()));
 	// ------------------------------------------------------------------------
 
-	VectorXr guess = downscale_solver(AtA, Atb, sizes, options.downscale_factor);
+	// Kept around for the coarse corrections of the deflated CG:
+	const CoarseSpace coarse(AtA, sizes, options.downscale_factor);
+	if (!coarse.ok()) {
+		return {};
+	}
+
+	VectorXr guess;
+	{
+		LOG_SCOPE_F(INFO, "downscale_solver");
+		guess = coarse.solve(Atb);
+	}
 
 	if (guess.size() == 0) {
 		return {};
 	}
 
-	if (options.tile) {
-		guess = tile_solver(AtA, Atb, guess, sizes, options.tile_size);
+	// The CG state in a checkpoint is already past the tiles and smoothing:
+	std::unique_ptr<CgCheckpoint> checkpoint;
+	if (options.cg && !options.checkpoint_path.empty()) {
+		const uint64_t fingerprint = checkpoint_fingerprint(AtA, Atb, static_cast<uint64_t>(options.preconditioner));
+		checkpoint.reset(new CgCheckpoint(options.checkpoint_path, AtA.cols(), fingerprint, options.checkpoint_interval));
+	}
+	const bool resuming = checkpoint && checkpoint->can_resume();
+
+	if (options.tile && !resuming) {
+		guess = tile_solver(AtA, Atb, guess, sizes, options.tile_size, options.tile_dims);
+	}
+
+	if (options.smoothing_sweeps > 0 && !resuming) {
+		LOG_SCOPE_F(INFO, "smoothing");
+		const LatticeSmoother smoother(AtA, sizes);
+		smoother.smooth(options.smoother, Atb, &guess, options.smoothing_sweeps);
 	}
 
 	if (!options.cg) {
 		return as_std_vector(guess);
 	}
 
-	LOG_SCOPE_F(INFO, "solveWithGuess");
-	// Eigen::BiCGSTAB<SparseMatrix> solver(AtA); // Fails
-	// Eigen::LeastSquaresConjugateGradient<SparseMatrix> solver(AtA); // Ringing
-	Eigen::ConjugateGradient<SparseMatrix> solver(AtA); // Good
-	solver.setTolerance(options.error_tolerance);
-	const VectorXr solution = solver.solveWithGuess(Atb, guess);
+	VectorXr solution;
+	if (options.preconditioner == CgPreconditioner::kDeflation) {
+		LOG_SCOPE_F(INFO, "Deflated CG");
+		const DeflationPreconditioner preconditioner(AtA, coarse);
+		// The A-DEF2 deflation must start with the coarse error removed:
+		const VectorXr start = resuming ? guess : preconditioner.start_vector(Atb, guess);
+		solution = solve_cg(AtA, Atb, start, preconditioner, options.error_tolerance, checkpoint.get());
+	} else if (options.preconditioner == CgPreconditioner::kAmg) {
+		AmgPreconditioner preconditioner;
+		preconditioner.compute(AtA);
+		if (preconditioner.info() == Eigen::Success) {
+			solution = solve_cg(AtA, Atb, guess, preconditioner, options.error_tolerance, checkpoint.get());
+		}
+	} else {
+		Eigen::DiagonalPreconditioner<float> preconditioner;
+		preconditioner.compute(AtA);
+		solution = solve_cg(AtA, Atb, guess, preconditioner, options.error_tolerance, checkpoint.get());
+	}
 
-	LOG_F(INFO, "CG iterations: %lu", solver.iterations());
-	LOG_F(INFO, "CG error:      %f",  solver.error());
+	if (checkpoint) {
+		checkpoint->remove();
+	}
 
-	if (solver.info() != Eigen::Success) {
-		LOG_F(WARNING, "solver.solveWithGuess failed");
+	if (solution.size() == 0) {
 		return as_std_vector(guess);
 	}
 
 	return as_std_vector(solution);
 }
+
+/// The pinned values, with zeros for the free unknowns.
+VectorXr pinned_vector(const NormalEquation& normal, const PinnedValues& pinned)
+{
+	const Index num_unknowns = normal.Atb.size();
+	CHECK_EQ_F(pinned.mask.size(),   num_unknowns);
+	CHECK_EQ_F(pinned.values.size(), num_unknowns);
+	VectorXr x_pinned = VectorXr::Zero(num_unknowns);
+	for (Index i = 0; i < num_unknowns; ++i) {
+		if (pinned.mask[i]) { x_pinned[i] = pinned.values[i]; }
+	}
+	return x_pinned;
+}
+
+ReducedNormalEquation eliminate_pinned(const NormalEquation& normal, const PinnedValues& pinned)
+{
+	LOG_SCOPE_F(INFO, "eliminate_pinned");
+	const SparseMatrix& AtA = normal.AtA;
+	const VectorXr x_pinned = pinned_vector(normal, pinned);
+	const VectorXr rhs = normal.Atb - AtA.selfadjointView<Eigen::Lower>() * x_pinned;
+
+	ReducedNormalEquation reduced;
+	std::vector<Index> reduced_index(AtA.cols(), -1);
+	for (Index i = 0; i < AtA.cols(); ++i) {
+		if (!pinned.mask[i]) {
+			reduced_index[i] = reduced.free_unknowns.size();
+			reduced.free_unknowns.push_back(i);
+		}
+	}
+	const Index num_free = reduced.free_unknowns.size();
+	LOG_F(INFO, "%ld of %ld unknowns are free", static_cast<long>(num_free), static_cast<long>(AtA.cols()));
+
+	std::vector<Eigen::Triplet<float, Index>> triplets;
+	triplets.reserve(AtA.nonZeros());
+	for (Index col = 0; col < AtA.outerSize(); ++col) {
+		if (pinned.mask[col]) { continue; }
+		for (SparseMatrix::InnerIterator it(AtA, col); it; ++it) {
+			if (pinned.mask[it.row()]) { continue; }
+			triplets.emplace_back(reduced_index[it.row()], reduced_index[col], it.value());
+		}
+	}
+	reduced.normal.AtA.resize(num_free, num_free);
+	reduced.normal.AtA.setFromTriplets(triplets.begin(), triplets.end());
+	reduced.normal.AtA.makeCompressed();
+
+	reduced.normal.Atb.resize(num_free);
+	for (Index i = 0; i < num_free; ++i) {
+		reduced.normal.Atb[i] = rhs[reduced.free_unknowns[i]];
+	}
+	return reduced;
+}
+
+NormalEquation decouple_pinned(const NormalEquation& normal, const PinnedValues& pinned)
+{
+	LOG_SCOPE_F(INFO, "decouple_pinned");
+	const SparseMatrix& AtA = normal.AtA;
+	const VectorXr x_pinned = pinned_vector(normal, pinned);
+
+	NormalEquation decoupled;
+	decoupled.Atb = normal.Atb - AtA.selfadjointView<Eigen::Lower>() * x_pinned;
+
+	std::vector<Eigen::Triplet<float, Index>> triplets;
+	triplets.reserve(AtA.nonZeros());
+	for (Index col = 0; col < AtA.outerSize(); ++col) {
+		if (pinned.mask[col]) {
+			// Keep the diagonal, so that the scale of the row (and thus the Jacobi preconditioner) is unchanged.
+			// A zero right hand side keeps the pinned values out of the norm CG measures its convergence by:
+			const float diagonal = AtA.coeff(col, col) > 0 ? AtA.coeff(col, col) : 1.0f;
+			triplets.emplace_back(col, col, diagonal);
+			decoupled.Atb[col] = 0;
+			continue;
+		}
+		for (SparseMatrix::InnerIterator it(AtA, col); it; ++it) {
+			if (pinned.mask[it.row()]) { continue; }
+			triplets.emplace_back(it.row(), col, it.value());
+		}
+	}
+	decoupled.AtA.resize(AtA.rows(), AtA.cols());
+	decoupled.AtA.setFromTriplets(triplets.begin(), triplets.end());
+	decoupled.AtA.makeCompressed();
+	return decoupled;
+}
+
+std::vector<float> solve_pinned(
+	const NormalEquation&   normal,
+	const PinnedValues&     pinned,
+	const std::vector<int>& sizes,
+	const SolveOptions&     options)
+{
+	LOG_SCOPE_F(INFO, "solve_pinned");
+	const size_t num_unknowns = normal.Atb.size();
+	std::vector<float> solution;
+
+	if (sizes.empty()) {
+		const ReducedNormalEquation reduced = eliminate_pinned(normal, pinned);
+		solution = pinned.values;
+		if (!reduced.free_unknowns.empty()) {
+			const std::vector<float> free_solution = solve_normal_equation(reduced.normal);
+			if (free_solution.size() != reduced.free_unknowns.size()) { return {}; }
+			for (size_t i = 0; i < free_solution.size(); ++i) {
+				solution[reduced.free_unknowns[i]] = free_solution[i];
+			}
+		}
+	} else {
+		solution = solve_normal_equation_approximate_lattice(decouple_pinned(normal, pinned), sizes, options);
+		if (solution.size() != num_unknowns) { return {}; }
+		// The pinned unknowns were solved as zero:
+		for (size_t i = 0; i < num_unknowns; ++i) {
+			if (pinned.mask[i]) { solution[i] = pinned.values[i]; }
+		}
+	}
+
+	return solution;
+}
+
+std::vector<float> row_residuals(const LinearEquation& eq, const std::vector<float>& x)
+{
+	std::vector<float> residuals(eq.num_rows());
+	const size_t num_chunks = (eq.num_rows() + 4095) / 4096;
+	parallel_for_chunks(eq.num_rows(), num_chunks, [&](size_t, size_t begin, size_t end) {
+		for (size_t row = begin; row < end; ++row) {
+			float sum = -eq.rhs[row];
+			for (Index entry = eq.row_starts[row]; entry < eq.row_starts[row + 1]; ++entry) {
+				sum += eq.values[entry] * x[eq.cols[entry]];
+			}
+			residuals[row] = sum;
+		}
+	});
+	return residuals;
+}
+
+/// IRLS weight of each residual.
+std::vector<float> robust_weights(const std::vector<float>& residuals, const RobustOptions& options)
+{
+	float scale = options.scale;
+	if (scale <= 0 && !residuals.empty()) {
+		// Median absolute deviation, scaled to be consistent with the standard deviation for normal noise:
+		std::vector<float> abs_residuals(residuals.size());
+		for (size_t i = 0; i < residuals.size(); ++i) {
+			abs_residuals[i] = std::abs(residuals[i]);
+		}
+		auto median = abs_residuals.begin() + abs_residuals.size() / 2;
+		std::nth_element(abs_residuals.begin(), median, abs_residuals.end());
+		scale = 1.4826f * *median;
+	}
+	scale = std::max(scale, 1e-12f);
+
+	// Standard tuning constants, giving 95% efficiency for normal noise.
+	// The weights are kept above zero so that the sparsity pattern never changes.
+	const float kMinWeight = 1e-6f;
+	const float huber_k = 1.345f * scale;
+	const float tukey_c = 4.685f * scale;
+
+	std::vector<float> weights(residuals.size(), 1.0f);
+	for (size_t i = 0; i < residuals.size(); ++i) {
+		const float r = std::abs(residuals[i]);
+		if (options.loss == RobustLoss::kHuber) {
+			weights[i] = r <= huber_k ? 1.0f : huber_k / r;
+		} else if (options.loss == RobustLoss::kTukey) {
+			const float u = r / tukey_c;
+			weights[i] = u < 1 ? (1 - u * u) * (1 - u * u) : 0.0f;
+		}
+		weights[i] = std::max(weights[i], kMinWeight);
+	}
+	return weights;
+}
+
+/// (fixed + Aᵀ·W·A, fixed + Aᵀ·W·b) for a changing diagonal W, e.g. the row weights of IRLS.
+/// The sparsity pattern is built once. Each update only recomputes the values, in parallel over the
+/// columns of AtA: column c is the sum of w_r·a_rc·(row r) over the rows r touching c.
+/// This is the same work as the sparse product AᵀA, minus building and allocating its pattern.
+class WeightedNormalEquation
+{
+public:
+	/// `eq` and `fixed` (optional, may be null) must outlive this.
+	WeightedNormalEquation(Index num_columns, const LinearEquation& eq, const NormalEquation* fixed)
+		: _eq(eq)
+	{
+		LOG_SCOPE_F(INFO, "WeightedNormalEquation");
+		const auto A = as_sparse_matrix(eq, num_columns);
+		_A = A;
+		_normal.AtA = make_square(A);
+		_normal.Atb = VectorXr::Zero(num_columns);
+		if (fixed) {
+			CHECK_EQ_F(fixed->Atb.size(), num_columns);
+			_normal.AtA += fixed->AtA;
+			_normal.AtA.makeCompressed();
+
+			// fixed->AtA spread out over the (larger) pattern:
+			SparseMatrix spread = _normal.AtA;
+			spread.coeffs().setZero();
+			for (Index col = 0; col < fixed->AtA.outerSize(); ++col) {
+				for (SparseMatrix::InnerIterator it(fixed->AtA, col); it; ++it) {
+					spread.coeffRef(it.row(), it.col()) += it.value();
+				}
+			}
+			_fixed_values.assign(spread.valuePtr(), spread.valuePtr() + spread.nonZeros());
+			_fixed_Atb = fixed->Atb;
+			_has_fixed = true;
+		}
+	}
+
+	/// The normal equation with the given weight of each row of `eq`.
+	/// Always the same object, with the same pattern, so e.g. a symbolic factorization of it stays valid.
+	const NormalEquation& update(const std::vector<float>& row_weights)
+	{
+		CHECK_EQ_F(row_weights.size(), _eq.num_rows());
+		SparseMatrix& AtA = _normal.AtA;
+		const Index num_columns = AtA.cols();
+		const Index* outer = AtA.outerIndexPtr();
+		const Index* inner = AtA.innerIndexPtr();
+		float*       value = AtA.valuePtr();
+
+		// One chunk per thread, each with a table from row to its position in the current column.
+		// It covers the rows of all the columns of the chunk: for a lattice a bit more than the chunk itself.
+		parallel_for_chunks(num_columns, num_worker_threads(), [&](size_t, size_t begin, size_t end) {
+			if (begin == end) { return; }
+			Index lowest_row = num_columns, highest_row = 0;
+			for (size_t col = begin; col < end; ++col) {
+				if (outer[col] == outer[col + 1]) { continue; }
+				lowest_row  = std::min(lowest_row,  inner[outer[col]]);
+				highest_row = std::max(highest_row, inner[outer[col + 1] - 1]);
+			}
+			if (lowest_row > highest_row) { return; }
+			std::vector<Index> position_of_row(highest_row - lowest_row + 1);
+
+			for (size_t col = begin; col < end; ++col) {
+				for (Index i = outer[col]; i < outer[col + 1]; ++i) {
+					position_of_row[inner[i] - lowest_row] = i;
+					value[i] = _has_fixed ? _fixed_values[i] : 0.0f;
+				}
+				float Atb = _has_fixed ? _fixed_Atb[col] : 0.0f;
+
+				for (SparseMatrix::InnerIterator it(_A, col); it; ++it) {
+					const Index row = it.row();
+					const float weighted = row_weights[row] * it.value();
+					Atb += weighted * _eq.rhs[row];
+					for (Index entry = _eq.row_starts[row]; entry < _eq.row_starts[row + 1]; ++entry) {
+						value[position_of_row[_eq.cols[entry] - lowest_row]] += weighted * _eq.values[entry];
+					}
+				}
+				_normal.Atb[col] = Atb;
+			}
+		});
+		return _normal;
+	}
+
+private:
+	const LinearEquation& _eq;
+	SparseMatrix          _A;            ///< `eq` in column major order, for the rows touching each column.
+	NormalEquation        _normal;       ///< The pattern of fixed + AᵀA.
+	bool                  _has_fixed = false;
+	std::vector<float>    _fixed_values; ///< fixed->AtA in the pattern of _normal.AtA.
+	VectorXr              _fixed_Atb;
+};
+
+std::vector<float> solve_robust(
+	Index                   num_columns,
+	const LinearEquation&   eq,
+	const NormalEquation*   fixed,
+	const std::vector<int>& sizes,
+	const SolveOptions&     solve_options,
+	const RobustOptions&    robust_options,
+	std::vector<float>*     out_row_weights)
+{
+	LOG_SCOPE_F(INFO, "solve_robust");
+	const bool exact = sizes.empty();
+
+	std::vector<float> row_weights(eq.num_rows(), 1.0f);
+	WeightedNormalEquation weighted(num_columns, eq, fixed);
+	const NormalEquation& normal = weighted.update(row_weights);
+
+	Eigen::SimplicialLLT<SparseMatrix> direct_solver;
+	VectorXr x;
+
+	if (exact) {
+		direct_solver.analyzePattern(normal.AtA);
+		direct_solver.factorize(normal.AtA);
+		if (direct_solver.info() != Eigen::Success) {
+			LOG_F(WARNING, "solver.factorize failed");
+			return {};
+		}
+		x = direct_solver.solve(normal.Atb);
+	} else {
+		const std::vector<float> solution = solve_normal_equation_approximate_lattice(normal, sizes, solve_options);
+		if (solution.empty()) { return {}; }
+		x = as_eigen_vector(solution);
+	}
+
+	const int iterations = robust_options.loss == RobustLoss::kNone ? 0 : robust_options.iterations;
+
+	// The re-weighted lattice solves are CG warm-started from the previous solution, with one preconditioner
+	// for all of them. The AMG hierarchy is set up once and then only re-computed numerically.
+	// The deflation preconditioner would need a new coarse factorization each time, so it is replaced by Jacobi.
+	const bool use_amg = solve_options.preconditioner == CgPreconditioner::kAmg;
+	AmgPreconditioner                    amg;
+	Eigen::DiagonalPreconditioner<float> jacobi;
+
+	for (int iteration = 0; iteration < iterations; ++iteration) {
+		row_weights = robust_weights(row_residuals(eq, as_std_vector(x)), robust_options);
+		weighted.update(row_weights);
+
+		if (exact) {
+			// Same pattern, so only the numerical factorization needs redoing:
+			direct_solver.factorize(normal.AtA);
+			if (direct_solver.info() != Eigen::Success) {
+				LOG_F(WARNING, "solver.factorize failed");
+				break;
+			}
+			x = direct_solver.solve(normal.Atb);
+		} else {
+			VectorXr solution;
+			if (use_amg) {
+				if (iteration == 0) {
+					amg.analyzePattern(normal.AtA);
+				}
+				amg.factorize(normal.AtA);
+				if (amg.info() == Eigen::Success) {
+					solution = solve_cg(normal.AtA, normal.Atb, x, amg, solve_options.error_tolerance, nullptr);
+				}
+			} else {
+				jacobi.compute(normal.AtA);
+				solution = solve_cg(normal.AtA, normal.Atb, x, jacobi, solve_options.error_tolerance, nullptr);
+			}
+			if (solution.size() == 0) {
+				LOG_F(WARNING, "IRLS iteration %d did not converge", iteration);
+				break;
+			}
+			x = solution;
+		}
+	}
+
+	if (out_row_weights) {
+		*out_row_weights = std::move(row_weights);
+	}
+
+	return as_std_vector(x);
+}
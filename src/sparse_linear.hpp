@@ -1,45 +1,237 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
 #include <vector>
 
-struct Triplet
+#include <Eigen/SparseCore>
+
+/// Index type for unknowns and non-zero entries.
+/// 32-bit indices use less memory bandwidth, but limits the system to 2^31 unknowns and 2^31 non-zeros.
+/// Build with -DFIELD_INTERPOLATION_64BIT_INDEX=1 for systems larger than that.
+#if FIELD_INTERPOLATION_64BIT_INDEX
+	using Index = int64_t;
+#else
+	using Index = int32_t;
+#endif
+
+/// Size of a LinearEquation, e.g. to reserve memory up front.
+struct EquationCapacity
 {
-	int row, col;
-	float value;
+	size_t rows     = 0;
+	size_t nonzeros = 0;
+};
+
+/// Sparse Ax=b, where A is stored row by row (compressed sparse row format) and `rhs` is b.
+/// The entries of row `r` are at [row_starts[r], row_starts[r + 1]) in `cols` and `values`.
+/// Rows are always added at the end, so the row of each entry is implicit.
+struct LinearEquation
+{
+	std::vector<Index> row_starts{0}; ///< One per row, plus one past the end.
+	std::vector<Index> cols;          ///< Column of each non-zero entry, sorted within each row.
+	std::vector<float> values;        ///< Value of each non-zero entry.
+	std::vector<float> rhs;           ///< One per row.
+
+	size_t num_rows()     const { return rhs.size();    }
+	size_t num_nonzeros() const { return values.size(); }
+
+	/// Make room for this many more rows and non-zeros, so that adding them won't reallocate.
+	void reserve_additional(const EquationCapacity& additional);
 
-	Triplet() {}
-	Triplet(int row_, int col_, float value_) : row(row_), col(col_), value(value_) {}
+	/// In bytes.
+	size_t allocated_bytes() const;
+
+	/// Add a value to the row being built. Call end_row when the row is complete.
+	void add_entry(Index col, float value)
+	{
+		cols.push_back(col);
+		values.push_back(value);
+	}
+
+	/// Finish the row built with add_entry.
+	/// Entries are sorted by column, and duplicate columns are summed.
+	void end_row(float row_rhs);
 };
 
+/// Recycles the memory of LinearEquation:s, e.g. between solves in a long-running service,
+/// so that a steady stream of similar systems does not keep allocating and freeing huge buffers.
+/// Thread safe.
+class EquationPool
+{
+public:
+	/// Keep at most this many equations around.
+	explicit EquationPool(size_t max_equations = 4) : _max_equations(max_equations) {}
+
+	/// An empty equation with room for at least `capacity`.
+	/// Re-uses the smallest pooled equation large enough, else grows the largest one.
+	LinearEquation acquire(const EquationCapacity& capacity);
+
+	/// Give back an equation no longer needed. It is cleared, but its memory is kept for the next acquire.
+	void release(LinearEquation&& eq);
+
+	/// Memory held by the pool, in bytes.
+	size_t pooled_bytes() const;
+
+private:
+	size_t                      _max_equations;
+	mutable std::mutex          _mutex;
+	std::vector<LinearEquation> _equations;
+};
+
+using VectorXr = Eigen::Matrix<float, Eigen::Dynamic, 1>;
+using SparseMatrix = Eigen::SparseMatrix<float, Eigen::ColMajor, Index>;
+
+/// An uninitialized lattice-sized vector, with its pages placed according to memory_placement() (see parallel.hpp).
+/// With MemoryPlacement::kFirstTouch, fill it using parallel_for_static.
+VectorXr placed_vector(Index size);
+
+/// The normal equations  AtA * x = Atb  of the least squares problem  A * x = b.
+/// These are what the solvers actually solve.
+/// The normal equations of two sets of equations over the same unknowns can be summed.
+struct NormalEquation
+{
+	SparseMatrix AtA;
+	VectorXr     Atb;
+};
+
+/// `num_columns` == number of unknowns
+NormalEquation make_normal_equation(Index num_columns, const LinearEquation& eq);
+
+/// sum += term
+void add_normal_equation(NormalEquation* sum, const NormalEquation& term);
+
 /// Solve a sparse linear least squared problem.
-/// Construct matrix A from triplets. Solve for x in  A * x = rhs.
-/// `rows` == `rhs.size()`.
+/// Solve for x in  A * x = rhs.
 /// `num_columns` == number of unknowns
-/// Duplicate elements in triplets will be summed.
 std::vector<float> solve_sparse_linear(
-	int                         num_columns,
-	const std::vector<Triplet>& triplets,
-	const std::vector<float>&   rhs);
+	Index                 num_columns,
+	const LinearEquation& eq);
 
 /// Least square solving for x in Ax = rhs.
 /// `guess` is a starting guess for x.
 std::vector<float> solve_sparse_linear_with_guess(
-	const std::vector<Triplet>& triplets,
-	const std::vector<float>&   rhs,
-	const std::vector<float>&   guess,
-	float                       error_tolerance);
+	const LinearEquation&     eq,
+	const std::vector<float>& guess,
+	float                     error_tolerance);
+
+/// See LatticeSmoother.
+enum class Smoother
+{
+	kGaussSeidel, ///< Multi-color (red-black when possible) symmetric Gauss–Seidel.
+	kChebyshev,   ///< Chebyshev polynomial in the Jacobi preconditioned operator.
+};
+
+/// Of the conjugate gradient stage.
+enum class CgPreconditioner
+{
+	kDiagonal,  ///< Jacobi. Cheap, but the number of iterations grows with the lattice resolution.
+	kAmg,       ///< Smoothed aggregation algebraic multigrid (see AmgPreconditioner). Expensive setup, few iterations.
+	kDeflation, ///< Jacobi plus a coarse correction from the downscale_solver lattice every iteration (see DeflationPreconditioner).
+};
 
 struct SolveOptions
 {
-	int   downscale_factor =  2;
-	bool  tile             = true;
-	int   tile_size        = 16;
-	bool  cg               = true;
-	float error_tolerance  =  1e-3f;
+	int              downscale_factor =  2;
+	bool             tile             = true;
+	int              tile_size        = 16;
+	int              tile_dims        =  3; ///< Tiles are one lattice point thick along the axes after this many, e.g. one time step of a space-time lattice.
+	int              smoothing_sweeps =  0; ///< Smoother sweeps after the tile solver: a cheap polish, in place of or before the CG.
+	Smoother         smoother         = Smoother::kGaussSeidel;
+	bool             cg               = true;
+	CgPreconditioner preconditioner   = CgPreconditioner::kDiagonal;
+	float            error_tolerance  =  1e-3f;
+
+	/// If set, the CG state is saved to this file every `checkpoint_interval` seconds (see CgCheckpoint).
+	/// A later solve of the same system resumes from it, skipping the stages before the CG.
+	/// The file is deleted once the CG is done.
+	std::string      checkpoint_path;
+	float            checkpoint_interval = 60;
 };
 
 std::vector<float> solve_sparse_linear_approximate_lattice(
-	const std::vector<Triplet>& triplets,
-	const std::vector<float>&   rhs,
-	const std::vector<int>&     sizes_full,
-	const SolveOptions&         options);
+	const LinearEquation&   eq,
+	const std::vector<int>& sizes_full,
+	const SolveOptions&     options);
+
+/// Solve the normal equations exactly.
+std::vector<float> solve_normal_equation(const NormalEquation& normal);
+
+/// Like solve_sparse_linear_approximate_lattice, but for already formed normal equations.
+std::vector<float> solve_normal_equation_approximate_lattice(
+	const NormalEquation&   normal,
+	const std::vector<int>& sizes_full,
+	const SolveOptions&     options);
+
+/// Unknowns held at given values while solving for the rest, e.g. the boundary of a tile taken from its
+/// already solved neighbors, or the part of a field outside the region being re-solved.
+/// Unlike value constraints with a huge weight this does not hurt the conditioning of the system.
+struct PinnedValues
+{
+	std::vector<bool>  mask;   ///< mask[i] == unknown `i` is pinned. One per unknown.
+	std::vector<float> values; ///< values[i] is the value of unknown `i` if it is pinned. One per unknown.
+};
+
+/// The normal equations of the free unknowns only:  AtA_ff * x_f = Atb_f - AtA_fp * x_p
+struct ReducedNormalEquation
+{
+	NormalEquation     normal;
+	std::vector<Index> free_unknowns; ///< free_unknowns[i] is the unknown of the full system which is unknown `i` here.
+};
+
+/// Eliminate the pinned unknowns, moving their contribution to the right hand side.
+ReducedNormalEquation eliminate_pinned(const NormalEquation& normal, const PinnedValues& pinned);
+
+/// Like eliminate_pinned, but keeps all unknowns, so that the lattice layout is kept for the lattice solvers.
+/// The pinned columns are moved to the right hand side, and each pinned row is left with only its diagonal
+/// and a zero right hand side. The pinned unknowns are thus decoupled from the free ones, which see exactly
+/// the system eliminate_pinned gives. The solution has zeros for the pinned unknowns.
+NormalEquation decouple_pinned(const NormalEquation& normal, const PinnedValues& pinned);
+
+/// Solve with the pinned unknowns held at their values:
+///   If `sizes` is empty the pinned unknowns are eliminated, and the free ones solved exactly.
+///   Else the pinned unknowns are decoupled and solve_normal_equation_approximate_lattice is used.
+/// The pinned unknowns of the solution are exactly their values. Returns an empty vector on failure.
+std::vector<float> solve_pinned(
+	const NormalEquation&   normal,
+	const PinnedValues&     pinned,
+	const std::vector<int>& sizes,
+	const SolveOptions&     options);
+
+/// Returns A * x - b, one residual per row.
+std::vector<float> row_residuals(const LinearEquation& eq, const std::vector<float>& x);
+
+/// Loss functions for robust least squares.
+enum class RobustLoss
+{
+	kNone,  ///< Plain least squares.
+	kHuber, ///< Quadratic for small residuals, linear for large ones.
+	kTukey, ///< Tukey's biweight: residuals beyond the cutoff are ignored completely.
+};
+
+struct RobustOptions
+{
+	RobustLoss loss       = RobustLoss::kNone;
+	float      scale      = 0; ///< Scale of the inlier residuals. 0 means estimate it from the median residual.
+	int        iterations = 4; ///< Number of re-weighted solves after the first, plain one.
+};
+
+/// Robust least squares using iteratively reweighted least squares (IRLS).
+/// Each iteration, the rows in `eq` are re-weighted by the loss function of their residuals.
+/// The equations in `fixed` (e.g. the model) are not re-weighted. `fixed` may be null.
+/// The sparsity pattern stays the same between iterations, so it is built once, and each iteration
+/// only re-computes the values of the normal equations from the new row weights. Then:
+///   If `sizes` is empty all solves are exact, and re-use the symbolic factorization of the first.
+///   Else the first solve uses solve_normal_equation_approximate_lattice, and the rest are
+///   conjugate gradient warm-started from the previous solution, sharing one preconditioner:
+///   AMG if solve_options.preconditioner is kAmg (only re-computed numerically), else Jacobi.
+/// `out_row_weights` will receive the final weight of each row of `eq`. Optional (may be null).
+std::vector<float> solve_robust(
+	Index                   num_columns,
+	const LinearEquation&   eq,
+	const NormalEquation*   fixed,
+	const std::vector<int>& sizes,
+	const SolveOptions&     solve_options,
+	const RobustOptions&    robust_options,
+	std::vector<float>*     out_row_weights);